@@ -0,0 +1,232 @@
+/* cache.c: In-Memory File Cache */
+
+#include "mainServer.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+
+#include <unistd.h>
+
+#define CACHE_BUCKETS   1024    /* Hash table size (power of two) */
+
+/**
+ * Cached file: precomputed response headers followed by file contents.
+ **/
+struct cache_entry {
+    struct lru_node node;       /* Table links, keyed by path (must be first) */
+    char   *path;               /* Resolved path (from determine_request_path) */
+    char   *data;               /* Headers and contents */
+    size_t  ndata;
+    size_t  size;               /* Bytes charged against CacheSize */
+};
+
+/* Cache state (shared by all threads, protected by CacheLock) */
+
+static pthread_mutex_t     CacheLock    = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t      CacheOnce    = PTHREAD_ONCE_INIT;
+static struct lru_node    *CacheBuckets[CACHE_BUCKETS];
+static struct lru          CacheTable   = {.buckets = CacheBuckets, .nbuckets = CACHE_BUCKETS};
+static size_t              CacheUsed    = 0;
+
+/* Statistics */
+
+static size_t CacheHits      = 0;
+static size_t CacheMisses    = 0;
+static size_t CacheEvictions = 0;
+
+/**
+ * Remove entry from cache and deallocate it (CacheLock must be held).
+ **/
+static void
+cache_remove(struct cache_entry *e)
+{
+    lru_remove(&CacheTable, &e->node);
+    CacheUsed -= e->size;
+
+    free(e->path);
+    free(e->data);
+    free(e);
+}
+
+/**
+ * Invalidate cached files at or below changed path (watch handler).
+ **/
+static void
+cache_invalidate(const char *path)
+{
+    size_t length = path ? strlen(path) : 0;
+
+    pthread_mutex_lock(&CacheLock);
+    for (struct cache_entry *e = (struct cache_entry *)CacheTable.head, *next; e; e = next) {
+        next = (struct cache_entry *)e->node.next;
+        if (!path || (strncmp(e->path, path, length) == 0 &&
+                      (e->path[length] == '\0' || e->path[length] == '/'))) {
+            debug("Invalidating cached file %s", e->path);
+            cache_remove(e);
+        }
+    }
+    pthread_mutex_unlock(&CacheLock);
+}
+
+/**
+ * Drop every cached file.
+ **/
+void
+cache_flush(void)
+{
+    cache_invalidate(NULL);
+}
+
+/**
+ * Subscribe to filesystem changes (once).
+ **/
+static void
+cache_init(void)
+{
+    watch_subscribe(cache_invalidate);
+}
+
+/**
+ * Serve file from cache.
+ *
+ * If the request path is cached, this writes the OK status line followed by
+ * the cached headers and contents to the response and returns true.
+ * Otherwise it starts watching the file's directory (so changes made while
+ * the caller reads the file are noticed) and returns false.
+ *
+ * Pending change notifications are processed first, so modified files are
+ * never served from the cache.
+ **/
+bool
+cache_lookup(struct request *r)
+{
+    struct cache_entry *e;
+
+    pthread_once(&CacheOnce, cache_init);
+    watch_poll();
+
+    pthread_mutex_lock(&CacheLock);
+    e = (struct cache_entry *)lru_find(&CacheTable, r->path);
+    if (e) {
+        CacheHits++;
+        lru_touch(&CacheTable, &e->node);
+        handle_status(r, HTTP_STATUS_OK);
+        fwrite(e->data, 1, e->ndata, r->file);
+    } else {
+        CacheMisses++;
+    }
+    pthread_mutex_unlock(&CacheLock);
+
+    if (!e) {
+        watch_parent(r->path);
+    }
+    return e != NULL;
+}
+
+/**
+ * Add file to cache, taking ownership of data (headers followed by contents).
+ *
+ * Least recently used entries are evicted until the entry fits in CacheSize
+ * bytes.  Files whose directory cannot be watched are not cached.
+ **/
+void
+cache_insert(const char *path, char *data, size_t ndata)
+{
+    struct cache_entry *e;
+    size_t size = sizeof(struct cache_entry) + strlen(path) + 1 + ndata;
+
+    if (size > CacheSize || watch_parent(path) < 0) {
+        free(data);
+        return;
+    }
+
+    e = calloc(1, sizeof(struct cache_entry));
+    if (!e || !(e->path = strdup(path))) {
+        free(e);
+        free(data);
+        return;
+    }
+    e->node.key = e->path;
+    e->data     = data;
+    e->ndata    = ndata;
+    e->size     = size;
+
+    pthread_mutex_lock(&CacheLock);
+
+    /* Replace any existing entry (another thread may have raced us) */
+    struct cache_entry *old = (struct cache_entry *)lru_find(&CacheTable, path);
+    if (old) {
+        cache_remove(old);
+    }
+
+    /* Evict least recently used entries until there is room */
+    while (CacheTable.head && CacheUsed + size > CacheSize) {
+        struct cache_entry *lru = (struct cache_entry *)CacheTable.head;
+        debug("Evicting cached file %s", lru->path);
+        cache_remove(lru);
+        CacheEvictions++;
+    }
+
+    lru_insert(&CacheTable, &e->node);
+    CacheUsed += size;
+
+    pthread_mutex_unlock(&CacheLock);
+}
+
+/**
+ * Format unsigned number into buffer, returning pointer past its end.
+ **/
+static char *
+cache_format(char *p, size_t n)
+{
+    char digits[32];
+    int  ndigits = 0;
+
+    do {
+        digits[ndigits++] = '0' + n % 10;
+        n /= 10;
+    } while (n > 0);
+
+    while (ndigits > 0) {
+        *p++ = digits[--ndigits];
+    }
+    return p;
+}
+
+/**
+ * Write cache statistics to stderr (SIGUSR1 handler).
+ *
+ * Only async-signal-safe functions are used, so this may interrupt anything;
+ * the counters are read without locking and may be slightly stale.
+ **/
+void
+cache_report(int signum)
+{
+    int saved_errno = errno;
+    char buffer[256];
+    char *p = buffer;
+
+    (void)signum;
+
+    struct { const char *label; size_t *value; } stats[] = {
+        {"[cache] hits=",      &CacheHits},
+        {" misses=",           &CacheMisses},
+        {" evictions=",        &CacheEvictions},
+        {" bytes=",            &CacheUsed},
+    };
+
+    for (size_t i = 0; i < sizeof(stats) / sizeof(stats[0]); i++) {
+        size_t length = strlen(stats[i].label);
+        memcpy(p, stats[i].label, length);
+        p = cache_format(p + length, __atomic_load_n(stats[i].value, __ATOMIC_RELAXED));
+    }
+    *p++ = '\n';
+
+    if (write(STDERR_FILENO, buffer, p - buffer) < 0) {
+        /* Nothing useful to do */
+    }
+    errno = saved_errno;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,327 @@
+/* event.c: Event-Driven HTTP Server */
+
+#include "mainServer.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#define EVENT_MAX   256     /* Maximum events returned by one epoll_wait */
+
+/**
+ * Put file descriptor into non-blocking mode.
+ **/
+static int
+set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) {
+        return -1;
+    }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/**
+ * Connections ordered by last activity (oldest first), for expiring idle
+ * connections in constant time per event.
+ **/
+struct idle_list {
+    struct request *head;
+    struct request *tail;
+    struct request *closed;     /* Closed connections, freed after each batch of events */
+};
+
+/**
+ * Remove connection from idle list (if it is on it).
+ **/
+static void
+idle_remove(struct idle_list *l, struct request *r)
+{
+    if (!r->prev && !r->next && l->head != r) {
+        return;
+    }
+    if (r->prev) r->prev->next = r->next; else l->head = r->next;
+    if (r->next) r->next->prev = r->prev; else l->tail = r->prev;
+    r->prev = r->next = NULL;
+}
+
+/**
+ * Mark connection as active now by moving it to the end of the idle list.
+ **/
+static void
+idle_touch(struct idle_list *l, struct request *r, time_t now)
+{
+    if (l->tail != r) {
+        idle_remove(l, r);
+        r->prev = l->tail;
+        r->next = NULL;
+        if (l->tail) l->tail->next = r; else l->head = r;
+        l->tail = r;
+    }
+    r->active = now;
+}
+
+/**
+ * Remove connection from epoll set and idle list, and mark it closed.
+ *
+ * A connection waiting for its script can have several events in the batch
+ * being dispatched, so the request is only freed (which also closes its
+ * pipes, taking them out of the epoll set) once the batch is done (see
+ * event_free).
+ **/
+static void
+event_close(int efd, struct idle_list *l, struct request *r)
+{
+    epoll_ctl(efd, EPOLL_CTL_DEL, r->fd, NULL);
+    idle_remove(l, r);
+    r->state  = REQUEST_CLOSED;
+    r->next   = l->closed;
+    l->closed = r;
+}
+
+/**
+ * Free connections closed during the last batch of events.
+ **/
+static void
+event_free(struct idle_list *l)
+{
+    while (l->closed) {
+        struct request *next = l->closed->next;
+        free_request(l->closed);
+        l->closed = next;
+    }
+}
+
+/**
+ * Close connections that have been idle for KeepAliveTimeout seconds
+ * (connections waiting on their script, worker, or micro-cache entry are
+ * not on the idle list; see event_pipe).
+ **/
+static void
+event_expire(int efd, struct idle_list *l, time_t now)
+{
+    while (l->head && now - l->head->active >= KeepAliveTimeout) {
+        debug("Closing idle connection from %s:%s", l->head->host, l->head->port);
+        event_close(efd, l, l->head);
+    }
+}
+
+/**
+ * Accept all pending connections on server socket.
+ *
+ * Each connection is made non-blocking and registered for input.
+ **/
+static void
+event_accept(int efd, int sfd, struct idle_list *l, time_t now)
+{
+    struct request *r;
+    struct epoll_event ev;
+
+    while ((r = accept_request(sfd))) {
+        if (set_nonblocking(r->fd) < 0) {
+            free_request(r);
+            continue;
+        }
+
+        r->events   = EPOLLIN;
+        ev.events   = r->events;
+        ev.data.ptr = r;
+        if (epoll_ctl(efd, EPOLL_CTL_ADD, r->fd, &ev) < 0) {
+            free_request(r);
+            continue;
+        }
+        idle_touch(l, r, now);
+    }
+}
+
+/**
+ * Register connection's socket for events (none takes it out of the epoll
+ * set).
+ **/
+static int
+event_socket(int efd, struct request *r, uint32_t events)
+{
+    struct epoll_event ev;
+    int op = !events ? EPOLL_CTL_DEL : r->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+
+    if (events == r->events) {
+        return 0;
+    }
+    r->events   = events;
+    ev.events   = events;
+    ev.data.ptr = r;
+    return epoll_ctl(efd, op, r->fd, &ev);
+}
+
+/**
+ * Wait for the connection's script instead of (or besides) its socket: for
+ * output from its response pipe, and for room in its input pipe or more of
+ * the request body (or for another request's run of the script; see
+ * request_waits).
+ *
+ * Pipes are registered one-shot, so they report at most one event each
+ * until they are registered again.  Unless the client's socket is among the
+ * waits, the connection is waiting on the server's side (a script, worker,
+ * or micro-cache entry), not on the client, so it is taken off the idle
+ * list until its next event and is not expired however long that takes.
+ **/
+static void
+event_pipe(int efd, struct idle_list *l, struct request *r)
+{
+    struct pollfd waits[2];
+    struct epoll_event ev;
+    uint32_t events = 0;
+    size_t n = request_waits(r, waits);
+
+    for (size_t i = 0; i < n; i++) {
+        if (waits[i].fd == r->fd) {
+            events = EPOLLIN;
+            continue;
+        }
+
+        ev.events   = (waits[i].events == POLLIN ? EPOLLIN : EPOLLOUT) | EPOLLONESHOT;
+        ev.data.ptr = r;
+        if (epoll_ctl(efd, EPOLL_CTL_MOD, waits[i].fd, &ev) < 0 &&
+            (errno != ENOENT || epoll_ctl(efd, EPOLL_CTL_ADD, waits[i].fd, &ev) < 0)) {
+            event_close(efd, l, r);
+            return;
+        }
+    }
+
+    if (!events) {
+        idle_remove(l, r);
+    }
+    if (event_socket(efd, r, events) < 0) {
+        event_close(efd, l, r);
+    }
+}
+
+/**
+ * Advance connection state machine.
+ *
+ *  REQUEST_READING: Read request head until complete, then parse, resolve,
+ *                   and handle it plus any pipelined requests already
+ *                   buffered (which queues their responses).
+ *  REQUEST_WRITING: Write queued response (and script output as it comes)
+ *                   until done, then either close the connection or reset
+ *                   it for the next request.
+ *
+ * Whenever the socket would block, the connection is (re)registered for the
+ * matching event and control returns to the event loop.  While waiting for
+ * its script, the pipes are registered instead (see event_pipe), and the
+ * socket only if the request body is to be read from it.
+ **/
+static void
+event_handle(int efd, struct idle_list *l, struct request *r, time_t now)
+{
+    uint32_t events;
+    int status;
+
+    if (r->state == REQUEST_CLOSED) {
+        return;
+    }
+    idle_touch(l, r, now);
+
+    while (true) {
+        if (r->state == REQUEST_READING) {
+            status = read_request(r);
+            if (status == 0) {
+                events = EPOLLIN;
+                break;
+            }
+            if (status < 0 && r->nbuffer == r->start) {
+                event_close(efd, l, r);
+                return;
+            }
+
+            /* Parse, resolve, and handle request and any pipelined behind it
+             * (errors produce a response) */
+            handle_pipeline(r);
+            r->state = REQUEST_WRITING;
+        }
+
+        status = write_response(r);
+        if (status == 1) {
+            events = EPOLLOUT;
+            break;
+        }
+        if (status == 2) {
+            event_pipe(efd, l, r);
+            return;
+        }
+        if (status < 0 || !r->keepalive) {
+            event_close(efd, l, r);
+            return;
+        }
+        reset_request(r);
+    }
+
+    /* Wait for socket to become ready */
+    if (event_socket(efd, r, events) < 0) {
+        event_close(efd, l, r);
+    }
+}
+
+/**
+ * Handle HTTP requests from a single process using non-blocking sockets.
+ *
+ * Every connection is a small state machine (see event_handle) driven by
+ * epoll, so slow or idle clients never block the rest of the server.
+ * Connections without activity for KeepAliveTimeout seconds are closed.
+ **/
+void
+event_server(int sfd)
+{
+    struct epoll_event ev;
+    struct epoll_event events[EVENT_MAX];
+    struct idle_list idle = {NULL, NULL, NULL};
+    int efd;
+
+    /* Create epoll instance and register server socket */
+    efd = epoll_create1(EPOLL_CLOEXEC);
+    if (efd < 0) {
+        fatal("Unable to create epoll instance: %s", strerror(errno));
+    }
+
+    if (set_nonblocking(sfd) < 0) {
+        fatal("Unable to make server socket non-blocking: %s", strerror(errno));
+    }
+
+    ev.events   = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(efd, EPOLL_CTL_ADD, sfd, &ev) < 0) {
+        fatal("Unable to register server socket: %s", strerror(errno));
+    }
+
+    /* Dispatch events */
+    while (true) {
+        int n = epoll_wait(efd, events, EVENT_MAX, idle.head ? 1000 : -1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+
+        time_t now = time(NULL);
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == NULL) {
+                event_accept(efd, sfd, &idle, now);
+            } else {
+                event_handle(efd, &idle, events[i].data.ptr, now);
+            }
+        }
+
+        event_expire(efd, &idle, now);
+        event_free(&idle);
+    }
+
+    /* Close epoll instance and server socket */
+    close(efd);
+    close(sfd);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
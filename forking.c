@@ -35,16 +35,20 @@ forking_server(int sfd)
 	/* Ignore children */
         signal(SIGCHLD, SIG_IGN);
 
+	/* Apply any requested mimetypes reload once, before children inherit it */
+        load_mimetypes();
+
 	/* Fork off child process to handle request */
         pid = fork();
         if (pid < 0) {
             // Fork failed: send 500 and clean up in parent 
             handle_error(request, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+            write_response(request);
             free_request(request);
             continue;
         } else if (pid == 0) {
-            // Child handles the request 
-            handle_request(request);
+            // Child handles the requests on the connection 
+            handle_connection(request);
             free_request(request);
             _exit(0);
         } else {
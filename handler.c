@@ -3,242 +3,1544 @@
 #include "mainServer.h"
 #include <errno.h>
 #include <limits.h>
+#include <signal.h>
 #include <string.h>
 
 #include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 /* Internal Declarations */
+static void write_status(struct request *request, const char *status);
 http_status handle_browse_request(struct request *request);
-http_status handle_file_request(struct request *request);
-http_status handle_cgi_request(struct request *request);
+http_status handle_file_request(struct request *request, struct open_file *file);
+http_status handle_plugin_request(struct request *request, const struct plugin *plugin);
 http_status handle_error(struct request *request, http_status status);
 
+/**
+ * Handle HTTP Connection
+ *
+ * This handles requests on a (blocking) client connection until either side
+ * closes it: each request is handled and its response written before the
+ * next one is read.  Idle connections are dropped once reads time out after
+ * KeepAliveTimeout seconds (see accept_request), and so are clients that
+ * send no more of a request body for as long.  Scripts, workers, and
+ * micro-cache entries are waited for however long they take.
+ **/
+void
+handle_connection(struct request *r)
+{
+    struct pollfd waits[2];
+    int status;
+
+    while (true) {
+        /* Wait for request, silently closing idle or closed connections */
+        if (read_request(r) <= 0 && r->nbuffer == r->start) {
+            break;
+        }
+
+        /* Handle request(s) and write response(s), waiting for script
+         * output and request body as needed */
+        handle_pipeline(r);
+        while ((status = write_response(r)) == 2) {
+            size_t n = request_waits(r, waits);
+            int timeout = -1;
+            for (size_t i = 0; i < n; i++) {
+                if (waits[i].fd == r->fd) {
+                    timeout = KeepAliveTimeout * 1000;
+                }
+            }
+
+            int ready = poll(waits, n, timeout);
+            if (ready == 0 || (ready < 0 && errno != EINTR)) {
+                break;
+            }
+        }
+        if (status != 0 || !r->keepalive) {
+            break;
+        }
+
+        /* Prepare for next request */
+        reset_request(r);
+    }
+}
+
+/**
+ * Handle Pipelined HTTP Requests
+ *
+ * This handles the buffered request and then, as long as the connection
+ * stays open, any further requests the client already sent behind it.
+ * Their responses accumulate in the response stream so they can be written
+ * together; batching stops at a response with body file ranges or pipe
+ * output still to stream (or another request's script run or a persistent
+ * worker to wait for), at a request whose body is still to be read, or once
+ * RESPONSE_BATCH bytes are buffered.
+ **/
+void
+handle_pipeline(struct request *r)
+{
+    handle_request(r);
+
+    while (r->keepalive && r->nranges == 0 && r->pipe_fd < 0 && r->cache_fd < 0 && !r->worker &&
+           r->worker_fd < 0 && r->body == BODY_NONE && ftello(r->file) < RESPONSE_BATCH && buffered_request(r)) {
+        reset_request(r);
+        handle_request(r);
+    }
+}
+
+/**
+ * Return whether client waits for a 100 Continue response before sending
+ * the request body.
+ **/
+static bool
+expects_continue(struct request *r)
+{
+    const char *expect = request_known_header(r, HEADER_EXPECT);
+
+    return expect && strcasecmp(expect, "100-continue") == 0 && streq(r->version, "HTTP/1.1");
+}
+
+/**
+ * Give up on request body without reading it, closing the connection after
+ * the response instead (as whatever the client sends next is unknown).
+ **/
+static void
+refuse_body(struct request *r)
+{
+    r->keepalive = false;
+    r->body      = BODY_NONE;
+}
+
+/**
+ * Cut response written from mark on back to its head, for HEAD requests:
+ * handlers answer them like GET (so the head is the same, Content-Length
+ * included), and the body is dropped here in one place, along with any
+ * body ranges queued for it.  Script output is left out by
+ * handle_cgi_head already, so its head is all there is to find.
+ **/
+static void
+omit_body(struct request *r, off_t mark, size_t nranges)
+{
+    char *end;
+
+    if (fflush(r->file) != 0 ||
+        !(end = memmem(r->response + mark, r->nresponse - mark, "\r\n\r\n", 4))) {
+        return;
+    }
+    fseeko(r->file, end + 4 - r->response, SEEK_SET);
+
+    r->nranges = nranges;
+    if (r->nranges == 0 && r->body_fd >= 0) {
+        close(r->body_fd);
+        r->body_fd = -1;
+    }
+}
+
 /**
  * Handle HTTP Request
  *
- * This parses a request, determines the request path, determines the request
- * type, and then dispatches to the appropriate handler type.
+ * This parses a request, determines the request path and type (URIs under a
+ * plugin's prefix go to the plugin, and the rest are resolved through the
+ * open file cache), and then dispatches to the appropriate handler type.
  *
  * On error, handle_error should be used with an appropriate HTTP status code.
+ *
+ * Request bodies larger than MaxBodySize are refused up front.  Only CGI
+ * scripts take request bodies (see handle_cgi_request); any other body is
+ * read and discarded after the response (see write_response), unless the
+ * client waits for a 100 Continue before sending it, in which case the
+ * connection is closed instead.
+ *
+ * Responses to HEAD requests are cut back to their head (see omit_body).
  **/
 http_status
 handle_request(struct request *r)
 {
+    struct open_file file;
+    const struct plugin *plugin = NULL;
+    off_t mark = ftello(r->file);
+    size_t nranges = r->nranges;
     http_status result;
 
-    /* Parse request */
+    /* Parse request (the stream cannot be trusted after a bad request) */
     if (parse_request(r) < 0) {
+        r->keepalive = false;
         return handle_error(r, HTTP_STATUS_BAD_REQUEST);
     }
 
-    /* Determine request path */
-    {
-        char *real = determine_request_path(r->uri);
-        if (!real) {
-            return handle_error(r, HTTP_STATUS_NOT_FOUND);
-        }
-        if (r->path) free(r->path);   /* replace any earlier value */
-        r->path = real;
-    }   
- 
-    debug("HTTP REQUEST PATH: %s", r->path);
+    /* Refuse oversized body without reading it */
+    if (r->body == BODY_LENGTH && r->body_left > (off_t)MaxBodySize) {
+        refuse_body(r);
+        result = handle_error(r, HTTP_STATUS_PAYLOAD_TOO_LARGE);
+        goto done;
+    }
+
+    /* Determine request path and type (unresolved URIs are not found) */
+    if ((plugin = plugin_lookup(r->uri))) {
+        file = (struct open_file){.type = REQUEST_PLUGIN, .fd = -1};
+        r->path = plugin->path;
+        debug("HTTP REQUEST PLUGIN: %s", r->path);
+    } else if (openfile_lookup(r, &file) < 0) {
+        file = (struct open_file){.type = REQUEST_BAD, .fd = -1};
+    } else {
+        r->path = file.path;
+        debug("HTTP REQUEST PATH: %s", r->path);
+    }
+
+    /* Do not wait for a body no script takes if the client holds it back
+     * until told to send it */
+    if (r->body != BODY_NONE && file.type != REQUEST_CGI && expects_continue(r)) {
+        refuse_body(r);
+    }
 
     /* Dispatch to appropriate request handler type */
-    switch (determine_request_type(r->path)) {
+    switch (file.type) {
     case REQUEST_BROWSE:
         result = handle_browse_request(r);
         break;
     case REQUEST_FILE:
-        result = handle_file_request(r);
+        result = handle_file_request(r, &file);
         break;
     case REQUEST_CGI:
         result = handle_cgi_request(r);
         break;
+    case REQUEST_PLUGIN:
+        result = handle_plugin_request(r, plugin);
+        break;
     default:
         result = handle_error(r, HTTP_STATUS_NOT_FOUND);
         break;
     }
+    openfile_close(&file);
 
+done:
+    if (streq(r->method, "HEAD")) {
+        omit_body(r, mark, nranges);
+    }
     log("HTTP REQUEST STATUS: %s", http_status_string(result));
     return result;
 }
 
+/**
+ * Directory reader returning one entry at a time from getdents64(2) batches,
+ * so reading a directory never holds more than one batch of its entries.
+ **/
+struct dir_reader {
+    int    fd;
+    bool   error;           /* Whether reading stopped on an error */
+    size_t nbuffer;
+    size_t position;
+    char   buffer[8*BUFSIZ] __attribute__ ((aligned(__alignof__(struct dirent64))));
+};
+
+/**
+ * Return next entry of directory other than . and .., or NULL at its end
+ * (or on error, which is recorded in the reader).
+ **/
+static struct dirent64 *
+dir_next(struct dir_reader *d)
+{
+    while (true) {
+        if (d->position >= d->nbuffer) {
+            ssize_t nread = getdents64(d->fd, d->buffer, sizeof(d->buffer));
+            if (nread <= 0) {
+                d->error = nread < 0;
+                return NULL;
+            }
+            d->nbuffer  = nread;
+            d->position = 0;
+        }
+
+        struct dirent64 *e = (struct dirent64 *)(d->buffer + d->position);
+        d->position += e->d_reclen;
+        if (!streq(e->d_name, ".") && !streq(e->d_name, "..")) {
+            return e;
+        }
+    }
+}
+
+/**
+ * Rewind directory reader to the first entry.
+ **/
+static int
+dir_rewind(struct dir_reader *d)
+{
+    d->error    = false;
+    d->nbuffer  = 0;
+    d->position = 0;
+    return lseek(d->fd, 0, SEEK_SET) < 0 ? -1 : 0;
+}
+
+/**
+ * Return value of query parameter (running up to the next '&'), or NULL if
+ * the query has no such parameter.
+ **/
+static const char *
+query_value(const char *query, const char *name)
+{
+    size_t length = strlen(name);
+
+    for (const char *p = query; p && *p; p = strchr(p, '&'), p = p ? p + 1 : NULL) {
+        if (strncmp(p, name, length) == 0 && p[length] == '=') {
+            return p + length + 1;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Parse numeric query parameter, returning fallback if it is absent or not
+ * a number.
+ **/
+static size_t
+query_number(const char *query, const char *name, size_t fallback)
+{
+    const char *value = query_value(query, name);
+    char *end;
+
+    if (!value || *value < '0' || *value > '9') {
+        return fallback;
+    }
+    unsigned long long number = strtoull(value, &end, 10);
+    return (*end == '\0' || *end == '&') ? (size_t)number : fallback;
+}
+
+/**
+ * Write HTML list item linking to directory entry.
+ **/
+static void
+browse_html_entry(FILE *ls, const char *uri, const char *name)
+{
+    /* Build link: uri + '/' + name (avoid double slashes) */
+    const char *base = (uri && uri[0]) ? uri : "/";
+    int need_slash = base[strlen(base) - 1] != '/';
+
+    fprintf(ls, "<li><a href=\"%s%s%s\">%s</a></li>\n", base, need_slash ? "/" : "", name, name);
+}
+
+/**
+ * Write string as JSON string literal.
+ **/
+static void
+browse_json_string(FILE *ls, const char *s)
+{
+    fputc('"', ls);
+    for (const unsigned char *c = (const unsigned char *)s; *c; c++) {
+        if (*c == '"' || *c == '\\') {
+            fprintf(ls, "\\%c", *c);
+        } else if (*c < 0x20) {
+            fprintf(ls, "\\u%04x", *c);
+        } else {
+            fputc(*c, ls);
+        }
+    }
+    fputc('"', ls);
+}
+
+/**
+ * Return JSON name for directory entry type.
+ **/
+static const char *
+browse_json_type(unsigned char type)
+{
+    switch (type) {
+    case DT_DIR:    return "directory";
+    case DT_REG:    return "file";
+    case DT_LNK:    return "symlink";
+    case DT_UNKNOWN:return "unknown";
+    default:        return "other";
+    }
+}
+
+/**
+ * Write rendered listing with OK status, returning the status.
+ **/
+static http_status
+browse_respond(struct request *r, const char *mimetype, const char *listing, size_t nlisting)
+{
+    handle_status(r, HTTP_STATUS_OK);
+    fprintf(r->file, "Content-Type: %s\r\nContent-Length: %zu\r\n\r\n", mimetype, nlisting);
+    fwrite(listing, 1, nlisting, r->file);
+    return HTTP_STATUS_OK;
+}
+
+/**
+ * Handle one page of a directory listing, in HTML or JSON.
+ *
+ * Entries come in directory order straight from getdents64, skipping the
+ * first offset of them, so a page costs time proportional to offset + limit
+ * and memory proportional to limit, however large the directory is.  Each
+ * page tells where the next one starts (if there is one).
+ *
+ * Under HTTP/1.1 the page is written straight into the response as chunks
+ * (see chunk_response); HTTP/1.0 clients need its length up front, so for
+ * them it is rendered on the side first.
+ **/
+static http_status
+browse_page(struct request *r, struct dir_reader *d, size_t offset, size_t limit, bool json)
+{
+    const char *uri = r->uri ? r->uri : "/";
+    const char *mimetype = json ? "application/json" : "text/html";
+    bool chunked = streq(r->version, "HTTP/1.1");
+    off_t mark = ftello(r->file);
+    struct dirent64 *e;
+    char *listing = NULL;
+    size_t nlisting = 0;
+    size_t nentries = 0;
+    FILE *ls;
+
+    if (limit == 0 || limit > LISTING_PAGE_MAX) {
+        limit = LISTING_PAGE_MAX;
+    }
+
+    if (chunked) {
+        handle_status(r, HTTP_STATUS_OK);
+        fprintf(r->file, "Content-Type: %s\r\nTransfer-Encoding: chunked\r\n\r\n", mimetype);
+        ls = chunk_response(r);
+    } else {
+        ls = open_memstream(&listing, &nlisting);
+    }
+    if (!ls) {
+        fseeko(r->file, mark, SEEK_SET);
+        return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+    }
+
+    if (json) {
+        fputs("{\"path\":", ls);
+        browse_json_string(ls, uri);
+        fprintf(ls, ",\"offset\":%zu,\"entries\":[", offset);
+    } else {
+        fprintf(ls, "<html><head><title>Index of %s</title></head><body>\n", uri);
+        fprintf(ls, "<h1>Index of %s</h1>\n<ul>\n", uri);
+    }
+
+    /* Skip entries before the page */
+    bool end = false;
+    for (size_t i = 0; i < offset && !end; i++) {
+        end = !dir_next(d);
+    }
+
+    while (!end && nentries < limit && (e = dir_next(d))) {
+        if (json) {
+            fputs(nentries > 0 ? ",{\"name\":" : "{\"name\":", ls);
+            browse_json_string(ls, e->d_name);
+            fprintf(ls, ",\"type\":\"%s\"}", browse_json_type(e->d_type));
+        } else {
+            browse_html_entry(ls, r->uri, e->d_name);
+        }
+        nentries++;
+    }
+
+    /* Look ahead to tell whether there is a next page */
+    bool more = nentries == limit && dir_next(d);
+
+    if (json) {
+        if (more) {
+            fprintf(ls, "],\"next\":%zu}\n", offset + nentries);
+        } else {
+            fputs("],\"next\":null}\n", ls);
+        }
+    } else {
+        fprintf(ls, "</ul>\n");
+        if (more) {
+            fprintf(ls, "<p><a href=\"?offset=%zu&amp;limit=%zu\">Next page</a></p>\n", offset + nentries, limit);
+        }
+        fprintf(ls, "</body></html>\n");
+    }
+
+    if (fclose(ls) != 0 || d->error) {
+        free(listing);
+        fseeko(r->file, mark, SEEK_SET);
+        return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+    }
+
+    if (!chunked) {
+        browse_respond(r, mimetype, listing, nlisting);
+        free(listing);
+    }
+    return HTTP_STATUS_OK;
+}
+
+/**
+ * Compare directory entry names for qsort.
+ **/
+static int
+browse_compare(const void *a, const void *b)
+{
+    return strcmp(*(const char * const *)a, *(const char * const *)b);
+}
+
+/**
+ * Read names of all entries in directory into one block (names), and point
+ * an array (returned through entries) at them, sorted.
+ *
+ * Returns the number of entries, or -1 on error or if the directory holds
+ * more than LISTING_SORTED entries.  Both names and entries must be free'd.
+ **/
+static ssize_t
+browse_sorted(struct dir_reader *d, char **names, char ***entries)
+{
+    size_t nnames = 0;
+    size_t nentries = 0;
+    struct dirent64 *e;
+    FILE *ns;
+
+    *names   = NULL;
+    *entries = NULL;
+    ns = open_memstream(names, &nnames);
+    if (!ns) {
+        return -1;
+    }
+
+    while ((e = dir_next(d))) {
+        if (++nentries > LISTING_SORTED) {
+            break;
+        }
+        fputs(e->d_name, ns);
+        fputc('\0', ns);
+    }
+
+    if (fclose(ns) != 0 || d->error || nentries > LISTING_SORTED ||
+        !(*entries = calloc(nentries + 1, sizeof(char *)))) {
+        free(*names);
+        *names = NULL;
+        return -1;
+    }
+
+    char *name = *names;
+    for (size_t i = 0; i < nentries; i++) {
+        (*entries)[i] = name;
+        name += strlen(name) + 1;
+    }
+    qsort(*entries, nentries, sizeof(char *), browse_compare);
+    return nentries;
+}
+
 /**
  * Handle browse request
  *
- * This lists the contents of a directory in HTML.
+ * This lists the contents of a directory in HTML, sorted by name.  Listings
+ * are served from the directory listing cache while the directory is
+ * unchanged, and added to it otherwise.
+ *
+ * Directories with more than LISTING_SORTED entries, and requests for a
+ * page of a listing (?offset=&limit=) or for JSON (?format=json) are instead
+ * answered one page at a time (see browse_page).
  *
- * If the path cannot be opened or scanned as a directory, then handle error
- * with HTTP_STATUS_NOT_FOUND.
+ * If the path cannot be opened as a directory, then handle error with
+ * HTTP_STATUS_NOT_FOUND.
  **/
 http_status
 handle_browse_request(struct request *r)
 {
-    struct dirent **entries;
-    int n;
+    struct dir_reader d = {.fd = -1};
+    struct stat st;
+    http_status status;
+    char **entries;
+    char *names;
+    char *listing = NULL;
+    size_t nlisting = 0;
+    ssize_t n;
+    FILE *ls;
 
-    /* Open a directory for reading or scanning */
-    n = scandir(r->path, &entries, NULL, alphasort);
-    if (n < 0) {
+    const char *format = query_value(r->query, "format");
+    bool json  = format && strncmp(format, "json", 4) == 0 && (format[4] == '\0' || format[4] == '&');
+    bool paged = json || query_value(r->query, "offset") || query_value(r->query, "limit");
+
+    /* Open directory, and serve it from the listing cache if possible */
+    d.fd = open(r->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (d.fd < 0 || fstat(d.fd, &st) < 0) {
+        if (d.fd >= 0) {
+            close(d.fd);
+        }
         return handle_error(r, HTTP_STATUS_NOT_FOUND);
     }
 
-    /* Write HTTP Header with OK Status and text/html Content-Type */
-    fprintf(r->file, "HTTP/1.0 %s\r\n", http_status_string(HTTP_STATUS_OK));
-    fprintf(r->file, "Content-Type: text/html\r\n");
-    fprintf(r->file, "\r\n");
+    if (paged) {
+        status = browse_page(r, &d, query_number(r->query, "offset", 0),
+                             query_number(r->query, "limit", LISTING_PAGE), json);
+        close(d.fd);
+        return status;
+    }
 
-    /* For each entry in directory, emit HTML list item */
-    fprintf(r->file, "<html><head><title>Index of %s</title></head><body>\n", r->uri ? r->uri : "/");
-    fprintf(r->file, "<h1>Index of %s</h1>\n<ul>\n", r->uri ? r->uri : "/");
+    if (listing_lookup(r, &st)) {
+        close(d.fd);
+        return HTTP_STATUS_OK;
+    }
 
-    for (int i = 0; i < n; i++) {
-        const char *name = entries[i]->d_name;
+    /* Page through directories too large to sort */
+    n = browse_sorted(&d, &names, &entries);
+    if (n < 0) {
+        status = dir_rewind(&d) == 0 ? browse_page(r, &d, 0, LISTING_PAGE, false)
+                                     : handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+        close(d.fd);
+        return status;
+    }
+    close(d.fd);
 
-        /* Skip . and .. */
-        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
-            free(entries[i]);
-            continue;
+    /* Render listing into memory so its length is known up front */
+    ls = open_memstream(&listing, &nlisting);
+    if (!ls) {
+        free(entries);
+        free(names);
+        return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+    }
+
+    fprintf(ls, "<html><head><title>Index of %s</title></head><body>\n", r->uri ? r->uri : "/");
+    fprintf(ls, "<h1>Index of %s</h1>\n<ul>\n", r->uri ? r->uri : "/");
+    for (ssize_t i = 0; i < n; i++) {
+        browse_html_entry(ls, r->uri, entries[i]);
+    }
+    fprintf(ls, "</ul>\n</body></html>\n");
+    free(entries);
+    free(names);
+
+    if (fclose(ls) != 0) {
+        free(listing);
+        return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+    }
+
+    /* Write HTTP Header with OK Status, text/html Content-Type, and length,
+     * followed by the listing, and keep a copy of both in the cache */
+    char headers[128];
+    int nheaders = snprintf(headers, sizeof(headers),
+            "Content-Type: text/html\r\n"
+            "Content-Length: %zu\r\n"
+            "\r\n", nlisting);
+    char *data = malloc(nheaders + nlisting);
+    if (!data) {
+        status = browse_respond(r, "text/html", listing, nlisting);
+        free(listing);
+        return status;
+    }
+    memcpy(data, headers, nheaders);
+    memcpy(data + nheaders, listing, nlisting);
+    free(listing);
+
+    handle_status(r, HTTP_STATUS_OK);
+    fwrite(data, 1, nheaders + nlisting, r->file);
+    listing_insert(r->path, &st, data, nheaders + nlisting);
+    return HTTP_STATUS_OK;
+}
+
+/**
+ * Format validators for file: an entity tag from its inode, size, and
+ * modification time, and its modification time as an HTTP date.
+ **/
+static void
+file_validators(const struct stat *s, char *etag, size_t netag, char *modified, size_t nmodified)
+{
+    struct tm tm;
+
+    snprintf(etag, netag, "\"%llx-%llx-%llx\"",
+             (unsigned long long)s->st_ino, (unsigned long long)s->st_size,
+             (unsigned long long)s->st_mtime);
+
+    if (!gmtime_r(&s->st_mtime, &tm) ||
+        strftime(modified, nmodified, "%a, %d %b %Y %H:%M:%S GMT", &tm) == 0) {
+        modified[0] = '\0';
+    }
+}
+
+/**
+ * Return whether the client's copy of the file is still current, according
+ * to its If-None-Match or (only if that is absent) If-Modified-Since header.
+ *
+ * If-None-Match holds a comma-separated list of entity tags (or "*"), which
+ * are compared weakly, i.e. ignoring any W/ prefix.  Conditions only apply
+ * to GET and HEAD requests.
+ **/
+static bool
+file_not_modified(struct request *r, const char *etag, time_t mtime)
+{
+    const char *match;
+    const char *since;
+
+    if (!streq(r->method, "GET") && !streq(r->method, "HEAD")) {
+        return false;
+    }
+
+    match = request_known_header(r, HEADER_IF_NONE_MATCH);
+    if (match) {
+        size_t netag = strlen(etag);
+
+        while (*match) {
+            while (*match == ' ' || *match == '\t' || *match == ',') {
+                match++;
+            }
+            if (strncmp(match, "W/", 2) == 0) {
+                match += 2;
+            }
+
+            const char *end = strchr(match, ',');
+            if (!end) {
+                end = match + strlen(match);
+            }
+            size_t length = end - match;
+            while (length > 0 && (match[length - 1] == ' ' || match[length - 1] == '\t')) {
+                length--;
+            }
+
+            if ((length == 1 && match[0] == '*') ||
+                (length == netag && strncmp(match, etag, length) == 0)) {
+                return true;
+            }
+            match = end;
         }
+        return false;
+    }
+
+    since = request_known_header(r, HEADER_IF_MODIFIED_SINCE);
+    if (since) {
+        struct tm tm;
+        memset(&tm, 0, sizeof(tm));
+
+        const char *end = strptime(since, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+        if (end && *end == '\0') {
+            return mtime <= timegm(&tm);
+        }
+    }
+    return false;
+}
+
+/**
+ * Byte range of file, inclusive of both ends.
+ **/
+struct byte_range {
+    off_t first;
+    off_t last;
+};
+
+/**
+ * Parse decimal number (digits only) at *s, advancing *s past it.
+ *
+ * Returns -1 if there are no digits or the number overflows.
+ **/
+static off_t
+parse_offset(const char **s)
+{
+    off_t value = 0;
 
-        /* Build link: r->uri + '/' + name (avoid double slashes) */
-        const char *base = (r->uri && r->uri[0]) ? r->uri : "/";
-        int need_slash = base[strlen(base) - 1] != '/';
+    if (**s < '0' || **s > '9') {
+        return -1;
+    }
+    for (; **s >= '0' && **s <= '9'; (*s)++) {
+        if (value > (INT64_MAX - (**s - '0')) / 10) {
+            return -1;
+        }
+        value = value * 10 + (**s - '0');
+    }
+    return value;
+}
 
-        fprintf(r->file, "<li><a href=\"%s%s%s\">%s</a></li>\n",
-                base, need_slash ? "/" : "", name, name);
+/**
+ * Determine byte ranges of file requested with a GET Range header.
+ *
+ * Supports "first-last", open-ended "first-", and suffix "-length" specs,
+ * separated by commas.  Ranges are clipped to the file size and those that
+ * start past its end are dropped.  The header is ignored (so the whole file
+ * is sent) if it cannot be parsed, lists more than REQUEST_RANGES ranges, or
+ * is conditional on an If-Range validator that no longer matches.
+ *
+ * Returns the number of satisfiable ranges stored in ranges (0 if none), or
+ * -1 if the header is absent or ignored.
+ **/
+static int
+file_ranges(struct request *r, const char *etag, const char *modified, off_t size,
+            struct byte_range *ranges)
+{
+    const char *range = request_known_header(r, HEADER_RANGE);
+    const char *condition = request_known_header(r, HEADER_IF_RANGE);
+    int nranges = 0;
+    int nspecs = 0;
 
-        free(entries[i]);
+    if (!range || !streq(r->method, "GET") || strncmp(range, "bytes=", 6) != 0) {
+        return -1;
+    }
+    if (condition && !streq(condition, etag) && !streq(condition, modified)) {
+        return -1;
     }
-    free(entries);
 
-    fprintf(r->file, "</ul>\n</body></html>\n");
+    for (const char *s = range + 6; *s; ) {
+        off_t first, last;
 
-    /* Flush socket, return OK */
-    fflush(r->file);
-    return HTTP_STATUS_OK;
+        while (*s == ' ' || *s == '\t' || *s == ',') {
+            s++;
+        }
+        if (!*s) {
+            break;
+        }
+        if (++nspecs > REQUEST_RANGES) {
+            return -1;
+        }
+
+        if (*s == '-') {
+            s++;
+            off_t length = parse_offset(&s);
+            if (length < 0) {
+                return -1;
+            }
+            first = length < size ? size - length : 0;
+            last  = length > 0 ? size - 1 : -1;
+        } else {
+            first = parse_offset(&s);
+            if (first < 0 || *s++ != '-') {
+                return -1;
+            }
+            if (*s >= '0' && *s <= '9') {
+                last = parse_offset(&s);
+                if (last < first) {
+                    return -1;
+                }
+                if (last >= size) {
+                    last = size - 1;
+                }
+            } else {
+                last = size - 1;
+            }
+        }
+
+        while (*s == ' ' || *s == '\t') {
+            s++;
+        }
+        if (*s && *s != ',') {
+            return -1;
+        }
+
+        if (first < size && first <= last) {
+            ranges[nranges].first = first;
+            ranges[nranges].last  = last;
+            nranges++;
+        }
+    }
+
+    return nspecs > 0 ? nranges : -1;
 }
 
 /**
- * Handle file request
+ * Handle ranged file request with 206 Partial Content.
  *
- * This opens and streams the contents of the specified file to the socket.
+ * A single range is sent as is, with a Content-Range header, and several as
+ * a multipart/byteranges body with a part per range.  Either way the ranges
+ * are queued to be sent straight from the file's descriptor at their
+ * offsets (see queue_body), which the request takes over.
+ **/
+static http_status
+handle_file_ranges(struct request *r, struct open_file *f, const char *mimetype,
+                   const char *etag, const char *modified,
+                   const struct byte_range *ranges, int nranges)
+{
+    long long size = f->st.st_size;
+    off_t mark = ftello(r->file);
+    size_t saved = r->nranges;
+    char boundary[64];
+    long long length;
+
+    handle_status(r, HTTP_STATUS_PARTIAL_CONTENT);
+
+    if (nranges == 1) {
+        fprintf(r->file,
+                "Content-Type: %s\r\n"
+                "Content-Length: %lld\r\n"
+                "Content-Range: bytes %lld-%lld/%lld\r\n"
+                "ETag: %s\r\n"
+                "Last-Modified: %s\r\n"
+                "Accept-Ranges: bytes\r\n"
+                "\r\n",
+                mimetype, (long long)(ranges[0].last - ranges[0].first + 1),
+                (long long)ranges[0].first, (long long)ranges[0].last, size, etag, modified);
+        if (queue_body(r, ranges[0].first, ranges[0].last - ranges[0].first + 1) < 0) {
+            goto fail;
+        }
+    } else {
+        /* Each part is preceded by its own headers, so total those up front
+         * to determine the Content-Length */
+        snprintf(boundary, sizeof(boundary), "%llx%llx",
+                 (unsigned long long)f->st.st_ino, (unsigned long long)f->st.st_mtime);
+
+        length = snprintf(NULL, 0, "\r\n--%s--\r\n", boundary);
+        for (int i = 0; i < nranges; i++) {
+            length += snprintf(NULL, 0,
+                    "\r\n--%s\r\n"
+                    "Content-Type: %s\r\n"
+                    "Content-Range: bytes %lld-%lld/%lld\r\n"
+                    "\r\n",
+                    boundary, mimetype, (long long)ranges[i].first, (long long)ranges[i].last, size);
+            length += ranges[i].last - ranges[i].first + 1;
+        }
+
+        fprintf(r->file,
+                "Content-Type: multipart/byteranges; boundary=%s\r\n"
+                "Content-Length: %lld\r\n"
+                "ETag: %s\r\n"
+                "Last-Modified: %s\r\n"
+                "Accept-Ranges: bytes\r\n"
+                "\r\n",
+                boundary, length, etag, modified);
+
+        for (int i = 0; i < nranges; i++) {
+            fprintf(r->file,
+                    "\r\n--%s\r\n"
+                    "Content-Type: %s\r\n"
+                    "Content-Range: bytes %lld-%lld/%lld\r\n"
+                    "\r\n",
+                    boundary, mimetype, (long long)ranges[i].first, (long long)ranges[i].last, size);
+            if (queue_body(r, ranges[i].first, ranges[i].last - ranges[i].first + 1) < 0) {
+                goto fail;
+            }
+        }
+        fprintf(r->file, "\r\n--%s--\r\n", boundary);
+    }
+
+    r->body_fd = f->fd;
+    f->fd      = -1;
+    return HTTP_STATUS_PARTIAL_CONTENT;
+
+fail:
+    fseeko(r->file, mark, SEEK_SET);
+    r->nranges = saved;
+    return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+}
+
+/**
+ * Handle file request
  *
- * If the path cannot be opened for reading, then handle error with
- * HTTP_STATUS_NOT_FOUND.
+ * If the client's copy of the file is still current (see file_not_modified),
+ * this only responds with 304 Not Modified, and if it asks for byte ranges
+ * (see file_ranges) with 206 Partial Content or 416 Range Not Satisfiable.
+ * Otherwise it serves the file from the file cache if possible, or it uses
+ * the descriptor opened by the open file cache to either copy the file's
+ * contents into the response (small files, which are also added to the
+ * cache if it is enabled) or queue them to be streamed to the socket after the response
+ * headers (see write_response), in which case the request takes over the
+ * descriptor.
  **/
 http_status
-handle_file_request(struct request *r)
+handle_file_request(struct request *r, struct open_file *f)
 {
-    FILE *fs;
-    char buffer[BUFSIZ];
-    char *mimetype = NULL;
-    size_t nread;
+    const struct stat *s = &f->st;
+    const char *mimetype;
+    struct byte_range ranges[REQUEST_RANGES];
+    char headers[BUFSIZ];
+    char etag[64];
+    char modified[64];
+    int nheaders;
+    int nranges;
 
-    /* Open file for reading */
-    fs = fopen(r->path, "rb");
-    if (!fs) {
-        return handle_error(r, HTTP_STATUS_NOT_FOUND);
+    /* Tell client to reuse its copy if it is current */
+    file_validators(s, etag, sizeof(etag), modified, sizeof(modified));
+    if (file_not_modified(r, etag, s->st_mtime)) {
+        handle_status(r, HTTP_STATUS_NOT_MODIFIED);
+        fprintf(r->file, "ETag: %s\r\nLast-Modified: %s\r\n\r\n", etag, modified);
+        return HTTP_STATUS_NOT_MODIFIED;
+    }
+
+    /* Send only the requested byte ranges, if any */
+    nranges = file_ranges(r, etag, modified, s->st_size, ranges);
+    if (nranges == 0) {
+        handle_status(r, HTTP_STATUS_RANGE_NOT_SATISFIABLE);
+        fprintf(r->file, "Content-Length: 0\r\nContent-Range: bytes */%lld\r\n\r\n", (long long)s->st_size);
+        return HTTP_STATUS_RANGE_NOT_SATISFIABLE;
+    }
+    if (nranges > 0) {
+        return handle_file_ranges(r, f, determine_mimetype(r), etag, modified, ranges, nranges);
+    }
+
+    /* Serve hot files from memory (once any pending mimetypes reload,
+     * which empties the cache, is applied) */
+    load_mimetypes();
+    if (CacheSize > 0 && cache_lookup(r)) {
+        return HTTP_STATUS_OK;
     }
 
     /* Determine mimetype */
-    mimetype = determine_mimetype(r->path);
-    if (!mimetype) {
-        mimetype = strdup(DefaultMimeType);
-        if (!mimetype) {
-            fclose(fs);
+    mimetype = determine_mimetype(r);
+
+    /* Format HTTP Headers with determined Content-Type, size, and
+     * validators */
+    nheaders = snprintf(headers, sizeof(headers),
+            "Content-Type: %s\r\n"
+            "Content-Length: %lld\r\n"
+            "ETag: %s\r\n"
+            "Last-Modified: %s\r\n"
+            "Accept-Ranges: bytes\r\n"
+            "\r\n",
+            mimetype, (long long)s->st_size, etag, modified);
+    if (nheaders >= (int)sizeof(headers)) {
+        return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+    }
+
+    /* Copy cacheable files into the response so they go out with the
+     * headers, and add them to the cache */
+    if (CacheSize > 0 && s->st_size <= CACHE_ENTRY_MAX) {
+        size_t ndata = nheaders + s->st_size;
+        char  *data  = malloc(ndata);
+        if (!data) {
+            return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+        }
+        memcpy(data, headers, nheaders);
+        ssize_t nread = s->st_size > 0 ? pread(f->fd, data + nheaders, s->st_size, 0) : 0;
+        if (nread != s->st_size) {
+            free(data);
             return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
         }
+
+        /* Write HTTP Headers with OK status, and file contents */
+        handle_status(r, HTTP_STATUS_OK);
+        fwrite(data, 1, ndata, r->file);
+
+        cache_insert(r->path, data, ndata);
+        return HTTP_STATUS_OK;
     }
 
-    /* Write HTTP Headers with OK status and determined Content-Type */
-    fprintf(r->file, "HTTP/1.0 %s\r\n", http_status_string(HTTP_STATUS_OK));
-    fprintf(r->file, "Content-Type: %s\r\n", mimetype);
-    fprintf(r->file, "\r\n");
+    /* Copy other small files straight into the response, discarding it
+     * again if the file cannot be read */
+    if (s->st_size <= RESPONSE_INLINE) {
+        char buffer[BUFSIZ];
+        off_t mark = ftello(r->file);
 
-    /* Read from file and write to socket in chunks */
-    while ((nread = fread(buffer, 1, sizeof(buffer), fs)) > 0) {
-        if (fwrite(buffer, 1, nread, r->file) != nread) {
-            fclose(fs);
-            free(mimetype);
-            return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+        handle_status(r, HTTP_STATUS_OK);
+        fwrite(headers, 1, nheaders, r->file);
+
+        for (off_t offset = 0; offset < s->st_size; ) {
+            size_t  nwant = s->st_size - offset < (off_t)sizeof(buffer) ? (size_t)(s->st_size - offset) : sizeof(buffer);
+            ssize_t nread = pread(f->fd, buffer, nwant, offset);
+            if (nread <= 0) {
+                fseeko(r->file, mark, SEEK_SET);
+                return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+            }
+            fwrite(buffer, 1, nread, r->file);
+            offset += nread;
         }
+        return HTTP_STATUS_OK;
     }
 
-    /* Close file, flush socket, deallocate mimetype, return OK */
-    fclose(fs);
-    fflush(r->file);
-    free(mimetype);
+    /* Write HTTP Headers with OK status, and queue larger files to be
+     * streamed after them */
+    off_t mark = ftello(r->file);
+    handle_status(r, HTTP_STATUS_OK);
+    fwrite(headers, 1, nheaders, r->file);
+
+    if (queue_body(r, 0, s->st_size) < 0) {
+        fseeko(r->file, mark, SEEK_SET);
+        return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+    }
+    r->body_fd = f->fd;
+    f->fd      = -1;
     return HTTP_STATUS_OK;
 }
 
 /**
- * Handle file request
- *
- * This popens and streams the results of the specified executables to the
- * socket.
- *
+ * Append NAME=value entry to CGI environment stream.
+ **/
+static void
+cgi_export(FILE *es, const char *name, const char *value)
+{
+    fprintf(es, "%s=%s", name, value);
+    fputc('\0', es);
+}
+
+/**
+ * Pack CGI variables for request into a single allocated block of
+ * NUL-terminated NAME=value entries (returned through data and ndata, and
+ * to be free'd by the caller).  The request body is only described
+ * (CONTENT_TYPE, CONTENT_LENGTH) if body is set, i.e. the script gets it.
  *
- * If the path cannot be popened, then handle error with
- * HTTP_STATUS_INTERNAL_SERVER_ERROR.
+ * Returns 0 on success, -1 on error.
  **/
-http_status
-handle_cgi_request(struct request *r)
+static int
+cgi_variables(struct request *r, bool body, char **data, size_t *ndata)
 {
-    FILE *pfs;
-    char buffer[BUFSIZ];
-    struct header *header;
+    FILE *es;
+
+    *data  = NULL;
+    *ndata = 0;
+    es = open_memstream(data, ndata);
+    if (!es) {
+        return -1;
+    }
 
     /* Export CGI environment variables from request:
     * http://en.wikipedia.org/wiki/Common_Gateway_Interface */
-    if (r->method) setenv("REQUEST_METHOD", r->method, 1);
-    if (r->uri)    setenv("REQUEST_URI",   r->uri,    1);
-    if (r->path)   setenv("SCRIPT_FILENAME", r->path, 1);
-    setenv("QUERY_STRING", r->query ? r->query : "", 1);
+    if (r->method) cgi_export(es, "REQUEST_METHOD", r->method);
+    if (r->uri)    cgi_export(es, "REQUEST_URI",   r->uri);
+    if (r->path)   cgi_export(es, "SCRIPT_FILENAME", r->path);
+    cgi_export(es, "QUERY_STRING", r->query ? r->query : "");
+
+    /* Request body (read from standard input; chunked bodies have no
+     * known length, so they are read up to the end of input) */
+    const char *type = request_known_header(r, HEADER_CONTENT_TYPE);
+    if (body && type) cgi_export(es, "CONTENT_TYPE", type);
+    if (body && r->body == BODY_LENGTH) {
+        fprintf(es, "CONTENT_LENGTH=%lld", (long long)r->body_left);
+        fputc('\0', es);
+    }
 
     /* Server and client info */
-    if (RootPath)  setenv("DOCUMENT_ROOT", RootPath, 1);
-    if (Port)      setenv("SERVER_PORT",   Port,     1);
-    if (r->host[0]) setenv("REMOTE_ADDR",  r->host,  1);
-    if (r->port[0]) setenv("REMOTE_PORT",  r->port,  1);
+    if (RootPath)  cgi_export(es, "DOCUMENT_ROOT", RootPath);
+    if (Port)      cgi_export(es, "SERVER_PORT",   Port);
+    if (r->host[0]) cgi_export(es, "REMOTE_ADDR",  r->host);
+    if (r->port[0]) cgi_export(es, "REMOTE_PORT",  r->port);
 
     /* Export CGI environment variables from request headers */
-    for (header = r->headers; header != NULL; header = header->next) {
+    for (size_t i = 0; i < r->nheaders; i++) {
+        struct header *header = &r->headers[i];
+
         // Build env name: HTTP_<NAME>, uppercase, '-' -> '_' 
-        char envname[PATH_MAX];
-        int n = snprintf(envname, sizeof(envname), "HTTP_%s", header->name ? header->name : "");
-        if (n <= 0 || n >= (int)sizeof(envname)) {
-            continue;
+        fputs("HTTP_", es);
+        for (const char *c = header->name; *c; c++) {
+            if (*c >= 'a' && *c <= 'z') fputc(*c - 32, es);    /* to upper */
+            else if (*c == '-')         fputc('_', es);
+            else                        fputc(*c, es);
+        }
+        fprintf(es, "=%s", header->value);
+        fputc('\0', es);
+    }
+
+    if (fclose(es) != 0) {
+        free(*data);
+        *data = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Build CGI environment for request.
+ *
+ * The CGI variables are packed into a single allocated block (returned
+ * through data) and referenced from the returned NULL-terminated array,
+ * followed by the server's own environment.  Nothing is exported into the
+ * server process itself, so concurrent requests never see each other's
+ * variables.  Both the array and data must be free'd.
+ **/
+static char **
+cgi_environment(struct request *r, char **data)
+{
+    extern char **environ;
+    size_t ndata = 0;
+    size_t nvars = 0;
+    size_t nenviron = 0;
+    char **envp;
+
+    if (cgi_variables(r, true, data, &ndata) < 0) {
+        return NULL;
+    }
+
+    /* Build array: CGI variables first (so they take precedence), then the
+     * inherited environment */
+    for (size_t i = 0; i < ndata; i++) {
+        if ((*data)[i] == '\0') nvars++;
+    }
+    while (environ && environ[nenviron]) {
+        nenviron++;
+    }
+
+    envp = calloc(nvars + nenviron + 1, sizeof(char *));
+    if (!envp) {
+        free(*data);
+        *data = NULL;
+        return NULL;
+    }
+
+    char *var = *data;
+    for (size_t i = 0; i < nvars; i++) {
+        envp[i] = var;
+        var += strlen(var) + 1;
+    }
+    for (size_t i = 0; i < nenviron; i++) {
+        envp[nvars + i] = environ[i];
+    }
+
+    return envp;
+}
+
+/**
+ * Handle request for script served by persistent workers (see
+ * worker_start): the request is sent to a worker, or waits for one to be
+ * free, and its response is written once the worker has answered (see
+ * handle_worker_response).
+ *
+ * Worker frames carry no request body, so a request's body is read and
+ * discarded after the response (see write_response), as for static files,
+ * and the worker handles the request as if it had none.  A client waiting
+ * for a 100 Continue is not asked for the body; the connection is closed
+ * after the response instead.
+ **/
+static http_status
+handle_worker_request(struct request *r)
+{
+    char *data;
+    size_t ndata;
+
+    if (r->body != BODY_NONE && expects_continue(r)) {
+        refuse_body(r);
+    }
+
+    if (cgi_variables(r, false, &data, &ndata) < 0) {
+        return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+    }
+
+    int status = worker_start(r, data, ndata);
+    free(data);
+    if (status < 0) {
+        return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+    }
+    return HTTP_STATUS_OK;
+}
+
+/**
+ * Write response from the output of the request's persistent worker once
+ * all of it is in (see worker_receive).
+ *
+ * Workers answer with the whole output at once, so its length is known and
+ * the connection can stay open.  If the worker fails, the response is
+ * HTTP_STATUS_INTERNAL_SERVER_ERROR instead.
+ *
+ * Returns false while more output is to come.
+ **/
+bool
+handle_worker_response(struct request *r)
+{
+    char *output;
+    size_t noutput;
+    int status = worker_receive(r, &output, &noutput);
+
+    if (status == 0) {
+        return false;
+    }
+    if (status < 0) {
+        handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+        return true;
+    }
+
+    if (r->cache_entry) {
+        microcache_capture(r, output, noutput);
+        if (r->cache_entry) {
+            microcache_capture(r, NULL, 0);
         }
-        for (int i = 5; envname[i]; i++) {
-            if (envname[i] >= 'a' && envname[i] <= 'z') envname[i] -= 32; /* to upper */
-            if (envname[i] == '-') envname[i] = '_';
+    }
+    handle_cgi_output(r, output, noutput);
+    free(output);
+    return true;
+}
+
+/**
+ * Handle cgi request
+ *
+ * This spawns the specified executable (see spawn_script) with its standard
+ * output connected to a non-blocking pipe, whose output is then streamed to
+ * the socket as it arrives (see write_response), so a slow script never
+ * holds up the thread or event loop serving it.  The script's header block
+ * becomes the response head (see handle_cgi_head), and under HTTP/1.1 the
+ * rest of its output is sent in chunks, so the connection stays open after
+ * it.  If the request has a body, the script's standard input is another
+ * pipe, which the body is fed into as it arrives (see read_body), after
+ * telling the client to go ahead if it waits for that.  Scripts named
+ * *.fcgi are instead handed to persistent workers (unless -f 0 disables
+ * them), whose answers are likewise waited for without blocking.  With -t,
+ * responses may come from the micro-cache instead, or from another
+ * request's run of the same script (see microcache_lookup).
+ *
+ * If the path cannot be spawned, then handle error with
+ * HTTP_STATUS_INTERNAL_SERVER_ERROR.
+ **/
+http_status
+handle_cgi_request(struct request *r)
+{
+    char *data;
+    char **envp;
+    pid_t pid;
+    char *head;
+    int fds[2];
+    int input[2] = {-1, -1};
+
+    /* Answer from the micro-cache, or wait for a run already under way */
+    if (microcache_lookup(r)) {
+        return HTTP_STATUS_OK;
+    }
+
+    if (worker_script(r->path)) {
+        return handle_worker_request(r);
+    }
+
+    /* Build CGI environment, and room for the script's header block */
+    envp = cgi_environment(r, &data);
+    if (!envp) {
+        return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+    }
+    head = request_alloc(r, CGI_HEAD_SIZE);
+
+    /* The body reuses the request buffer (see read_body), so keep the
+     * request line that the response head depends on in the arena */
+    if (head && r->body != BODY_NONE) {
+        char *method  = request_strdup(r, r->method);
+        char *uri     = request_strdup(r, r->uri);
+        char *version = request_strdup(r, r->version);
+        if (!method || !uri || !version) {
+            head = NULL;
+        } else {
+            r->method  = method;
+            r->uri     = uri;
+            r->version = version;
+        }
+    }
+    if (!head) {
+        free(envp);
+        free(data);
+        return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+    }
+
+    /* Spawn CGI Script (only the server's ends of the pipes are
+     * non-blocking) */
+    if (pipe2(fds, O_CLOEXEC) < 0) {
+        free(envp);
+        free(data);
+        return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+    }
+    if (r->body != BODY_NONE && pipe2(input, O_CLOEXEC) < 0) {
+        input[0] = input[1] = -1;
+        pid = -1;
+    } else {
+        pid = spawn_script(r->path, envp, input[0], fds[1]);
+    }
+    close(fds[1]);
+    if (input[0] >= 0) {
+        close(input[0]);
+    }
+    free(envp);
+    free(data);
+    if (pid < 0 || fcntl(fds[0], F_SETFL, O_NONBLOCK) < 0 ||
+        (input[1] >= 0 && fcntl(input[1], F_SETFL, O_NONBLOCK) < 0)) {
+        log("Unable to spawn %s: %s", r->path, strerror(errno));
+        close(fds[0]);
+        if (input[1] >= 0) {
+            close(input[1]);
+        }
+        if (pid > 0) {
+            kill(pid, SIGKILL);
+            reap_child(pid);
         }
-        if (header->value) {
-            setenv(envname, header->value, 1);
+        if (expects_continue(r)) {
+            refuse_body(r);
         }
+        return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+    }
+
+    /* Let the body move in large batches (where allowed) */
+    if (input[1] >= 0) {
+        fcntl(input[1], F_SETPIPE_SZ, INPUT_PIPE_SIZE);
+    }
+    if (input[1] >= 0 && expects_continue(r)) {
+        fputs("HTTP/1.1 100 Continue\r\n\r\n", r->file);
+    }
+
+    /* The response head follows once the script has written its own */
+    r->pipe_fd        = fds[0];
+    r->pipe_pid       = pid;
+    r->pipe_head      = head;
+    r->pipe_head_size = CGI_HEAD_SIZE;
+    r->pipe_copy      = r->cache_entry != NULL;
+    r->input_fd       = input[1];
+    return HTTP_STATUS_OK;
+}
+
+/**
+ * Handle request for URI under a plugin's prefix (see plugin_request).
+ *
+ * The plugin runs right here, in the thread (or process) serving the
+ * request, and writes what a CGI script would; its output is complete when
+ * it returns, so it is sent with a Content-Length (see handle_cgi_output).
+ * Plugins take no request body, so a request's body is read and discarded
+ * after the response (see write_response), as for static files.
+ *
+ * If the plugin fails, then handle error with
+ * HTTP_STATUS_INTERNAL_SERVER_ERROR.
+ **/
+http_status
+handle_plugin_request(struct request *r, const struct plugin *plugin)
+{
+    char *output = NULL;
+    size_t noutput = 0;
+    FILE *out;
+
+    out = open_memstream(&output, &noutput);
+    int status = out ? plugin_request(plugin, r, out) : -1;
+    if (out && fclose(out) != 0) {
+        status = -1;
     }
 
-    /* POpen CGI Script */
-    pfs = popen(r->path, "r");
-    if (!pfs) {
+    if (status < 0) {
+        log("Plugin %s failed on %s", plugin->path, r->uri);
+        free(output);
         return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
     }
-    fprintf(r->file, "HTTP/1.0 %s\r\n", http_status_string(HTTP_STATUS_OK));
+    http_status result = handle_cgi_output(r, output, noutput);
+    free(output);
+    return result;
+}
 
-    /* Copy data from popen to socket */
-    size_t nread;
-    while ((nread = fread(buffer, 1, sizeof(buffer), pfs)) > 0) {
-        if (fwrite(buffer, 1, nread, r->file) != nread) {
-            pclose(pfs);
-            return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+/**
+ * Find next line of script's header block, from *line up to end, storing
+ * its length (without line break) in length and advancing *line past it.
+ *
+ * Returns the line, or NULL if the rest holds no complete line.
+ **/
+static const char *
+cgi_head_line(const char **line, const char *end, size_t *length)
+{
+    const char *start = *line;
+    const char *newline = memchr(start, '\n', end - start);
+
+    if (!newline) {
+        return NULL;
+    }
+    *length = newline - start;
+    if (*length > 0 && start[*length - 1] == '\r') {
+        (*length)--;
+    }
+    *line = newline + 1;
+    return start;
+}
+
+/**
+ * Return whether header line has the given name (compared
+ * case-insensitively).
+ **/
+static bool
+cgi_head_is(const char *line, size_t length, const char *name)
+{
+    size_t nname = strlen(name);
+
+    return length > nname && line[nname] == ':' && strncasecmp(line, name, nname) == 0;
+}
+
+/**
+ * Handle script's header block
+ *
+ * Scripts start their output with a CGI header block: header lines ended by
+ * an empty line (with LF or CRLF line breaks), optionally preceded by an
+ * HTTP status line.  The status comes from that line, a Status header, or
+ * a Location header (302 Found), and is 200 OK otherwise.  Headers that the
+ * server sets itself (framing, connection, and date) are dropped, and the
+ * others passed on.  This writes the response head accordingly.
+ *
+ * If complete, output holds all of the script's output, so the body is sent
+ * with its length.  Otherwise it streams: in chunks under HTTP/1.1 (see
+ * relay_pipe), and under HTTP/1.0 up to the end of the connection.  body
+ * tells whether the body is to be sent at all (not in response to HEAD, or
+ * with 1xx, 204, and 304 statuses).
+ *
+ * Returns the length of the header block in output, 0 if output does not
+ * hold all of it yet, and -1 if it is malformed (nothing is written then).
+ **/
+ssize_t
+handle_cgi_head(struct request *r, const char *output, size_t noutput, bool complete, bool *body)
+{
+    static const char *dropped[] = {
+        "Status", "Connection", "Keep-Alive", "Transfer-Encoding", "Content-Length", "Date", NULL,
+    };
+    const char *end = output + noutput;
+    const char *line;
+    const char *next = output;
+    size_t length;
+    const char *status = NULL;
+    size_t nstatus = 0;
+    bool   located = false;
+
+    /* Check header lines up to the empty line, and determine status */
+    while ((line = cgi_head_line(&next, end, &length)) && length > 0) {
+        if (line == output && length > 5 && strncmp(line, "HTTP/", 5) == 0) {
+            status = memchr(line, ' ', length);
+            nstatus = status ? (size_t)(line + length - ++status) : 0;
+            continue;
         }
+        if (line[0] == ':' || !memchr(line, ':', length)) {
+            return -1;
+        }
+        if (cgi_head_is(line, length, "Status")) {
+            status  = line + 7;
+            nstatus = length - 7;
+        }
+        located |= cgi_head_is(line, length, "Location");
+    }
+    if (!line) {
+        return complete ? -1 : 0;
+    }
+
+    while (nstatus > 0 && (*status == ' ' || *status == '\t')) {
+        status++;
+        nstatus--;
+    }
+    if (!status) {
+        status  = located ? "302 Found" : "200 OK";
+        nstatus = strlen(status);
+    }
+    if (nstatus < 3 || (nstatus > 3 && status[3] != ' ') ||
+        status[0] < '1' || status[0] > '5' ||
+        status[1] < '0' || status[1] > '9' || status[2] < '0' || status[2] > '9') {
+        return -1;
     }
 
-    /* Close popen, flush socket, return OK */
-    pclose(pfs);
-    fflush(r->file);
+    /* Determine how the body (if any) is framed */
+    int  code   = (status[0] - '0') * 100 + (status[1] - '0') * 10 + (status[2] - '0');
+    bool nobody = code < 200 || code == 204 || code == 304;
+    ssize_t nhead = next - output;
+
+    *body = !nobody && !streq(r->method, "HEAD");
+    if (!complete && *body && !streq(r->version, "HTTP/1.1")) {
+        r->keepalive = false;
+    }
+
+    /* Write status line, the script's headers, and framing */
+    char line_status[64];
+    snprintf(line_status, sizeof(line_status), "%.*s%s", (int)nstatus, status, nstatus == 3 ? " " : "");
+    write_status(r, line_status);
+
+    next = output;
+    while ((line = cgi_head_line(&next, end, &length)) && length > 0) {
+        bool drop = line == output && strncmp(line, "HTTP/", 5) == 0;
+        for (const char **name = dropped; *name && !drop; name++) {
+            drop = cgi_head_is(line, length, *name);
+        }
+        if (!drop) {
+            fwrite(line, 1, length, r->file);
+            fputs("\r\n", r->file);
+        }
+    }
+
+    if (complete && !nobody) {
+        fprintf(r->file, "Content-Length: %zu\r\n", noutput - nhead);
+    } else if (!complete && *body && r->keepalive) {
+        fputs("Transfer-Encoding: chunked\r\n", r->file);
+        r->pipe_chunked = true;
+    }
+    fputs("\r\n", r->file);
+    return nhead;
+}
+
+/**
+ * Handle script's complete output: its header block becomes the response
+ * head (see handle_cgi_head), followed by the rest as body.
+ *
+ * If the header block is malformed, then handle error with
+ * HTTP_STATUS_INTERNAL_SERVER_ERROR.
+ **/
+http_status
+handle_cgi_output(struct request *r, const char *output, size_t noutput)
+{
+    bool body;
+    ssize_t nhead = handle_cgi_head(r, output, noutput, true, &body);
+
+    if (nhead < 0) {
+        log("Malformed header block from %s", r->path);
+        return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+    }
+    if (body) {
+        fwrite(output + nhead, 1, noutput - nhead, r->file);
+    }
     return HTTP_STATUS_OK;
 }
 
@@ -252,23 +1554,57 @@ http_status
 handle_error(struct request *r, http_status status)
 {
     const char *status_string = http_status_string(status);
+    char body[BUFSIZ];
+    int nbody;
+
+    /* Format HTML Description of Error */
+    nbody = snprintf(body, sizeof(body),
+            "<html><head><title>%s</title></head><body>\n"
+            "<h1>%s</h1>\n"
+            "<p>The requested URL %s resulted in an error.</p>\n"
+            "</body></html>\n",
+            status_string, status_string, r->uri ? r->uri : "/");
+    if (nbody >= (int)sizeof(body)) {
+        nbody = sizeof(body) - 1;
+    }
 
     /* Write HTTP Header */
-    fprintf(r->file, "HTTP/1.0 %s\r\n", status_string);
-    fprintf(r->file, "Content-Type: text/html\r\n");
-    fprintf(r->file, "\r\n");
+    handle_status(r, status);
+    fprintf(r->file, "Content-Type: text/html\r\nContent-Length: %d\r\n\r\n", nbody);
 
     /* Write HTML Description of Error*/
-    fprintf(r->file, "<html><head><title>%s</title></head><body>\n", status_string);
-    fprintf(r->file, "<h1>%s</h1>\n", status_string);
-    fprintf(r->file, "<p>The requested URL %s resulted in an error.</p>\n",
-            r->uri ? r->uri : "/");
-    fprintf(r->file, "</body></html>\n");
-
-    fflush(r->file);
+    fwrite(body, 1, nbody, r->file);
 
     /* Return specified status */
     return status;
 }
 
+/**
+ * Write HTTP status line, Connection header, and Date header
+ *
+ * Responses are HTTP/1.1; the Connection header tells the client whether
+ * the server keeps the connection open after this response.  These lines
+ * start every response, so they are assembled from constant pieces and the
+ * cached date (see http_date) rather than formatted.
+ **/
+void
+handle_status(struct request *r, http_status status)
+{
+    write_status(r, http_status_string(status));
+}
+
+/**
+ * Write status line (from status code and reason phrase), Connection
+ * header, and Date header.
+ **/
+static void
+write_status(struct request *r, const char *status)
+{
+    fputs("HTTP/1.1 ", r->file);
+    fputs(status, r->file);
+    fputs(r->keepalive ? "\r\nConnection: keep-alive\r\nDate: " : "\r\nConnection: close\r\nDate: ", r->file);
+    fputs(http_date(), r->file);
+    fputs("\r\n", r->file);
+}
+
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,158 @@
+/* listing.c: Directory Listing Cache */
+
+#include "mainServer.h"
+
+#include <pthread.h>
+#include <string.h>
+
+#define LISTING_BUCKETS 64      /* Hash table size (power of two) */
+
+/**
+ * Cached listing: precomputed response headers followed by rendered HTML.
+ **/
+struct listing_entry {
+    struct lru_node  node;          /* Table links, keyed by path (must be first) */
+    char            *path;          /* Resolved directory path */
+    struct timespec  mtime;         /* Directory modification time when rendered */
+    char            *data;          /* Headers and listing */
+    size_t           ndata;
+};
+
+/* Cache state (shared by all threads, protected by ListingLock) */
+
+static pthread_mutex_t       ListingLock  = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t        ListingOnce  = PTHREAD_ONCE_INIT;
+static struct lru_node      *ListingBuckets[LISTING_BUCKETS];
+static struct lru            ListingTable = {.buckets = ListingBuckets, .nbuckets = LISTING_BUCKETS};
+
+/**
+ * Remove entry from cache and deallocate it (ListingLock must be held).
+ **/
+static void
+listing_remove(struct listing_entry *e)
+{
+    lru_remove(&ListingTable, &e->node);
+    free(e->path);
+    free(e->data);
+    free(e);
+}
+
+/**
+ * Invalidate listings of directories that changed (watch handler).
+ *
+ * A listing is stale if an entry directly inside its directory changed, or
+ * if the directory itself (or one of its ancestors) was changed or moved.
+ **/
+static void
+listing_invalidate(const char *path)
+{
+    const char *slash = path ? strrchr(path, '/') : NULL;
+    size_t length = path ? strlen(path) : 0;
+    size_t nparent = slash ? (size_t)(slash - path) : 0;
+
+    pthread_mutex_lock(&ListingLock);
+    for (struct listing_entry *e = (struct listing_entry *)ListingTable.head, *next; e; e = next) {
+        next = (struct listing_entry *)e->node.next;
+        if (!path ||
+            (strncmp(e->path, path, length) == 0 && (e->path[length] == '\0' || e->path[length] == '/')) ||
+            (slash && strlen(e->path) == nparent && strncmp(e->path, path, nparent) == 0)) {
+            debug("Invalidating directory listing %s", e->path);
+            listing_remove(e);
+        }
+    }
+    pthread_mutex_unlock(&ListingLock);
+}
+
+/**
+ * Subscribe to filesystem changes (once).
+ **/
+static void
+listing_init(void)
+{
+    watch_subscribe(listing_invalidate);
+}
+
+/**
+ * Serve directory listing from cache.
+ *
+ * If a listing of the request path rendered while the directory had the
+ * modification time in st is cached, this writes the OK status line
+ * followed by the cached headers and listing to the response and returns
+ * true.  Otherwise it starts watching the directory (so changes made while
+ * the caller reads it are noticed) and returns false.
+ **/
+bool
+listing_lookup(struct request *r, const struct stat *st)
+{
+    struct listing_entry *e;
+
+    pthread_once(&ListingOnce, listing_init);
+    watch_poll();
+
+    pthread_mutex_lock(&ListingLock);
+    e = (struct listing_entry *)lru_find(&ListingTable, r->path);
+    if (e && (e->mtime.tv_sec != st->st_mtim.tv_sec || e->mtime.tv_nsec != st->st_mtim.tv_nsec)) {
+        listing_remove(e);
+        e = NULL;
+    }
+    if (e) {
+        lru_touch(&ListingTable, &e->node);
+        handle_status(r, HTTP_STATUS_OK);
+        fwrite(e->data, 1, e->ndata, r->file);
+    }
+    pthread_mutex_unlock(&ListingLock);
+
+    if (!e) {
+        watch_directory(r->path);
+    }
+    return e != NULL;
+}
+
+/**
+ * Add listing to cache, taking ownership of data (headers followed by the
+ * listing rendered while the directory had the modification time in st).
+ *
+ * Only LISTING_MAX listings of at most LISTING_ENTRY_MAX bytes are kept,
+ * evicting the least recently used ones.  Listings of directories that
+ * cannot be watched are not cached.
+ **/
+void
+listing_insert(const char *path, const struct stat *st, char *data, size_t ndata)
+{
+    struct listing_entry *e;
+
+    if (ndata > LISTING_ENTRY_MAX || watch_directory(path) < 0) {
+        free(data);
+        return;
+    }
+
+    e = calloc(1, sizeof(struct listing_entry));
+    if (!e || !(e->path = strdup(path))) {
+        free(e);
+        free(data);
+        return;
+    }
+    e->node.key = e->path;
+    e->mtime    = st->st_mtim;
+    e->data     = data;
+    e->ndata    = ndata;
+
+    pthread_mutex_lock(&ListingLock);
+
+    /* Replace any existing entry (another thread may have raced us) */
+    struct listing_entry *old = (struct listing_entry *)lru_find(&ListingTable, path);
+    if (old) {
+        listing_remove(old);
+    }
+
+    /* Evict least recently used entries until there is room */
+    while (ListingTable.head && ListingTable.count >= LISTING_MAX) {
+        listing_remove((struct listing_entry *)ListingTable.head);
+    }
+
+    lru_insert(&ListingTable, &e->node);
+
+    pthread_mutex_unlock(&ListingLock);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,107 @@
+/* lru.c: Hashed LRU Tables */
+
+#include "mainServer.h"
+
+#include <string.h>
+
+/**
+ * Hash string (FNV-1a).
+ **/
+size_t
+hash_string(const char *s)
+{
+    size_t hash = 2166136261u;
+    for (const char *c = s; *c; c++) {
+        hash = (hash ^ (unsigned char)*c) * 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * Return head of hash chain that key belongs to.
+ **/
+static struct lru_node **
+lru_bucket(struct lru *t, const char *key)
+{
+    return &t->buckets[hash_string(key) & (t->nbuckets - 1)];
+}
+
+/**
+ * Find node for key.
+ **/
+struct lru_node *
+lru_find(struct lru *t, const char *key)
+{
+    for (struct lru_node *n = *lru_bucket(t, key); n; n = n->hnext) {
+        if (streq(n->key, key)) {
+            return n;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Unlink node from LRU list.
+ **/
+static void
+lru_unlink(struct lru *t, struct lru_node *n)
+{
+    if (n->prev) n->prev->next = n->next; else t->head = n->next;
+    if (n->next) n->next->prev = n->prev; else t->tail = n->prev;
+    n->prev = n->next = NULL;
+}
+
+/**
+ * Append node to LRU list as most recently used.
+ **/
+static void
+lru_append(struct lru *t, struct lru_node *n)
+{
+    n->prev = t->tail;
+    n->next = NULL;
+    if (t->tail) t->tail->next = n; else t->head = n;
+    t->tail = n;
+}
+
+/**
+ * Add node (whose key is set) to table as most recently used.
+ **/
+void
+lru_insert(struct lru *t, struct lru_node *n)
+{
+    struct lru_node **bucket = lru_bucket(t, n->key);
+
+    n->hnext = *bucket;
+    *bucket  = n;
+    lru_append(t, n);
+    t->count++;
+}
+
+/**
+ * Mark node as most recently used.
+ **/
+void
+lru_touch(struct lru *t, struct lru_node *n)
+{
+    lru_unlink(t, n);
+    lru_append(t, n);
+}
+
+/**
+ * Remove node from table (freeing the entry around it is up to the caller).
+ **/
+void
+lru_remove(struct lru *t, struct lru_node *n)
+{
+    struct lru_node **link = lru_bucket(t, n->key);
+
+    while (*link != n) {
+        link = &(*link)->hnext;
+    }
+    *link = n->hnext;
+
+    lru_unlink(t, n);
+    t->count--;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
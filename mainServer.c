@@ -2,6 +2,7 @@
 
 #include "mainServer.h"
 #include <errno.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <string.h>
 
@@ -13,6 +14,15 @@ char *MimeTypesPath   = "/etc/mime.types";
 char *DefaultMimeType = "text/plain";
 char *RootPath	      = "www";
 mode  ConcurrencyMode = SINGLE;
+long  Workers         = 0;
+long  KeepAliveTimeout = 5;
+long  KeepAliveMax    = 100;
+bool  SendFile        = true;
+size_t CacheSize      = 16 << 20;
+long  CgiWorkers      = 4;
+size_t MaxBodySize    = 64 << 20;
+long  MicrocacheTTL   = 0;
+char *MicrocacheVary  = NULL;
 
 /**
  * Display usage message.
@@ -20,17 +30,45 @@ mode  ConcurrencyMode = SINGLE;
 void
 usage(const char *progname, int status)
 {
-    fprintf(stderr, "Usage: %s [hcmMpr]\n", progname);
+    fprintf(stderr, "Usage: %s [hbcCfknmMpPrstVw]\n", progname);
     fprintf(stderr, "Options:\n");
     fprintf(stderr, "    -h            Display help message\n");
-    fprintf(stderr, "    -c mode       Single or Forking mode\n");
+    fprintf(stderr, "    -b bytes      Largest request body accepted (K, M, or G suffix; 0 refuses bodies)\n");
+    fprintf(stderr, "    -c mode       Single, Forking, Event, Uring, Threaded, or Prefork mode\n");
+    fprintf(stderr, "    -C bytes      File cache size (K, M, or G suffix; 0 disables)\n");
+    fprintf(stderr, "    -f workers    Persistent workers per .fcgi script (0 runs them as CGI)\n");
+    fprintf(stderr, "    -k seconds    Idle connection timeout\n");
+    fprintf(stderr, "    -n requests   Maximum requests per connection\n");
     fprintf(stderr, "    -m path       Path to mimetypes file\n");
     fprintf(stderr, "    -M mimetype   Default mimetype\n");
     fprintf(stderr, "    -p port       Port to listen on\n");
+    fprintf(stderr, "    -P prefix=so  Handle URIs under prefix with plugin shared object (repeatable)\n");
     fprintf(stderr, "    -r path       Root directory\n");
+    fprintf(stderr, "    -s method     Send files with sendfile (default) or copy\n");
+    fprintf(stderr, "    -t seconds    Cache script responses (0 disables, the default)\n");
+    fprintf(stderr, "    -V headers    Request headers cached script responses vary by (comma-separated)\n");
+    fprintf(stderr, "    -w workers    Number of worker threads or processes\n");
     exit(status);
 }
 
+/**
+ * Parse byte count with optional K, M, or G suffix, returning false if s is
+ * not one.
+ **/
+static bool
+parse_size(const char *s, size_t *size)
+{
+    char *suffix;
+
+    *size = strtoull(s, &suffix, 10);
+    switch (*suffix) {
+        case 'G': *size <<= 10; /* Fallthrough */
+        case 'M': *size <<= 10; /* Fallthrough */
+        case 'K': *size <<= 10; suffix++; break;
+    }
+    return suffix != s && !*suffix;
+}
+
 /**
  * Parses command line options and starts appropriate server
  **/
@@ -42,16 +80,48 @@ main(int argc, char *argv[])
         if (strcmp(argv[c], "-h") == 0) {
             usage(argv[0], EXIT_SUCCESS);
 
+        } else if (strcmp(argv[c], "-b") == 0) {
+            if (++c >= argc) usage(argv[0], EXIT_FAILURE);
+            if (!parse_size(argv[c], &MaxBodySize)) usage(argv[0], EXIT_FAILURE);
+
         } else if (strcmp(argv[c], "-c") == 0) {
             if (++c >= argc) usage(argv[0], EXIT_FAILURE);
             if (strcmp(argv[c], "single") == 0) {
                 ConcurrencyMode = SINGLE;
             } else if (strcmp(argv[c], "forking") == 0) {
                 ConcurrencyMode = FORKING;
+            } else if (strcmp(argv[c], "event") == 0) {
+                ConcurrencyMode = EVENT;
+            } else if (strcmp(argv[c], "uring") == 0) {
+                ConcurrencyMode = URING;
+            } else if (strcmp(argv[c], "threaded") == 0) {
+                ConcurrencyMode = THREADED;
+            } else if (strcmp(argv[c], "prefork") == 0) {
+                ConcurrencyMode = PREFORK;
             } else {
                 usage(argv[0], EXIT_FAILURE);
             }
 
+        } else if (strcmp(argv[c], "-C") == 0) {
+            if (++c >= argc) usage(argv[0], EXIT_FAILURE);
+            if (!parse_size(argv[c], &CacheSize)) usage(argv[0], EXIT_FAILURE);
+
+        } else if (strcmp(argv[c], "-f") == 0) {
+            if (++c >= argc) usage(argv[0], EXIT_FAILURE);
+            char *end;
+            CgiWorkers = strtol(argv[c], &end, 10);
+            if (end == argv[c] || *end || CgiWorkers < 0) usage(argv[0], EXIT_FAILURE);
+
+        } else if (strcmp(argv[c], "-k") == 0) {
+            if (++c >= argc) usage(argv[0], EXIT_FAILURE);
+            KeepAliveTimeout = strtol(argv[c], NULL, 10);
+            if (KeepAliveTimeout <= 0) usage(argv[0], EXIT_FAILURE);
+
+        } else if (strcmp(argv[c], "-n") == 0) {
+            if (++c >= argc) usage(argv[0], EXIT_FAILURE);
+            KeepAliveMax = strtol(argv[c], NULL, 10);
+            if (KeepAliveMax <= 0) usage(argv[0], EXIT_FAILURE);
+
         } else if (strcmp(argv[c], "-m") == 0) {
             if (++c >= argc) usage(argv[0], EXIT_FAILURE);
             MimeTypesPath = argv[c];
@@ -64,17 +134,46 @@ main(int argc, char *argv[])
             if (++c >= argc) usage(argv[0], EXIT_FAILURE);
             Port = argv[c];
 
+        } else if (strcmp(argv[c], "-P") == 0) {
+            if (++c >= argc) usage(argv[0], EXIT_FAILURE);
+            if (plugin_load(argv[c]) < 0) return EXIT_FAILURE;
+
         } else if (strcmp(argv[c], "-r") == 0) {
             if (++c >= argc) usage(argv[0], EXIT_FAILURE);
             RootPath = argv[c];
 
+        } else if (strcmp(argv[c], "-s") == 0) {
+            if (++c >= argc) usage(argv[0], EXIT_FAILURE);
+            if (strcmp(argv[c], "sendfile") == 0) {
+                SendFile = true;
+            } else if (strcmp(argv[c], "copy") == 0) {
+                SendFile = false;
+            } else {
+                usage(argv[0], EXIT_FAILURE);
+            }
+
+        } else if (strcmp(argv[c], "-t") == 0) {
+            if (++c >= argc) usage(argv[0], EXIT_FAILURE);
+            char *end;
+            MicrocacheTTL = strtol(argv[c], &end, 10);
+            if (end == argv[c] || *end || MicrocacheTTL < 0) usage(argv[0], EXIT_FAILURE);
+
+        } else if (strcmp(argv[c], "-V") == 0) {
+            if (++c >= argc) usage(argv[0], EXIT_FAILURE);
+            MicrocacheVary = argv[c];
+
+        } else if (strcmp(argv[c], "-w") == 0) {
+            if (++c >= argc) usage(argv[0], EXIT_FAILURE);
+            Workers = strtol(argv[c], NULL, 10);
+            if (Workers <= 0) usage(argv[0], EXIT_FAILURE);
+
         } else {
             usage(argv[0], EXIT_FAILURE);
         }
     }
 
     /* Listen to server socket */
-    int sock_fd = socket_listen(Port);
+    int sock_fd = socket_listen(Port, ConcurrencyMode == PREFORK);
     if (sock_fd < 0) {
         return EXIT_FAILURE;
     }
@@ -91,12 +190,39 @@ main(int argc, char *argv[])
     debug("RootPath        = %s", RootPath);
     debug("MimeTypesPath   = %s", MimeTypesPath);
     debug("DefaultMimeType = %s", DefaultMimeType);
-    debug("ConcurrencyMode = %s", ConcurrencyMode == SINGLE ? "Single" : "Forking");
+    debug("KeepAlive       = %lds, %ld requests", KeepAliveTimeout, KeepAliveMax);
+    debug("SendFile        = %s", SendFile ? "Yes" : "No");
+    debug("CacheSize       = %zu", CacheSize);
+    debug("MaxBodySize     = %zu", MaxBodySize);
+    debug("Microcache      = %lds, varying by %s", MicrocacheTTL, MicrocacheVary ? MicrocacheVary : "nothing");
+    debug("ConcurrencyMode = %s", ConcurrencyMode == SINGLE  ? "Single"  :
+                                  ConcurrencyMode == FORKING ? "Forking" :
+                                  ConcurrencyMode == EVENT   ? "Event"   :
+                                  ConcurrencyMode == URING   ? "Uring"   :
+                                  ConcurrencyMode == THREADED ? "Threaded" : "Prefork");
+
+    /* Writes to closed sockets are reported through errno instead */
+    signal(SIGPIPE, SIG_IGN);
+
+    /* Report file cache statistics on request */
+    signal(SIGUSR1, cache_report);
+
+    /* Load mimetypes once, and again whenever SIGHUP is received */
+    load_mimetypes();
+    signal(SIGHUP, reload_mimetypes);
 
-    /* Start either forking or single HTTP server */
+    /* Start forking, event, uring, threaded, prefork, or single HTTP server */
 
     if (ConcurrencyMode == FORKING){
         forking_server(sock_fd);
+    } else if (ConcurrencyMode == EVENT) {
+        event_server(sock_fd);
+    } else if (ConcurrencyMode == URING) {
+        uring_server(sock_fd);
+    } else if (ConcurrencyMode == THREADED) {
+        threaded_server(sock_fd);
+    } else if (ConcurrencyMode == PREFORK) {
+        prefork_server(sock_fd);
     } else {
         single_server(sock_fd);
     }
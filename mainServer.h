@@ -2,15 +2,45 @@
 #define SPIDEY_H
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 
+#include <net/if.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 /* Constants */
 
 #define WHITESPACE	" \t\n"
+#define REQUEST_BUFSIZ	(4*BUFSIZ)	/* Maximum size of request head */
+#define REQUEST_HEADERS	64		/* Maximum number of request headers */
+#define REQUEST_ARENA	1024		/* Per-request allocations kept in struct request */
+#define REQUEST_POOL	64		/* Freed request structs kept for reuse */
+#define REQUEST_RANGES	16		/* Maximum byte ranges sent in one response */
+#define RESPONSE_BATCH	(8*BUFSIZ)	/* Buffered response size that ends batching */
+#define RESPONSE_INLINE	(2*BUFSIZ)	/* Largest file copied into response buffer */
+#define CACHE_ENTRY_MAX	(8*BUFSIZ)	/* Largest file kept in file cache */
+#define OPENFILE_MAX	1024		/* Maximum open file cache entries */
+#define OPENFILE_VALID	5		/* Seconds before open file cache entries are resolved again */
+#define LISTING_MAX	64		/* Maximum directory listing cache entries */
+#define LISTING_ENTRY_MAX	(1<<20)	/* Largest listing kept in directory listing cache */
+#define LISTING_SORTED	10000		/* Most entries sorted into one listing (larger ones are paged) */
+#define LISTING_PAGE	1000		/* Default entries per listing page */
+#define LISTING_PAGE_MAX	10000	/* Maximum entries per listing page */
+#define WORKER_SUFFIX	".fcgi"		/* Scripts served by persistent workers */
+#define WORKER_RESPAWN	1		/* Seconds a worker must run to be respawned when it dies */
+#define MICROCACHE_MAX	256		/* Maximum script response micro-cache entries */
+#define MICROCACHE_ENTRY_MAX	(1<<18)	/* Largest script output kept in micro-cache */
+#define PLUGIN_MAX	16		/* Maximum handler plugins */
+#define CGI_HEAD_MAX	BUFSIZ		/* Largest header block accepted from script */
+#define CGI_HEAD_SIZE	512		/* Room first set aside for it (fits the request arena) */
+#define REAP_MAX	1024		/* Exited scripts waiting to be reaped */
+#define INPUT_PIPE_SIZE	(1<<20)		/* Capacity of pipe feeding request body to script */
 
 /**
  * Concurrency modes
@@ -18,6 +48,10 @@
 typedef enum {
     SINGLE,     /**< Single connection */
     FORKING,    /**< Process per connection */
+    EVENT,      /**< Non-blocking connections on epoll */
+    URING,      /**< Asynchronous connections on io_uring (or epoll) */
+    THREADED,   /**< Pool of worker threads */
+    PREFORK,    /**< Pre-forked worker processes */
     UNKNOWN
 } mode;
 
@@ -28,6 +62,15 @@ extern char *Port;                  /**< Port number */
 extern char *MimeTypesPath;         /**< Path to mime.types file */
 extern char *DefaultMimeType;       /**< Default file mimetype */
 extern char *RootPath;              /**< Path to root directory */
+extern long  Workers;               /**< Number of workers (0 = default) */
+extern long  KeepAliveTimeout;      /**< Idle connection timeout (seconds) */
+extern long  KeepAliveMax;          /**< Maximum requests per connection */
+extern bool  SendFile;              /**< Send file bodies with sendfile(2) */
+extern size_t CacheSize;            /**< File cache memory budget (bytes) */
+extern long  CgiWorkers;            /**< Persistent workers per script (0 = plain CGI) */
+extern size_t MaxBodySize;          /**< Largest request body accepted (bytes) */
+extern long  MicrocacheTTL;         /**< Seconds script responses are cached (0 = disabled) */
+extern char *MicrocacheVary;        /**< Request headers cached script responses vary by (comma-separated) */
 
 /* Logging Macros */
 
@@ -42,30 +85,140 @@ extern char *RootPath;              /**< Path to root directory */
 
 /* HTTP Request */
 
+typedef enum {
+    HEADER_HOST,
+    HEADER_CONNECTION,
+    HEADER_CONTENT_LENGTH,
+    HEADER_CONTENT_TYPE,
+    HEADER_TRANSFER_ENCODING,
+    HEADER_EXPECT,
+    HEADER_ACCEPT_ENCODING,
+    HEADER_RANGE,
+    HEADER_IF_RANGE,
+    HEADER_IF_NONE_MATCH,
+    HEADER_IF_MODIFIED_SINCE,
+    HEADER_UNKNOWN,         /**< Any other header (also: number of well-known headers) */
+} header_id;
+
 struct header {
-    char *name;
-    char *value;
+    char  *name;            /*< Header name (in request buffer) */
+    char  *value;           /*< Header value (in request buffer) */
+    size_t nname;           /*< Length of name */
+    size_t nvalue;          /*< Length of value */
+};
 
-    struct header *next;
+struct arena_block;
+struct microcache_entry;
+struct worker;
+struct worker_pool;
+
+struct body_range {
+    size_t position;        /*< Response stream bytes sent before this range */
+    off_t  offset;          /*< Next offset to send from body_fd */
+    off_t  length;          /*< Remaining bytes to send from body_fd */
 };
 
+typedef enum {
+    REQUEST_READING,        /**< Reading request head from socket */
+    REQUEST_WRITING,        /**< Writing response to socket */
+    REQUEST_CLOSED,         /**< Closed, waiting to be freed (used by event server) */
+} request_state;
+
+typedef enum {
+    BODY_NONE,              /**< No request body (left) to read */
+    BODY_LENGTH,            /**< Reading body_left more bytes (Content-Length) */
+    BODY_CHUNK_SIZE,        /**< Reading chunk size line */
+    BODY_CHUNK_DATA,        /**< Reading body_left more bytes of chunk */
+    BODY_CHUNK_END,         /**< Reading line break that ends chunk */
+    BODY_TRAILER,           /**< Reading trailer lines up to empty line */
+} body_state;
+
 struct request {
     int   fd;               /*< Client socket file descripter */
-    FILE *file;             /*< Client socket file stream */
-    char *method;           /*< HTTP method */
-    char *uri;              /*< HTTP uniform resource identifier */
-    char *path;             /*< Real path corrsponding to URI and RootPath */
-    char *query;            /*< HTTP query string */
+    FILE *file;             /*< Response stream (buffered in memory) */
+    char *method;           /*< HTTP method (in request buffer) */
+    char *uri;              /*< HTTP uniform resource identifier (in request buffer) */
+    char *path;             /*< Real path corrsponding to URI and RootPath (in arena) */
+    char *query;            /*< HTTP query string (in request buffer) */
+    char *version;          /*< HTTP version (in request buffer) */
+
+    char host[INET6_ADDRSTRLEN + IF_NAMESIZE];  /*< Numeric client address */
+    char port[sizeof("65535")];                 /*< Numeric client port */
+
+    struct header headers[REQUEST_HEADERS]; /*< Name, value pairs */
+    size_t nheaders;        /*< Number of headers */
+    uint8_t known[HEADER_UNKNOWN];  /*< 1 + index of first header with each well-known name (0 if absent) */
+
+    bool   keepalive;       /*< Keep connection open after response */
+    long   nrequests;       /*< Number of requests parsed on connection */
 
-    char host[NI_MAXHOST];
-    char port[NI_MAXSERV];
+    request_state state;    /*< Connection state (used by event server) */
+    uint32_t events;        /*< Registered epoll events (used by event server) */
+    time_t active;          /*< Time of last activity (used by event server) */
+    struct request *prev;   /*< Idle list links (used by event server) */
+    struct request *next;
 
-    struct header *headers; /*< List of name, value pairs */
+    char  *buffer;          /*< Raw request head read from socket */
+    size_t nbuffer;         /*< Number of bytes in buffer */
+    size_t start;           /*< Offset of current request head in buffer */
+    size_t nscanned;        /*< Offset up to which buffer was scanned */
+    size_t offset;          /*< Parse offset into buffer */
+
+    char   arena[REQUEST_ARENA] __attribute__((aligned(16)));  /*< Per-request allocations */
+    size_t narena;          /*< Bytes of arena in use */
+    struct arena_block *overflow;   /*< Allocations that did not fit in arena */
+
+    char  *response;        /*< Response data written to file stream */
+    size_t nresponse;       /*< Number of bytes in response */
+    size_t nsent;           /*< Number of response bytes sent */
+    int    body_fd;         /*< File whose ranges are streamed within response (or -1) */
+    struct body_range *ranges;  /*< Ranges of body_fd to send (in arena) */
+    size_t nranges;         /*< Number of queued ranges */
+    size_t nextrange;       /*< Index of next range to send */
+    bool   corked;          /*< Whether TCP_CORK is set on socket */
+    int    pipe_fd;         /*< Non-blocking pipe whose output follows the response stream (or -1) */
+    pid_t  pipe_pid;        /*< Process writing into pipe_fd (or 0) */
+    bool   pipe_copy;       /*< Whether pipe output is copied through the response stream rather than spliced */
+    char  *pipe_head;       /*< Script's header block read from pipe so far (in arena; NULL once parsed) */
+    size_t npipe_head;      /*< Number of bytes in pipe_head */
+    size_t pipe_head_size;  /*< Room in pipe_head (doubled up to CGI_HEAD_MAX as needed) */
+    bool   pipe_chunked;    /*< Whether pipe output is sent with chunked transfer coding */
+    size_t pipe_chunk;      /*< Bytes of pipe output still to splice as part of the current chunk */
+    int    input_fd;        /*< Non-blocking pipe the request body is fed into (script's standard input, or -1) */
+    bool   input_full;      /*< Whether input_fd was full when last written */
+    struct microcache_entry *cache_entry;   /*< Micro-cache entry this request's script output fills, or that it waits for (or NULL) */
+    int    cache_fd;        /*< Readable once the script run waited for is done (or -1) */
+    struct request *cache_next; /*< Next request waiting for the same entry */
+    struct worker *worker;  /*< Persistent worker whose answer the request awaits (or NULL) */
+    struct worker_pool *worker_pool;    /*< Pool whose workers are all busy, waited for (or NULL) */
+    int    worker_fd;       /*< Readable once a worker of that pool may be free (or -1) */
+    struct request *worker_next;    /*< Next request waiting for the same pool */
+    body_state body;        /*< Request body framing state */
+    off_t  body_left;       /*< Body bytes still to read (of the current chunk, if chunked) */
+    off_t  body_total;      /*< Body bytes announced so far */
 };
 
 struct request *    accept_request(int sfd);
+struct request *    connection_request(int fd, const struct sockaddr *raddr, socklen_t rlen);
 void		    free_request(struct request *request);
+void *		    request_alloc(struct request *request, size_t size);
+char *		    request_strdup(struct request *request, const char *s);
+void		    reset_request(struct request *request);
 int		    parse_request(struct request *request);
+const char *	    request_header(struct request *request, const char *name);
+const char *	    request_known_header(struct request *request, header_id id);
+char *		    request_space(struct request *request, size_t *n);
+void		    request_received(struct request *request, size_t n);
+int		    read_request(struct request *request);
+bool		    buffered_request(struct request *request);
+int		    queue_body(struct request *request, off_t offset, off_t length);
+ssize_t		    relay_pipe(struct request *request);
+int		    pipe_relayed(struct request *request, size_t n);
+FILE *		    chunk_response(struct request *request);
+int		    read_body(struct request *request);
+size_t		    request_waits(struct request *request, struct pollfd *waits);
+int		    write_response(struct request *request);
+int		    rewind_response(struct request *request);
 
 /* HTTP Request Handlers */
 
@@ -73,38 +226,155 @@ typedef enum {
     REQUEST_BROWSE,
     REQUEST_FILE,
     REQUEST_CGI,
+    REQUEST_PLUGIN,
     REQUEST_BAD,
 } request_type;
 
 typedef enum {
     HTTP_STATUS_OK,			/* 200 OK */
+    HTTP_STATUS_PARTIAL_CONTENT,	/* 206 Partial Content */
+    HTTP_STATUS_NOT_MODIFIED,		/* 304 Not Modified */
     HTTP_STATUS_BAD_REQUEST,		/* 400 Bad Request */
     HTTP_STATUS_NOT_FOUND,		/* 404 Not Found */
+    HTTP_STATUS_PAYLOAD_TOO_LARGE,	/* 413 Payload Too Large */
+    HTTP_STATUS_RANGE_NOT_SATISFIABLE,	/* 416 Range Not Satisfiable */
     HTTP_STATUS_INTERNAL_SERVER_ERROR,	/* 500 Internal Server Error */
 } http_status;
 
+void		    handle_connection(struct request *request);
+void		    handle_pipeline(struct request *request);
 http_status	    handle_request(struct request *request);
 http_status handle_error(struct request *r, http_status status);
+void        handle_status(struct request *r, http_status status);
+http_status handle_cgi_request(struct request *r);
+bool        handle_worker_response(struct request *r);
+ssize_t     handle_cgi_head(struct request *r, const char *output, size_t noutput, bool complete, bool *body);
+http_status handle_cgi_output(struct request *r, const char *output, size_t noutput);
 
 /* HTTP Server */
 
 void		    single_server(int sfd);
 void		    forking_server(int sfd);
+void		    event_server(int sfd);
+void		    uring_server(int sfd);
 void		    threaded_server(int sfd);
+void		    prefork_server(int sfd);
+
+/* Hashed LRU Tables */
+
+/**
+ * Table entries embed an lru_node as their first member, so a node found
+ * in the table is the entry itself.  Tables are not locked: each cache
+ * guards its own with its lock.
+ **/
+struct lru_node {
+    const char      *key;   /*< Key the entry is found by (owned by the entry) */
+    struct lru_node *hnext; /*< Hash chain */
+    struct lru_node *prev;  /*< LRU list (least recently used first) */
+    struct lru_node *next;
+};
+
+struct lru {
+    struct lru_node **buckets;  /*< Hash chains */
+    size_t nbuckets;        /*< Number of buckets (power of two) */
+    struct lru_node *head;  /*< Least recently used entry */
+    struct lru_node *tail;  /*< Most recently used entry */
+    size_t count;           /*< Number of entries */
+};
+
+size_t		    hash_string(const char *s);
+struct lru_node *   lru_find(struct lru *table, const char *key);
+void		    lru_insert(struct lru *table, struct lru_node *node);
+void		    lru_touch(struct lru *table, struct lru_node *node);
+void		    lru_remove(struct lru *table, struct lru_node *node);
+
+/* File Cache */
+
+bool		    cache_lookup(struct request *request);
+void		    cache_insert(const char *path, char *data, size_t ndata);
+void		    cache_flush(void);
+void		    cache_report(int signum);
+
+/* Directory Listing Cache */
+
+bool		    listing_lookup(struct request *request, const struct stat *st);
+void		    listing_insert(const char *path, const struct stat *st, char *data, size_t ndata);
+
+/* Persistent CGI Workers */
+
+bool		    worker_script(const char *path);
+int		    worker_start(struct request *request, const char *vars, size_t nvars);
+int		    worker_receive(struct request *request, char **output, size_t *noutput);
+bool		    worker_ready(struct request *request);
+int		    worker_socket(const struct worker *worker);
+void		    worker_release(struct request *request);
+
+/* In-Process Handler Plugins */
+
+struct plugin_request;
+
+struct plugin {
+    char  *prefix;          /*< URI prefix handled by plugin (without trailing /) */
+    size_t nprefix;         /*< Length of prefix */
+    char  *path;            /*< Path of plugin's shared object */
+    int  (*handle)(const struct plugin_request *request, FILE *response);  /*< Plugin's plugin_handle */
+    void  *state;           /*< State stored by plugin's plugin_init */
+};
+
+int		    plugin_load(const char *spec);
+const struct plugin *	plugin_lookup(const char *uri);
+int		    plugin_request(const struct plugin *plugin, struct request *request, FILE *out);
+
+/* Script Response Micro-Cache */
+
+int		    microcache_lookup(struct request *request);
+void		    microcache_capture(struct request *request, const char *data, size_t n);
+bool		    microcache_ready(struct request *request);
+void		    microcache_release(struct request *request);
+
+/* Open File Cache */
+
+struct open_file {
+    char        *path;      /*< Real path corresponding to URI and RootPath */
+    request_type type;      /*< Request type of path */
+    struct stat  st;        /*< File status (REQUEST_FILE only) */
+    int          fd;        /*< Read-only descriptor (REQUEST_FILE only, or -1) */
+};
+
+int		    openfile_lookup(struct request *request, struct open_file *file);
+void		    openfile_close(struct open_file *file);
+
+/* Filesystem Change Notification */
+
+typedef void (*watch_handler)(const char *path);
+
+void		    watch_subscribe(watch_handler handler);
+int		    watch_directory(const char *dir);
+int		    watch_parent(const char *path);
+void		    watch_poll(void);
+
+/* Delimiter Scanning */
+
+size_t		    scan_delimiter(const char *s, size_t n, const char *delimiters);
 
 /* Socket */
 
-int		    socket_listen(const char *port);
+int		    socket_listen(const char *port, bool reuseport);
 
 /* Utilities */
 
 #define chomp(s)    (s)[strlen(s) - 1] = '\0'
 #define streq(a, b) (strcmp((a), (b)) == 0)
 
-char *		    determine_mimetype(const char *path);
+const char *	    determine_mimetype(struct request *r);
+void		    load_mimetypes(void);
+void		    reload_mimetypes(int signum);
 char *		    determine_request_path(const char *uri);
 request_type	    determine_request_type(const char *path);
 const char *        http_status_string(http_status status);
+const char *        http_date(void);
+void		    reap_child(pid_t pid);
+pid_t		    spawn_script(const char *path, char **envp, int in, int out);
 char *		    skip_nonwhitespace(char *s);
 char *		    skip_whitespace(char *s);
 
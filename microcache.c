@@ -0,0 +1,398 @@
+/* microcache.c: Script Response Micro-Cache */
+
+#include "mainServer.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#define MICROCACHE_BUCKETS 256  /* Hash table size (power of two) */
+
+typedef enum {
+    MICROCACHE_RUNNING,         /* Script running for first request, others wait */
+    MICROCACHE_STORED,          /* Output stored until expiry */
+    MICROCACHE_PASS,            /* Output not cacheable: requests run script until expiry */
+} microcache_state;
+
+/**
+ * Cached script response: the script's whole output (header block and body)
+ * for one key.
+ **/
+struct microcache_entry {
+    struct lru_node  node;          /* Table links, keyed by key (must be first) */
+    char            *key;           /* Script path, query, and varying headers */
+    microcache_state state;
+    time_t           expires;       /* Time entry stops being used (unless running) */
+    char            *data;          /* Script output */
+    size_t           ndata;
+    size_t           capacity;
+    struct request  *waiters;       /* Requests waiting for running script */
+};
+
+/* Cache state (shared by all threads, protected by MicrocacheLock) */
+
+static pthread_mutex_t          MicrocacheLock  = PTHREAD_MUTEX_INITIALIZER;
+static struct lru_node         *MicrocacheBuckets[MICROCACHE_BUCKETS];
+static struct lru               MicrocacheTable = {.buckets = MicrocacheBuckets, .nbuckets = MICROCACHE_BUCKETS};
+
+/**
+ * Build key for request: resolved script path, query, and the values of the
+ * request headers listed in MicrocacheVary.
+ *
+ * Returns allocated key (to be free'd), or NULL on error.
+ **/
+static char *
+microcache_key(struct request *r)
+{
+    char *key = NULL;
+    size_t nkey = 0;
+    FILE *ks = open_memstream(&key, &nkey);
+
+    if (!ks) {
+        return NULL;
+    }
+    fprintf(ks, "%s?%s", r->path, r->query ? r->query : "");
+
+    for (const char *name = MicrocacheVary; name && *name; ) {
+        size_t length = strcspn(name, ",");
+        char header[64];
+
+        if (length > 0 && length < sizeof(header)) {
+            memcpy(header, name, length);
+            header[length] = '\0';
+            const char *value = request_header(r, header);
+            fprintf(ks, "\n%s: %s", header, value ? value : "");
+        }
+        name += length + (name[length] == ',');
+    }
+
+    if (fclose(ks) != 0) {
+        free(key);
+        return NULL;
+    }
+    return key;
+}
+
+/**
+ * Wake up requests waiting for entry, which retry their lookup
+ * (MicrocacheLock must be held).
+ **/
+static void
+microcache_wake(struct microcache_entry *e)
+{
+    for (struct request *w = e->waiters, *next; w; w = next) {
+        next = w->cache_next;
+        w->cache_entry = NULL;
+        w->cache_next  = NULL;
+        eventfd_write(w->cache_fd, 1);
+    }
+    e->waiters = NULL;
+}
+
+/**
+ * Remove entry from cache and deallocate it, waking up any requests
+ * waiting for it (MicrocacheLock must be held).
+ **/
+static void
+microcache_remove(struct microcache_entry *e)
+{
+    lru_remove(&MicrocacheTable, &e->node);
+    microcache_wake(e);
+
+    free(e->key);
+    free(e->data);
+    free(e);
+}
+
+/**
+ * Add running entry for key, taking ownership of key (MicrocacheLock must
+ * be held).
+ *
+ * Only MICROCACHE_MAX entries are kept, evicting the least recently used
+ * ones that are not running.  Returns NULL on error.
+ **/
+static struct microcache_entry *
+microcache_insert(char *key)
+{
+    struct microcache_entry *e = calloc(1, sizeof(struct microcache_entry));
+
+    if (!e) {
+        return NULL;
+    }
+    e->key      = key;
+    e->node.key = key;
+    e->state    = MICROCACHE_RUNNING;
+
+    for (struct microcache_entry *v = (struct microcache_entry *)MicrocacheTable.head, *next;
+         v && MicrocacheTable.count >= MICROCACHE_MAX; v = next) {
+        next = (struct microcache_entry *)v->node.next;
+        if (v->state != MICROCACHE_RUNNING) {
+            microcache_remove(v);
+        }
+    }
+
+    lru_insert(&MicrocacheTable, &e->node);
+    return e;
+}
+
+/**
+ * Determine for how many seconds script output may be served from the
+ * cache, from the header block at its start.
+ *
+ * Only 200 responses without cookies are cached.  A Cache-Control header
+ * with no-store, no-cache, or private keeps the response out of the cache,
+ * and s-maxage (or else max-age) shortens its lifetime from MicrocacheTTL.
+ * Returns 0 if the output is not to be cached.
+ **/
+static long
+microcache_lifetime(const char *data, size_t ndata)
+{
+    const char *end = data + ndata;
+    const char *line = data;
+    const char *newline;
+    long maxage  = -1;
+    long smaxage = -1;
+    bool first   = true;
+
+    while ((newline = memchr(line, '\n', end - line))) {
+        size_t length = newline - line;
+        if (length > 0 && line[length - 1] == '\r') {
+            length--;
+        }
+        if (length == 0) {
+            long lifetime = smaxage >= 0 ? smaxage : maxage;
+            return lifetime >= 0 && lifetime < MicrocacheTTL ? lifetime : MicrocacheTTL;
+        }
+
+        if (first && strncmp(line, "HTTP/", 5) == 0) {
+            const char *status = memchr(line, ' ', length);
+            if (!status || strncmp(status + 1, "200", 3) != 0) {
+                return 0;
+            }
+        } else if (strncasecmp(line, "Status:", 7) == 0) {
+            const char *status = line + 7;
+            while (*status == ' ' || *status == '\t') {
+                status++;
+            }
+            if (strncmp(status, "200", 3) != 0) {
+                return 0;
+            }
+        } else if (strncasecmp(line, "Location:", 9) == 0 || strncasecmp(line, "Set-Cookie:", 11) == 0) {
+            return 0;
+        } else if (strncasecmp(line, "Cache-Control:", 14) == 0) {
+            /* Directives are comma-separated, with optional =value */
+            for (const char *d = line + 14; d < line + length; ) {
+                while (d < line + length && (*d == ' ' || *d == '\t' || *d == ',')) {
+                    d++;
+                }
+                size_t ndirective = strcspn(d, ",\r\n");
+                if (d + ndirective > line + length) {
+                    ndirective = line + length - d;
+                }
+                if ((ndirective == 8 && strncasecmp(d, "no-store", 8) == 0) ||
+                    (ndirective == 8 && strncasecmp(d, "no-cache", 8) == 0) ||
+                    (ndirective == 7 && strncasecmp(d, "private", 7) == 0)) {
+                    return 0;
+                }
+                if (strncasecmp(d, "s-maxage=", 9) == 0) {
+                    smaxage = strtol(d + 9, NULL, 10);
+                } else if (strncasecmp(d, "max-age=", 8) == 0) {
+                    maxage = strtol(d + 8, NULL, 10);
+                }
+                d += ndirective;
+            }
+        }
+
+        first = false;
+        line  = newline + 1;
+    }
+    return 0;
+}
+
+/**
+ * Settle running entry filled by request: store its output for lifetime
+ * seconds, or if that is 0, remember for MicrocacheTTL seconds that it is
+ * not cacheable.  Either way the requests waiting for it are woken up.
+ **/
+static void
+microcache_settle(struct request *r, long lifetime)
+{
+    struct microcache_entry *e = r->cache_entry;
+
+    pthread_mutex_lock(&MicrocacheLock);
+    e->expires = time(NULL) + (lifetime > 0 ? lifetime : MicrocacheTTL);
+    if (lifetime > 0) {
+        debug("Caching output of %s for %lds", r->path, lifetime);
+        e->state = MICROCACHE_STORED;
+    } else {
+        e->state = MICROCACHE_PASS;
+        free(e->data);
+        e->data  = NULL;
+        e->ndata = e->capacity = 0;
+    }
+    microcache_wake(e);
+    pthread_mutex_unlock(&MicrocacheLock);
+
+    r->cache_entry = NULL;
+}
+
+/**
+ * Look up script response for request in the micro-cache.
+ *
+ * Only GET and HEAD requests without a body or Authorization header are
+ * looked up, and only if MicrocacheTTL is set (and not again for a request
+ * that already runs the script, when it is handled again after waiting for
+ * a persistent worker).  Responses are keyed by
+ * script path, query, and the request headers listed in MicrocacheVary.
+ *
+ * If the response is cached, it is written (see handle_cgi_output).  If
+ * another request is running the script for the same key, the request waits
+ * for it instead: cache_fd becomes readable once it is done (see
+ * microcache_ready), and the request is then handled again.  Otherwise,
+ * the first GET request for a key runs the script, and its output is to be
+ * passed to microcache_capture (cache_entry is set).
+ *
+ * Returns 1 if the response was written or the request waits, and 0 if the
+ * script is to be run.
+ **/
+int
+microcache_lookup(struct request *r)
+{
+    struct microcache_entry *e;
+    char *key;
+    int fd;
+
+    if (MicrocacheTTL <= 0 || r->cache_entry || r->body != BODY_NONE ||
+        (!streq(r->method, "GET") && !streq(r->method, "HEAD")) ||
+        request_header(r, "Authorization") || !(key = microcache_key(r))) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&MicrocacheLock);
+    e = (struct microcache_entry *)lru_find(&MicrocacheTable, key);
+    if (e && e->state != MICROCACHE_RUNNING && e->expires <= time(NULL)) {
+        microcache_remove(e);
+        e = NULL;
+    }
+
+    if (e && e->state == MICROCACHE_STORED) {
+        lru_touch(&MicrocacheTable, &e->node);
+        handle_cgi_output(r, e->data, e->ndata);
+        pthread_mutex_unlock(&MicrocacheLock);
+        free(key);
+        return 1;
+    }
+
+    if (e && e->state == MICROCACHE_RUNNING && (fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) >= 0) {
+        debug("Waiting for running %s", r->path);
+        r->cache_entry = e;
+        r->cache_fd    = fd;
+        r->cache_next  = e->waiters;
+        e->waiters     = r;
+        pthread_mutex_unlock(&MicrocacheLock);
+        free(key);
+        return 1;
+    }
+
+    if (!e && streq(r->method, "GET") && (r->cache_entry = microcache_insert(key))) {
+        key = NULL;
+    }
+    pthread_mutex_unlock(&MicrocacheLock);
+    free(key);
+    return 0;
+}
+
+/**
+ * Capture n bytes of output from the script run for request (see
+ * microcache_lookup), where n is 0 once the output is complete.
+ *
+ * Output larger than MICROCACHE_ENTRY_MAX is not cached.  Once the entry is
+ * settled, cache_entry is cleared, and the rest of the output need not be
+ * captured.
+ **/
+void
+microcache_capture(struct request *r, const char *data, size_t n)
+{
+    struct microcache_entry *e = r->cache_entry;
+
+    if (n == 0) {
+        microcache_settle(r, microcache_lifetime(e->data, e->ndata));
+        return;
+    }
+
+    if (e->ndata + n > MICROCACHE_ENTRY_MAX) {
+        microcache_settle(r, 0);
+        return;
+    }
+    if (e->ndata + n > e->capacity) {
+        size_t capacity = e->capacity ? e->capacity : BUFSIZ;
+        while (capacity < e->ndata + n) {
+            capacity *= 2;
+        }
+        char *grown = realloc(e->data, capacity);
+        if (!grown) {
+            microcache_settle(r, 0);
+            return;
+        }
+        e->data     = grown;
+        e->capacity = capacity;
+    }
+    memcpy(e->data + e->ndata, data, n);
+    e->ndata += n;
+}
+
+/**
+ * Return whether the script run the request waits for is done (see
+ * microcache_lookup), in which case the request is to be handled again.
+ **/
+bool
+microcache_ready(struct request *r)
+{
+    eventfd_t value;
+
+    if (eventfd_read(r->cache_fd, &value) < 0) {
+        return false;
+    }
+    close(r->cache_fd);
+    r->cache_fd = -1;
+    return true;
+}
+
+/**
+ * Release request's part in the micro-cache: stop waiting for a running
+ * script, or if the request runs the script itself and did not capture all
+ * of its output, drop its entry (so the requests waiting for it retry).
+ **/
+void
+microcache_release(struct request *r)
+{
+    if (!r->cache_entry && r->cache_fd < 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&MicrocacheLock);
+    if (r->cache_entry && r->cache_fd < 0) {
+        microcache_remove(r->cache_entry);
+    } else if (r->cache_entry) {
+        struct request **link = &r->cache_entry->waiters;
+        while (*link && *link != r) {
+            link = &(*link)->cache_next;
+        }
+        if (*link) {
+            *link = r->cache_next;
+        }
+    }
+    pthread_mutex_unlock(&MicrocacheLock);
+
+    if (r->cache_fd >= 0) {
+        close(r->cache_fd);
+    }
+    r->cache_entry = NULL;
+    r->cache_fd    = -1;
+    r->cache_next  = NULL;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
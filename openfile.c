@@ -0,0 +1,241 @@
+/* openfile.c: Open File and Path Resolution Cache */
+
+#include "mainServer.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+
+#include <sys/resource.h>
+#include <unistd.h>
+
+#define OPENFILE_BUCKETS    1024    /* Hash table size (power of two) */
+
+/**
+ * Cached URI resolution.
+ **/
+struct openfile_entry {
+    struct lru_node  node;          /* Table links, keyed by uri (must be first) */
+    char            *uri;
+    struct open_file file;          /* Resolved path, type, stat, and fd */
+    time_t           expires;       /* Time after which entry is resolved again */
+};
+
+/* Cache state (shared by all threads, protected by OpenFileLock) */
+
+static pthread_mutex_t        OpenFileLock  = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t         OpenFileOnce  = PTHREAD_ONCE_INIT;
+static struct lru_node       *OpenFileBuckets[OPENFILE_BUCKETS];
+static struct lru             OpenFileTable = {.buckets = OpenFileBuckets, .nbuckets = OPENFILE_BUCKETS};
+static size_t                 OpenFileLimit = OPENFILE_MAX;
+
+/**
+ * Release resources held by resolved file.
+ **/
+static void
+openfile_release(struct open_file *f)
+{
+    if (f->fd >= 0) {
+        close(f->fd);
+    }
+    free(f->path);
+}
+
+/**
+ * Remove entry from cache and deallocate it (OpenFileLock must be held).
+ **/
+static void
+openfile_remove(struct openfile_entry *e)
+{
+    lru_remove(&OpenFileTable, &e->node);
+    openfile_release(&e->file);
+    free(e->uri);
+    free(e);
+}
+
+/**
+ * Invalidate entries resolving at or below changed path (watch handler).
+ **/
+static void
+openfile_invalidate(const char *path)
+{
+    size_t length = path ? strlen(path) : 0;
+
+    pthread_mutex_lock(&OpenFileLock);
+    for (struct openfile_entry *e = (struct openfile_entry *)OpenFileTable.head, *next; e; e = next) {
+        next = (struct openfile_entry *)e->node.next;
+        if (!path || (strncmp(e->file.path, path, length) == 0 &&
+                      (e->file.path[length] == '\0' || e->file.path[length] == '/'))) {
+            debug("Invalidating open file %s", e->file.path);
+            openfile_remove(e);
+        }
+    }
+    pthread_mutex_unlock(&OpenFileLock);
+}
+
+/**
+ * Subscribe to filesystem changes and bound the number of entries (once).
+ *
+ * Entries hold file descriptors, so at most a quarter of the descriptor
+ * limit is spent on them; the rest is left for connections and CGI pipes.
+ **/
+static void
+openfile_init(void)
+{
+    struct rlimit limit;
+
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY &&
+        limit.rlim_cur / 4 < OpenFileLimit) {
+        OpenFileLimit = limit.rlim_cur / 4;
+    }
+    watch_subscribe(openfile_invalidate);
+}
+
+/**
+ * Copy resolved file for request, duplicating its path (into the request
+ * arena) and file descriptor.
+ **/
+static int
+openfile_copy(struct request *r, struct open_file *dst, const struct open_file *src)
+{
+    *dst = *src;
+    dst->fd   = -1;
+    dst->path = request_strdup(r, src->path);
+    if (!dst->path) {
+        return -1;
+    }
+    if (src->fd >= 0 && (dst->fd = fcntl(src->fd, F_DUPFD_CLOEXEC, 0)) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Resolve URI from scratch: real path (including the RootPath prefix check
+ * done by determine_request_path), request type, and for regular files an
+ * open file descriptor and its stat information.
+ **/
+static int
+openfile_resolve(const char *uri, struct open_file *f, bool *watched)
+{
+    memset(f, 0, sizeof(struct open_file));
+    f->fd   = -1;
+    f->path = determine_request_path(uri);
+    if (!f->path) {
+        return -1;
+    }
+
+    /* Watch before looking at the file, so later changes are noticed */
+    *watched = watch_parent(f->path) == 0;
+
+    f->type = determine_request_type(f->path);
+    if (f->type == REQUEST_FILE) {
+        f->fd = open(f->path, O_RDONLY | O_CLOEXEC);
+        if (f->fd < 0 || fstat(f->fd, &f->st) < 0) {
+            f->type = REQUEST_BAD;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Resolve request URI to a file.
+ *
+ * Resolutions are cached by URI, together with an open descriptor for
+ * regular files, so repeated requests skip realpath(3), stat(2), access(2),
+ * and open(2).  Entries are dropped as soon as inotify reports a change to
+ * the file or its directory, and resolved again after OPENFILE_VALID seconds
+ * in any case (which covers changes to ancestor directories).  Files whose
+ * directory cannot be watched are not cached.
+ *
+ * On success, f receives a copy of the path (allocated from the request
+ * arena) and its own descriptor (if any), which must be released with
+ * openfile_close.  Returns -1 if the URI does not resolve to a path within
+ * RootPath.
+ **/
+int
+openfile_lookup(struct request *r, struct open_file *f)
+{
+    struct openfile_entry *e;
+    struct open_file resolved;
+    time_t now = time(NULL);
+    bool watched;
+    int status = 0;
+
+    pthread_once(&OpenFileOnce, openfile_init);
+    watch_poll();
+
+    pthread_mutex_lock(&OpenFileLock);
+    e = (struct openfile_entry *)lru_find(&OpenFileTable, r->uri);
+    if (e && now >= e->expires) {
+        openfile_remove(e);
+        e = NULL;
+    }
+    if (e) {
+        lru_touch(&OpenFileTable, &e->node);
+        status = openfile_copy(r, f, &e->file);
+    }
+    pthread_mutex_unlock(&OpenFileLock);
+
+    if (e) {
+        return status;
+    }
+
+    /* Resolve, and hand the result to a new entry if it can be cached */
+    if (openfile_resolve(r->uri, &resolved, &watched) < 0) {
+        return -1;
+    }
+
+    if (!watched || OpenFileLimit == 0 ||
+        !(e = calloc(1, sizeof(struct openfile_entry))) || !(e->uri = strdup(r->uri))) {
+        free(e);
+        *f = resolved;
+        f->path = request_strdup(r, resolved.path);
+        free(resolved.path);
+        if (!f->path) {
+            openfile_close(f);
+            return -1;
+        }
+        return 0;
+    }
+    e->node.key = e->uri;
+    e->file     = resolved;
+    e->expires  = now + OPENFILE_VALID;
+
+    pthread_mutex_lock(&OpenFileLock);
+
+    status = openfile_copy(r, f, &e->file);
+
+    /* Replace any existing entry (another thread may have raced us) */
+    struct openfile_entry *old = (struct openfile_entry *)lru_find(&OpenFileTable, r->uri);
+    if (old) {
+        openfile_remove(old);
+    }
+
+    /* Evict least recently used entries until there is room */
+    while (OpenFileTable.head && OpenFileTable.count >= OpenFileLimit) {
+        openfile_remove((struct openfile_entry *)OpenFileTable.head);
+    }
+
+    lru_insert(&OpenFileTable, &e->node);
+
+    pthread_mutex_unlock(&OpenFileLock);
+    return status;
+}
+
+/**
+ * Release file returned by openfile_lookup (its path belongs to the request
+ * arena).
+ **/
+void
+openfile_close(struct open_file *f)
+{
+    if (f->fd >= 0) {
+        close(f->fd);
+    }
+    f->fd   = -1;
+    f->path = NULL;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,131 @@
+/* plugin.c: In-Process Handler Plugins */
+
+#include "mainServer.h"
+#include "plugin.h"
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <string.h>
+
+/* Loaded plugins (set up before serving starts, read-only afterwards) */
+
+static struct plugin Plugins[PLUGIN_MAX];
+static size_t        NPlugins = 0;
+
+/**
+ * Load plugin from spec of the form prefix=path, mapping URIs under prefix
+ * (which must start with /) to the shared object at path, and initialize it
+ * (see plugin_init in plugin.h).
+ *
+ * Returns 0 on success, -1 on error.
+ **/
+int
+plugin_load(const char *spec)
+{
+    const char *equals = strchr(spec, '=');
+    struct plugin *p = &Plugins[NPlugins];
+    int (*init)(const char *, void **);
+    void *handle;
+
+    if (!equals || spec[0] != '/' || !equals[1]) {
+        log("Plugin must be given as prefix=path: %s", spec);
+        return -1;
+    }
+    if (NPlugins == PLUGIN_MAX) {
+        log("At most %d plugins can be loaded", PLUGIN_MAX);
+        return -1;
+    }
+
+    /* Prefixes match whole path segments, so trailing slashes go */
+    p->nprefix = equals - spec;
+    while (p->nprefix > 1 && spec[p->nprefix - 1] == '/') {
+        p->nprefix--;
+    }
+    p->prefix = strndup(spec, p->nprefix);
+    p->path   = strdup(equals + 1);
+    if (!p->prefix || !p->path) {
+        goto fail;
+    }
+
+    handle = dlopen(p->path, RTLD_NOW | RTLD_LOCAL);
+    if (!handle) {
+        log("Unable to load plugin %s: %s", p->path, dlerror());
+        goto fail;
+    }
+    init      = (int (*)(const char *, void **))dlsym(handle, "plugin_init");
+    p->handle = (int (*)(const struct plugin_request *, FILE *))dlsym(handle, "plugin_handle");
+    if (!init || !p->handle) {
+        log("Plugin %s does not export plugin_init and plugin_handle", p->path);
+        dlclose(handle);
+        goto fail;
+    }
+    if (init(p->prefix, &p->state) < 0) {
+        log("Plugin %s failed to initialize for %s", p->path, p->prefix);
+        dlclose(handle);
+        goto fail;
+    }
+
+    debug("Loaded plugin %s for %s", p->path, p->prefix);
+    NPlugins++;
+    return 0;
+
+fail:
+    free(p->prefix);
+    free(p->path);
+    memset(p, 0, sizeof(struct plugin));
+    return -1;
+}
+
+/**
+ * Return plugin whose prefix the URI falls under (the longest one, if
+ * several do), or NULL if none.
+ **/
+const struct plugin *
+plugin_lookup(const char *uri)
+{
+    const struct plugin *match = NULL;
+
+    for (size_t i = 0; i < NPlugins; i++) {
+        const struct plugin *p = &Plugins[i];
+        if (strncmp(uri, p->prefix, p->nprefix) == 0 &&
+            (uri[p->nprefix] == '\0' || uri[p->nprefix] == '/' || p->nprefix == 1) &&
+            (!match || p->nprefix > match->nprefix)) {
+            match = p;
+        }
+    }
+    return match;
+}
+
+/**
+ * Run request through plugin, which appends what a CGI script would write
+ * to out.
+ *
+ * Returns 0 on success, -1 on error.
+ **/
+int
+plugin_request(const struct plugin *p, struct request *r, FILE *out)
+{
+    struct plugin_header *headers = request_alloc(r, (r->nheaders + 1) * sizeof(struct plugin_header));
+    struct plugin_request request = {
+        .method      = r->method,
+        .uri         = r->uri,
+        .path        = r->uri + (p->nprefix > 1 ? p->nprefix : 0),
+        .query       = r->query ? r->query : "",
+        .version     = r->version,
+        .remote_addr = r->host,
+        .remote_port = r->port,
+        .headers     = headers,
+        .nheaders    = r->nheaders,
+        .state       = p->state,
+    };
+
+    if (!headers) {
+        return -1;
+    }
+    for (size_t i = 0; i < r->nheaders; i++) {
+        headers[i] = (struct plugin_header){r->headers[i].name, r->headers[i].value};
+    }
+    return p->handle(&request, out) < 0 ? -1 : 0;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
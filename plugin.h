@@ -0,0 +1,70 @@
+/* plugin.h: In-Process Handler Plugin API */
+
+#ifndef PLUGIN_H
+#define PLUGIN_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+/**
+ * Handler plugins are shared objects the server loads at startup (-P
+ * prefix=path.so) and hands every request whose URI falls under the prefix.
+ * They run inside the server process, on whichever thread (or forked
+ * process) serves the request, so there is no process to spawn, but a
+ * plugin that crashes takes the server down with it.  Build them against
+ * this header alone (cc -fPIC -shared), and export both functions below.
+ **/
+
+/**
+ * Request header (name and value as sent).
+ **/
+struct plugin_header {
+    const char *name;
+    const char *value;
+};
+
+/**
+ * Request handed to a plugin.  Everything it points to is only valid until
+ * plugin_handle returns.
+ **/
+struct plugin_request {
+    const char *method;
+    const char *uri;            /* URI path (without query) */
+    const char *path;           /* Rest of uri after the plugin's prefix ("" or starting with /) */
+    const char *query;          /* Query string ("" if none) */
+    const char *version;
+    const char *remote_addr;    /* Numeric client address */
+    const char *remote_port;
+    const struct plugin_header *headers;
+    size_t      nheaders;
+    void       *state;          /* What plugin_init stored for the prefix */
+};
+
+/**
+ * Set up plugin for the URI prefix it is mapped to, storing in state
+ * whatever its requests need (handed back in each plugin_request).  Called
+ * once per prefix before the server starts serving (and before it forks or
+ * starts threads).
+ *
+ * Returns 0 on success, and -1 if the plugin cannot be used (the server
+ * then refuses to start).
+ **/
+int plugin_init(const char *prefix, void **state);
+
+/**
+ * Handle request, writing to response what a CGI script would write to its
+ * standard output: a header block (Content-Type, Status, Location, and any
+ * other headers, up to an empty line), followed by the body.  The server
+ * adds framing (Content-Length, Connection, Date) and leaves out the body
+ * where there is none (HEAD, 204, 304).  Plugins do not see request
+ * bodies: the server reads and discards them after the response.
+ *
+ * May be called from several threads at once, and must not block for
+ * long.  Returns 0 on success, and -1 to answer 500 Internal Server Error
+ * instead (whatever was written is dropped).
+ **/
+int plugin_handle(const struct plugin_request *request, FILE *response);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
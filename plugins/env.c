@@ -0,0 +1,94 @@
+/* env.c: Example handler plugin (in-process version of env.sh) */
+
+#include "plugin.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Per-prefix state: number of requests served so far.
+ **/
+struct env_state {
+    unsigned long served;
+};
+
+/**
+ * Format NAME=value line into lines (at *nlines), skipping it on error.
+ **/
+static void
+env_line(char **lines, size_t *nlines, const char *prefix, const char *name, const char *value)
+{
+    if (asprintf(&lines[*nlines], "%s%s=%s", prefix, name, value) >= 0) {
+        (*nlines)++;
+    }
+}
+
+/**
+ * Compare lines for qsort.
+ **/
+static int
+env_compare(const void *a, const void *b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+int
+plugin_init(const char *prefix, void **state)
+{
+    (void)prefix;
+    *state = calloc(1, sizeof(struct env_state));
+    return *state ? 0 : -1;
+}
+
+/**
+ * List the request's CGI variables (HTTP_* ones named as in CGI), sorted,
+ * like env.sh does with its environment.
+ **/
+int
+plugin_handle(const struct plugin_request *request, FILE *response)
+{
+    struct env_state *state = request->state;
+    char **lines = calloc(request->nheaders + 8, sizeof(char *));
+    size_t nlines = 0;
+    char served[32];
+
+    if (!lines) {
+        return -1;
+    }
+
+    snprintf(served, sizeof(served), "%lu", __atomic_add_fetch(&state->served, 1, __ATOMIC_RELAXED));
+    env_line(lines, &nlines, "", "PLUGIN_REQUESTS", served);
+    env_line(lines, &nlines, "", "REQUEST_METHOD",  request->method);
+    env_line(lines, &nlines, "", "REQUEST_URI",     request->uri);
+    env_line(lines, &nlines, "", "PATH_INFO",       request->path);
+    env_line(lines, &nlines, "", "QUERY_STRING",    request->query);
+    env_line(lines, &nlines, "", "SERVER_PROTOCOL", request->version);
+    env_line(lines, &nlines, "", "REMOTE_ADDR",     request->remote_addr);
+    env_line(lines, &nlines, "", "REMOTE_PORT",     request->remote_port);
+
+    for (size_t i = 0; i < request->nheaders; i++) {
+        char name[64];
+        size_t n;
+
+        for (n = 0; request->headers[i].name[n] && n + 1 < sizeof(name); n++) {
+            char c = request->headers[i].name[n];
+            name[n] = c == '-' ? '_' : (c >= 'a' && c <= 'z') ? c - 32 : c;
+        }
+        name[n] = '\0';
+        env_line(lines, &nlines, "HTTP_", name, request->headers[i].value);
+    }
+
+    qsort(lines, nlines, sizeof(char *), env_compare);
+
+    fputs("Content-Type: text/plain\n\n", response);
+    for (size_t i = 0; i < nlines; i++) {
+        fputs(lines[i], response);
+        fputc('\n', response);
+        free(lines[i]);
+    }
+    free(lines);
+    return 0;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,180 @@
+/* prefork.c: Pre-forked HTTP Server */
+
+#include "mainServer.h"
+
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <string.h>
+
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* Worker pids (for forwarding signals to them) */
+
+static pid_t  *PreforkPids     = NULL;
+static size_t  PreforkNWorkers = 0;
+
+/**
+ * Forward SIGHUP to the workers, which each load their own mimetypes (the
+ * parent serves nothing).
+ **/
+static void
+prefork_reload(int signum)
+{
+    for (size_t i = 0; i < PreforkNWorkers; i++) {
+        if (PreforkPids[i] > 0) {
+            kill(PreforkPids[i], signum);
+        }
+    }
+}
+
+/**
+ * Pin calling process to the n-th CPU it is allowed to run on (modulo the
+ * number of allowed CPUs).
+ **/
+static void
+prefork_pin(size_t n)
+{
+    cpu_set_t allowed;
+    cpu_set_t set;
+    int ncpus;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+        return;
+    }
+
+    ncpus = CPU_COUNT(&allowed);
+    if (ncpus <= 0) {
+        return;
+    }
+
+    n %= ncpus;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &allowed) || n-- > 0) {
+            continue;
+        }
+
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+            log("Unable to pin worker to CPU %d: %s", cpu, strerror(errno));
+        } else {
+            debug("Pinned worker to CPU %d", cpu);
+        }
+        return;
+    }
+}
+
+/**
+ * Fork worker n, which serves its own listening socket with an event loop.
+ *
+ * Returns the worker's pid in the parent or -1 on error.
+ **/
+static pid_t
+prefork_spawn(int *sockets, size_t nworkers, size_t n)
+{
+    pid_t pid = fork();
+
+    if (pid != 0) {
+        return pid;
+    }
+
+    /* Reload mimetypes on SIGHUP, exit along with parent, and only keep own
+     * listening socket */
+    signal(SIGHUP, reload_mimetypes);
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    for (size_t i = 0; i < nworkers; i++) {
+        if (i != n) {
+            close(sockets[i]);
+        }
+    }
+
+    prefork_pin(n);
+    event_server(sockets[n]);
+    _exit(EXIT_SUCCESS);
+}
+
+/**
+ * Handle HTTP requests with long-lived pre-forked worker processes.
+ *
+ * Workers processes are started (default: one per CPU), each pinned to a
+ * core and serving its own SO_REUSEPORT listening socket, so the kernel
+ * spreads connections across workers without a shared accept lock.  The
+ * first worker uses sfd; the others get sockets from socket_listen.
+ *
+ * The parent holds on to every listening socket and respawns workers that
+ * exit, so connections queued on a crashed worker's socket are picked up by
+ * its replacement.  It also passes SIGHUP (reload mimetypes) on to them.
+ **/
+void
+prefork_server(int sfd)
+{
+    size_t nworkers = Workers > 0 ? Workers : sysconf(_SC_NPROCESSORS_ONLN);
+    int   *sockets  = calloc(nworkers, sizeof(int));
+    pid_t *pids     = calloc(nworkers, sizeof(pid_t));
+    int status;
+    pid_t pid;
+
+    if (!sockets || !pids) {
+        fatal("Unable to allocate workers: %s", strerror(errno));
+    }
+
+    /* Create listening sockets */
+    sockets[0] = sfd;
+    for (size_t i = 1; i < nworkers; i++) {
+        sockets[i] = socket_listen(Port, true);
+        if (sockets[i] < 0) {
+            fatal("Unable to create listening socket for worker %zu", i);
+        }
+    }
+
+    /* Start workers */
+    for (size_t i = 0; i < nworkers; i++) {
+        pids[i] = prefork_spawn(sockets, nworkers, i);
+        if (pids[i] < 0) {
+            fatal("Unable to fork worker %zu: %s", i, strerror(errno));
+        }
+    }
+
+    debug("Started %zu worker processes", nworkers);
+
+    /* Pass SIGHUP on to workers */
+    PreforkPids     = pids;
+    PreforkNWorkers = nworkers;
+    signal(SIGHUP, prefork_reload);
+
+    /* Respawn workers as they exit */
+    while (true) {
+        pid = wait(&status);
+        if (pid < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+
+        for (size_t i = 0; i < nworkers; i++) {
+            if (pids[i] != pid) {
+                continue;
+            }
+
+            log("Worker %zu (%d) exited with status %d, respawning", i, pid, status);
+            pids[i] = prefork_spawn(sockets, nworkers, i);
+            if (pids[i] < 0) {
+                log("Unable to respawn worker %zu: %s", i, strerror(errno));
+            }
+            break;
+        }
+    }
+
+    /* Close listening sockets and exit */
+    for (size_t i = 0; i < nworkers; i++) {
+        close(sockets[i]);
+    }
+    free(sockets);
+    free(pids);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -2,157 +2,1433 @@
 #include "mainServer.h"
 
 #include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio_ext.h>
 #include <string.h>
 
+#include <fcntl.h>
+#include <netinet/tcp.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/time.h>
 #include <unistd.h>
 
 int parse_request_method(struct request *r);
 int parse_request_headers(struct request *r);
+int parse_request_body(struct request *r);
+char *parse_request_line(struct request *r, size_t *length);
+
+/**
+ * Perfect hash of well-known header names, from their length and their
+ * first and last characters (case-insensitively).  The constants were
+ * chosen so that every name in HeaderNames gets its own slot (a collision
+ * would show up as an overridden initializer with -Wextra).
+ **/
+#define HEADER_HASH(length, first, last) \
+    (((length) + ((first) | 0x20) + 7 * ((last) | 0x20)) & 15)
+
+static const struct {
+    const char *name;
+    size_t      length;
+    header_id   id;
+} HeaderNames[16] = {
+    [HEADER_HASH( 4, 'H', 't')] = {"Host",              4,  HEADER_HOST},
+    [HEADER_HASH(10, 'C', 'n')] = {"Connection",        10, HEADER_CONNECTION},
+    [HEADER_HASH(14, 'C', 'h')] = {"Content-Length",    14, HEADER_CONTENT_LENGTH},
+    [HEADER_HASH(12, 'C', 'e')] = {"Content-Type",      12, HEADER_CONTENT_TYPE},
+    [HEADER_HASH(17, 'T', 'g')] = {"Transfer-Encoding", 17, HEADER_TRANSFER_ENCODING},
+    [HEADER_HASH( 6, 'E', 't')] = {"Expect",            6,  HEADER_EXPECT},
+    [HEADER_HASH(15, 'A', 'g')] = {"Accept-Encoding",   15, HEADER_ACCEPT_ENCODING},
+    [HEADER_HASH( 5, 'R', 'e')] = {"Range",             5,  HEADER_RANGE},
+    [HEADER_HASH( 8, 'I', 'e')] = {"If-Range",          8,  HEADER_IF_RANGE},
+    [HEADER_HASH(13, 'I', 'h')] = {"If-None-Match",     13, HEADER_IF_NONE_MATCH},
+    [HEADER_HASH(17, 'I', 'e')] = {"If-Modified-Since", 17, HEADER_IF_MODIFIED_SINCE},
+};
+
+/**
+ * Return well-known header with the given name, or HEADER_UNKNOWN.
+ **/
+static header_id
+header_lookup(const char *name, size_t length)
+{
+    if (length == 0) {
+        return HEADER_UNKNOWN;
+    }
+
+    size_t slot = HEADER_HASH(length, (unsigned char)name[0], (unsigned char)name[length - 1]);
+    if (HeaderNames[slot].name && HeaderNames[slot].length == length &&
+        strncasecmp(HeaderNames[slot].name, name, length) == 0) {
+        return HeaderNames[slot].id;
+    }
+    return HEADER_UNKNOWN;
+}
+
+/**
+ * Request allocation that did not fit in the request arena.
+ **/
+struct arena_block {
+    struct arena_block *next;
+    char data[] __attribute__((aligned(16)));
+};
+
+/* Freed request structs kept for reuse, with their buffer and response
+ * stream (protected by RequestPoolLock) */
+
+static pthread_mutex_t RequestPoolLock = PTHREAD_MUTEX_INITIALIZER;
+static struct request *RequestPool[REQUEST_POOL];
+static size_t          NRequestPool    = 0;
+
+/**
+ * Take request struct from pool, or allocate a new one along with its
+ * request buffer and response stream.
+ **/
+static struct request *
+new_request(void)
+{
+    struct request *r = NULL;
+
+    pthread_mutex_lock(&RequestPoolLock);
+    if (NRequestPool > 0) {
+        r = RequestPool[--NRequestPool];
+    }
+    pthread_mutex_unlock(&RequestPoolLock);
+
+    if (r) {
+        return r;
+    }
+
+    r = calloc(1, sizeof(*r));
+    if (!r) {
+        return NULL;
+    }
+    r->fd        = -1;
+    r->body_fd   = -1;
+    r->pipe_fd   = -1;
+    r->input_fd  = -1;
+    r->cache_fd  = -1;
+    r->worker_fd = -1;
+
+    r->buffer = malloc(REQUEST_BUFSIZ);
+    if (!r->buffer) {
+        goto fail;
+    }
+    r->buffer[0] = '\0';
+
+    /* The response stream only ever belongs to one thread at a time, so
+     * stdio need not lock it on every call */
+    r->file = open_memstream(&r->response, &r->nresponse);
+    if (!r->file) {
+        goto fail;
+    }
+    __fsetlocking(r->file, FSETLOCKING_BYCALLER);
+    return r;
+
+fail:
+    free_request(r);
+    return NULL;
+}
+
+/**
+ * Return request struct to pool, returning false if the pool is full or its
+ * response stream cannot be reused.
+ *
+ * Everything but the request buffer and response stream is zeroed, so the
+ * next connection starts from a clean state.
+ **/
+static bool
+recycle_request(struct request *r)
+{
+    char  *buffer   = r->buffer;
+    FILE  *file     = r->file;
+    char  *response = r->response;
+    bool   recycled = false;
+
+    if (!buffer || !file || fseeko(file, 0, SEEK_SET) != 0 || fflush(file) != 0) {
+        return false;
+    }
+
+    memset(r, 0, sizeof(*r));
+    r->fd        = -1;
+    r->body_fd   = -1;
+    r->pipe_fd   = -1;
+    r->input_fd  = -1;
+    r->cache_fd  = -1;
+    r->worker_fd = -1;
+    r->buffer    = buffer;
+    r->buffer[0] = '\0';
+    r->file      = file;
+    r->response  = response;
+
+    pthread_mutex_lock(&RequestPoolLock);
+    if (NRequestPool < REQUEST_POOL) {
+        RequestPool[NRequestPool++] = r;
+        recycled = true;
+    }
+    pthread_mutex_unlock(&RequestPoolLock);
+    return recycled;
+}
 
 /**
  * Accept request from server socket.
  *
  * This function does the following:
  *
- *  1. Allocates a request struct initialized to 0.
- *  2. Initializes the headers list in the request struct.
- *  3. Accepts a client connection from the server socket.
- *  4. Looks up the client information and stores it in the request struct.
- *  5. Opens the client socket stream for the request struct.
- *  6. Returns the request struct.
+ *  1. Accepts a client connection from the server socket.
+ *  2. Sets the connection up as a request (see connection_request).
+ *  3. Returns the request struct.
+ *
+ * If no connection could be accepted, NULL is returned and errno is left as
+ * set by accept(2) (e.g. EAGAIN on a non-blocking server socket).
+ *
+ * The returned request struct must be deallocated using free_request.
+ **/
+struct request *
+accept_request(int sfd)
+{
+    struct sockaddr_storage raddr;
+    socklen_t rlen;
+    int fd;
+
+    /* Accept a client */
+    rlen = sizeof(raddr);
+    fd = accept4(sfd, (struct sockaddr *)&raddr, &rlen, SOCK_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    return connection_request(fd, (struct sockaddr *)&raddr, rlen);
+}
+
+/**
+ * Set up request for accepted client connection.
+ *
+ * This function does the following:
+ *
+ *  1. Takes a zeroed request struct, with its request buffer and response
+ *     stream, from the pool of freed requests (or allocates a new one).
+ *  2. Sets the socket options every connection uses.
+ *  3. Looks up the client information (from raddr, or if that is NULL from
+ *     the socket) and stores it in the request struct.
+ *
+ * The request takes over the socket; if it cannot be allocated, the socket
+ * is closed and NULL is returned.
+ **/
+struct request *
+connection_request(int fd, const struct sockaddr *raddr, socklen_t rlen)
+{
+    struct sockaddr_storage peer;
+    struct request *r;
+
+    /* Allocate request struct (zeroed) */
+    r = new_request();
+    if (!r) {
+        close(fd);
+        return NULL;
+    }
+    r->fd    = fd;
+    r->state = REQUEST_READING;
+
+    /* Bound blocking reads and writes by the idle connection timeout */
+    struct timeval timeout = {.tv_sec = KeepAliveTimeout};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    /* Send every write right away: write_response itself marks the writes
+     * that more data follows with MSG_MORE, so responses are never split
+     * into extra segments nor held back waiting for ACKs */
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int));
+
+    /* Lookup client information */
+    if (!raddr) {
+        rlen  = sizeof(peer);
+        raddr = getpeername(fd, (struct sockaddr *)&peer, &rlen) == 0 ? (struct sockaddr *)&peer : NULL;
+    }
+    if (!raddr || getnameinfo(raddr, rlen, r->host, sizeof(r->host), r->port, sizeof(r->port), NI_NUMERICHOST | NI_NUMERICSERV) != 0) {
+        r->host[0] = '\0';
+        r->port[0] = '\0';
+    }
+
+    log("Accepted request from %s:%s", r->host, r->port);
+    return r;
+}
+
+/**
+ * Close response pipe and reap the process writing into it, killing it
+ * first if its output is abandoned before the end (abort).
+ **/
+static void
+close_pipe(struct request *r, bool abort)
+{
+    if (r->pipe_fd >= 0) {
+        close(r->pipe_fd);
+        r->pipe_fd = -1;
+    }
+    if (r->pipe_pid > 0) {
+        if (abort) {
+            kill(r->pipe_pid, SIGKILL);
+        }
+        reap_child(r->pipe_pid);
+        r->pipe_pid = 0;
+    }
+    r->pipe_copy      = false;
+    r->pipe_head      = NULL;
+    r->npipe_head     = 0;
+    r->pipe_head_size = 0;
+    r->pipe_chunked   = false;
+    r->pipe_chunk     = 0;
+}
+
+/**
+ * Close input pipe, so the script reading it sees the end of the body.
+ **/
+static void
+close_input(struct request *r)
+{
+    if (r->input_fd >= 0) {
+        close(r->input_fd);
+        r->input_fd = -1;
+    }
+    r->input_full = false;
+}
+
+/**
+ * Release per-request state.
+ *
+ * This closes any pending body file or pipes (killing the script behind
+ * them), gives up the request's micro-cache entry and persistent worker
+ * (killing the worker if it has not answered in full), empties the request
+ * arena, and forgets the parsed request (which lives in the request buffer)
+ * along with any unread body, leaving the connection itself (socket,
+ * buffers) intact.
+ **/
+static void
+clear_request(struct request *r)
+{
+    /* Close body file and pipe */
+    if (r->body_fd >= 0) {
+        close(r->body_fd);
+        r->body_fd = -1;
+    }
+    close_pipe(r, true);
+    close_input(r);
+    microcache_release(r);
+    worker_release(r);
+    r->ranges    = NULL;
+    r->nranges   = 0;
+    r->nextrange = 0;
+    r->keepalive = false;
+
+    /* Forget unread body */
+    r->body       = BODY_NONE;
+    r->body_left  = 0;
+    r->body_total = 0;
+
+    /* Empty arena */
+    while (r->overflow) {
+        struct arena_block *next = r->overflow->next;
+        free(r->overflow);
+        r->overflow = next;
+    }
+    r->narena = 0;
+    r->path   = NULL;
+
+    /* Forget request line and headers */
+    r->method   = NULL;
+    r->uri      = NULL;
+    r->query    = NULL;
+    r->version  = NULL;
+    r->nheaders = 0;
+    memset(r->known, 0, sizeof(r->known));
+}
+
+/**
+ * Deallocate request struct.
+ *
+ * This function does the following:
+ *
+ *  1. Closes the request socket.
+ *  2. Releases per-request state (body file and arena).
+ *  3. Returns the request struct to the pool, or if that is full, closes
+ *     the response stream and frees the request buffers and struct.
+ **/
+void
+free_request(struct request *r)
+{
+    if (r == NULL) {
+    	return;
+    }
+
+    /* Close socket */
+    if (r->fd >= 0) {
+        close(r->fd);
+    }
+
+    /* Release per-request state */
+    clear_request(r);
+
+    /* Keep struct, buffer, and stream for the next connection */
+    if (recycle_request(r)) {
+        return;
+    }
+
+    /* Close response stream and free buffers */
+    if (r->file) {
+        fclose(r->file);
+    }
+    free(r->response);
+    free(r->buffer);
+
+    /* Free request */
+    free(r);
+}
+
+/**
+ * Allocate size bytes (16-byte aligned) that live until the request is
+ * reset or freed.
+ *
+ * Allocations come from the arena embedded in the request struct, so the
+ * common case is a pointer bump that needs no free; larger or further
+ * allocations fall back to malloc and are freed along with the arena.
+ * Returns NULL if memory is exhausted.
+ **/
+void *
+request_alloc(struct request *r, size_t size)
+{
+    size = (size + 15) & ~(size_t)15;
+
+    if (size <= REQUEST_ARENA - r->narena) {
+        void *p = r->arena + r->narena;
+        r->narena += size;
+        return p;
+    }
+
+    struct arena_block *block = malloc(sizeof(struct arena_block) + size);
+    if (!block) {
+        return NULL;
+    }
+    block->next = r->overflow;
+    r->overflow = block;
+    return block->data;
+}
+
+/**
+ * Copy string into request arena (see request_alloc).
+ **/
+char *
+request_strdup(struct request *r, const char *s)
+{
+    size_t length = strlen(s) + 1;
+    char  *copy   = request_alloc(r, length);
+
+    if (copy) {
+        memcpy(copy, s, length);
+    }
+    return copy;
+}
+
+/**
+ * Reset request struct for the next request on a persistent connection.
+ *
+ * This releases per-request state and starts the next request head right
+ * after the previous one in the request buffer, so pipelined requests are
+ * parsed in place.  Responses accumulate in the response stream until they
+ * are written (see write_response).
+ **/
+void
+reset_request(struct request *r)
+{
+    clear_request(r);
+
+    r->start    = r->offset;
+    r->nscanned = r->offset;
+    r->state    = REQUEST_READING;
+}
+
+/**
+ * Return whether the request buffer holds a complete request head (i.e. up
+ * to and including an empty line), without reading from the socket.
+ *
+ * Only bytes not seen by a previous call are scanned.
+ **/
+bool
+buffered_request(struct request *r)
+{
+    while (r->nscanned < r->nbuffer) {
+        size_t i = r->nscanned + scan_delimiter(r->buffer + r->nscanned, r->nbuffer - r->nscanned, "\n");
+        if (i == r->nbuffer) {
+            r->nscanned = i;
+            break;
+        }
+        if ((i >= r->start + 1 && r->buffer[i - 1] == '\n') ||
+            (i >= r->start + 2 && r->buffer[i - 1] == '\r' && r->buffer[i - 2] == '\n')) {
+            r->nscanned = i;
+            return true;
+        }
+        r->nscanned = i + 1;
+    }
+    return false;
+}
+
+/**
+ * Return where the next bytes read from the client socket go in the request
+ * buffer, storing how many fit in n (0 if the buffer is full).
+ *
+ * Room is made by discarding already handled requests if necessary.
+ **/
+char *
+request_space(struct request *r, size_t *n)
+{
+    if (r->nbuffer >= REQUEST_BUFSIZ - 1 && r->start > 0) {
+        r->nbuffer  -= r->start;
+        r->nscanned -= r->start;
+        r->offset   -= r->start;
+        memmove(r->buffer, r->buffer + r->start, r->nbuffer + 1);
+        r->start     = 0;
+    }
+
+    *n = r->nbuffer < REQUEST_BUFSIZ - 1 ? REQUEST_BUFSIZ - 1 - r->nbuffer : 0;
+    return r->buffer + r->nbuffer;
+}
+
+/**
+ * Account for n bytes read into the request buffer at request_space.
+ **/
+void
+request_received(struct request *r, size_t n)
+{
+    r->nbuffer += n;
+    r->buffer[r->nbuffer] = '\0';
+}
+
+/**
+ * Read request head from client socket.
+ *
+ * This reads from the socket into the request buffer until the empty line
+ * that terminates the request head has been received.
+ *
+ * Returns 1 once the request head is buffered, 0 if the socket would block
+ * first, and -1 on error, end of file, or if the head does not fit in
+ * REQUEST_BUFSIZ.
+ **/
+int
+read_request(struct request *r)
+{
+    char  *space;
+    size_t nspace;
+
+    while (true) {
+        if (buffered_request(r)) {
+            return 1;
+        }
+
+        space = request_space(r, &nspace);
+        if (nspace == 0) {
+            return -1;
+        }
+
+        ssize_t nread = read(r->fd, space, nspace);
+        if (nread < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        if (nread == 0) {
+            return -1;
+        }
+
+        request_received(r, nread);
+    }
+}
+
+/**
+ * Queue length bytes of body_fd, starting at offset, to be sent after
+ * everything written to the response stream so far (see write_response).
+ *
+ * Returns 0 on success, and -1 if REQUEST_RANGES ranges are already queued
+ * or memory is exhausted.
+ **/
+int
+queue_body(struct request *r, off_t offset, off_t length)
+{
+    off_t position;
+
+    if (r->nranges >= REQUEST_RANGES) {
+        return -1;
+    }
+    if (!r->ranges && !(r->ranges = request_alloc(r, REQUEST_RANGES * sizeof(struct body_range)))) {
+        return -1;
+    }
+    if (fflush(r->file) != 0 || (position = ftello(r->file)) < 0) {
+        return -1;
+    }
+
+    r->ranges[r->nranges].position = position;
+    r->ranges[r->nranges].offset   = offset;
+    r->ranges[r->nranges].length   = length;
+    r->nranges++;
+    return 0;
+}
+
+/**
+ * Send remainder of body range to client socket, where more tells whether
+ * more response data follows it.
+ *
+ * The range is sent with sendfile(2) unless SendFile is disabled or the
+ * file does not support it, in which case it is copied through a buffer.
+ * Either way the range's last segment is held back while more data follows
+ * (with TCP_CORK or MSG_MORE respectively), so it can be filled up.
+ *
+ * Returns 0 once the range has been sent, 1 if the socket would block first,
+ * and -1 on error.
+ **/
+static int
+write_body(struct request *r, struct body_range *range, bool more)
+{
+    char buffer[BUFSIZ];
+    ssize_t nwritten;
+
+    /* Stream range straight from the page cache */
+    if (more && SendFile && !r->corked) {
+        r->corked = setsockopt(r->fd, IPPROTO_TCP, TCP_CORK, &(int){1}, sizeof(int)) == 0;
+    }
+    while (range->length > 0 && SendFile) {
+        nwritten = sendfile(r->fd, r->body_fd, &range->offset, range->length);
+        if (nwritten < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EINVAL || errno == ENOSYS) {
+                break;      /* Unsupported for this file: copy instead */
+            }
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 1 : -1;
+        }
+        if (nwritten == 0) {
+            return -1;      /* File shrank underneath us */
+        }
+        range->length -= nwritten;
+    }
+
+    /* Otherwise stream range in chunks */
+    while (range->length > 0) {
+        size_t  nwant = range->length < (off_t)sizeof(buffer) ? (size_t)range->length : sizeof(buffer);
+        ssize_t nread = pread(r->body_fd, buffer, nwant, range->offset);
+        if (nread <= 0) {
+            if (nread < 0 && errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+
+        int flags = (more || nread < range->length) ? MSG_NOSIGNAL | MSG_MORE : MSG_NOSIGNAL;
+        nwritten = send(r->fd, buffer, nread, flags);
+        if (nwritten < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 1 : -1;
+        }
+        range->offset += nwritten;
+        range->length -= nwritten;
+    }
+
+    return 0;
+}
+
+/**
+ * Append data to the response stream as one chunk if chunked (chunked
+ * transfer coding), or else as is.
+ **/
+static void
+write_chunk(struct request *r, bool chunked, const char *data, size_t n)
+{
+    if (!chunked) {
+        fwrite(data, 1, n, r->file);
+    } else if (n > 0) {
+        fprintf(r->file, "%zx\r\n", n);
+        fwrite(data, 1, n, r->file);
+        fputs("\r\n", r->file);
+    }
+}
+
+/**
+ * Append chunk written to chunked response stream (see chunk_response).
+ **/
+static ssize_t
+chunk_write(void *cookie, const char *data, size_t n)
+{
+    write_chunk(cookie, true, data, n);
+    return n;
+}
+
+/**
+ * End body of chunked response stream with the last (empty) chunk.
+ **/
+static int
+chunk_close(void *cookie)
+{
+    struct request *r = cookie;
+
+    fputs("0\r\n\r\n", r->file);
+    return 0;
+}
+
+/**
+ * Open stream for a response body with chunked transfer coding.
+ *
+ * Whatever is written to the stream is appended to the response stream as
+ * chunks of up to one stdio buffer each, so a body of unknown length never
+ * has to be assembled on the side first, and closing it ends the body.
+ *
+ * Returns NULL on error.
+ **/
+FILE *
+chunk_response(struct request *r)
+{
+    cookie_io_functions_t functions = {.write = chunk_write, .close = chunk_close};
+    FILE *stream = fopencookie(r, "w", functions);
+
+    if (stream) {
+        setvbuf(stream, NULL, _IOFBF, 8*BUFSIZ);
+    }
+    return stream;
+}
+
+/**
+ * Account for n bytes relayed from the response pipe as part of the current
+ * chunk (see relay_pipe), ending the chunk once it is complete.
+ *
+ * Returns 0 on success, and -1 on error.
+ **/
+int
+pipe_relayed(struct request *r, size_t n)
+{
+    r->pipe_chunk -= n;
+    if (r->pipe_chunk == 0 && r->pipe_chunked) {
+        fputs("\r\n", r->file);
+        return fflush(r->file) == 0 ? 0 : -1;
+    }
+    return 0;
+}
+
+/**
+ * Turn the script's header block collected from the response pipe into the
+ * response head once it is complete (see handle_cgi_head), and append any
+ * output read past it.  If the script ended (eof), its whole output is in
+ * the block, so the response gets a Content-Length.
+ *
+ * The block is collected in the request arena, with room for most header
+ * blocks; once it fills that room, it is moved into twice as much.
+ * Scripts whose header block is malformed, missing, or longer than
+ * CGI_HEAD_MAX are killed, and answered with 500 Internal Server Error.
+ * Output of responses without a body is abandoned.
+ **/
+static void
+pipe_head_response(struct request *r, bool eof)
+{
+    bool body;
+    ssize_t nhead = handle_cgi_head(r, r->pipe_head, r->npipe_head, eof, &body);
+
+    if (nhead == 0 && r->npipe_head < r->pipe_head_size) {
+        return;
+    }
+    if (nhead == 0 && r->pipe_head_size < CGI_HEAD_MAX) {
+        size_t size  = r->pipe_head_size * 2 < CGI_HEAD_MAX ? r->pipe_head_size * 2 : CGI_HEAD_MAX;
+        char  *grown = request_alloc(r, size);
+        if (grown) {
+            memcpy(grown, r->pipe_head, r->npipe_head);
+            r->pipe_head      = grown;
+            r->pipe_head_size = size;
+            return;
+        }
+    }
+    if (nhead <= 0) {
+        log("Malformed header block from %s", r->path);
+        close_pipe(r, true);
+        handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    char  *rest  = r->pipe_head + nhead;
+    size_t nrest = r->npipe_head - nhead;
+
+    r->pipe_head = NULL;
+    if (body) {
+        write_chunk(r, r->pipe_chunked, rest, nrest);
+    }
+    if (eof || !body) {
+        close_pipe(r, false);
+    }
+}
+
+/**
+ * Append output available in the response pipe to the response stream.
+ *
+ * Output is first collected in pipe_head, until the script's header block
+ * is complete (see pipe_head_response), and also captured for the
+ * micro-cache if the request fills an entry (see microcache_capture).
+ * After it, output is appended as a chunk per read if the response is
+ * chunked, except for the rest of a chunk whose size has already been sent
+ * (see relay_pipe), which is appended as is.
+ *
+ * Returns the number of bytes read, 0 once the pipe is drained (it is then
+ * closed, its writer reaped, and the response ended), and -1 on error, with
+ * errno EAGAIN if no output is available yet.
+ **/
+static ssize_t
+pipe_response(struct request *r)
+{
+    char buffer[8*BUFSIZ];
+    char *data = r->pipe_head ? r->pipe_head + r->npipe_head : buffer;
+    size_t nwant = r->pipe_head ? r->pipe_head_size - r->npipe_head : sizeof(buffer);
+    ssize_t nread;
+
+    if (r->pipe_chunk > 0 && r->pipe_chunk < nwant) {
+        nwant = r->pipe_chunk;
+    }
+
+    do {
+        nread = read(r->pipe_fd, data, nwant);
+    } while (nread < 0 && errno == EINTR);
+
+    if (nread < 0) {
+        return -1;
+    }
+    if (r->cache_entry) {
+        microcache_capture(r, data, nread);
+    }
+    if (r->pipe_head) {
+        r->npipe_head += nread;
+        pipe_head_response(r, nread == 0);
+    } else if (nread == 0) {
+        if (r->pipe_chunked) {
+            fputs("0\r\n\r\n", r->file);
+        }
+        close_pipe(r, false);
+    } else if (r->pipe_chunk > 0) {
+        fwrite(buffer, 1, nread, r->file);
+        if (pipe_relayed(r, nread) < 0) {
+            return -1;
+        }
+    } else {
+        write_chunk(r, r->pipe_chunked, buffer, nread);
+    }
+
+    /* Output of a bodyless response ends early, and once captured, the
+     * rest of it may be spliced */
+    if (r->cache_entry) {
+        if (r->pipe_fd < 0) {
+            microcache_capture(r, NULL, 0);
+        }
+        r->pipe_copy = r->cache_entry != NULL;
+    }
+
+    if (fflush(r->file) != 0) {
+        errno = EIO;
+        return -1;
+    }
+    return nread;
+}
+
+/**
+ * Determine how to relay the next output of the response pipe.
+ *
+ * Output waiting in the pipe is to be spliced straight to the client socket
+ * by the caller (see splice_pipe), so it never passes through user space.
+ * If the response is chunked, the waiting output becomes a chunk, whose
+ * size goes ahead of it through the response stream.  Only as much as
+ * FIONREAD reports is moved, so the pipe never blocks and EAGAIN can only
+ * come from the socket.
+ *
+ * Waiting for more output, noticing its end, and the script's header block
+ * are left to pipe_response, which is also used instead if SendFile is
+ * disabled or the output must be copied (pipe_copy, which the caller sets
+ * if the socket does not support splicing).
+ *
+ * Returns the number of bytes to splice (to be reported with pipe_relayed),
+ * 0 if the response stream has more to send first, and -1 on error, with
+ * errno EAGAIN if no output is available yet.
+ **/
+ssize_t
+relay_pipe(struct request *r)
+{
+    int navailable;
+
+    if (SendFile && !r->pipe_copy && !r->pipe_head) {
+        if (r->pipe_chunk > 0) {
+            return r->pipe_chunk;
+        }
+        if (ioctl(r->pipe_fd, FIONREAD, &navailable) < 0) {
+            return -1;
+        }
+        if (navailable > 0) {
+            r->pipe_chunk = navailable;
+            if (!r->pipe_chunked) {
+                return navailable;
+            }
+            fprintf(r->file, "%x\r\n", navailable);
+            return fflush(r->file) == 0 ? 0 : -1;
+        }
+    }
+    return pipe_response(r) < 0 ? -1 : 0;
+}
+
+/**
+ * Splice up to length bytes of output waiting in the response pipe (see
+ * relay_pipe) straight to the client socket.
+ *
+ * Returns 0 once some have been moved (or if the socket does not support
+ * splicing, in which case pipe_copy is set), 1 if the socket would block
+ * first, and -1 on error.
+ **/
+static int
+splice_pipe(struct request *r, size_t length)
+{
+    ssize_t nwritten;
+
+    do {
+        nwritten = splice(r->pipe_fd, NULL, r->fd, NULL, length,
+                          SPLICE_F_MOVE | SPLICE_F_NONBLOCK | SPLICE_F_MORE);
+    } while (nwritten < 0 && errno == EINTR);
+
+    if (nwritten < 0) {
+        if (errno == EINVAL) {
+            r->pipe_copy = true;
+            return 0;
+        }
+        return (errno == EAGAIN || errno == EWOULDBLOCK) ? 1 : -1;
+    }
+    return (nwritten > 0 && pipe_relayed(r, nwritten) == 0) ? 0 : -1;
+}
+
+/**
+ * Read more of the request body from the client socket into the request
+ * buffer, without blocking.
+ *
+ * Room is made by dropping what has been consumed: once a request is being
+ * handled, its head is not needed anymore, so the body reuses the buffer.
+ *
+ * Returns 1 if bytes were read, 0 if the socket has none yet, and -1 on
+ * error, end of file, or if the buffer holds no complete line.
+ **/
+static int
+read_body_buffer(struct request *r)
+{
+    size_t nspace;
+    char  *space;
+
+    if (r->offset == r->nbuffer) {
+        r->offset  = 0;
+        r->nbuffer = 0;
+    }
+    r->start    = r->offset;
+    r->nscanned = r->offset;
+
+    space = request_space(r, &nspace);
+    if (nspace == 0) {
+        return -1;
+    }
+
+    while (true) {
+        ssize_t nread = recv(r->fd, space, nspace, MSG_DONTWAIT);
+        if (nread < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        if (nread == 0) {
+            return -1;
+        }
+        request_received(r, nread);
+        return 1;
+    }
+}
+
+/**
+ * Parse line of chunked body framing: a chunk size (in hex, with any chunk
+ * extensions ignored), the empty line that ends each chunk, or a trailer
+ * (ignored up to the empty line that ends the body).
  *
- * The returned request struct must be deallocated using free_request.
+ * Returns 0 on success, and -1 if the line is malformed or the chunk takes
+ * the body past MaxBodySize.
  **/
-struct request *
-accept_request(int sfd)
+static int
+parse_body_line(struct request *r, const char *line, size_t length)
 {
-    struct request *r;
-    struct sockaddr raddr;
-    socklen_t rlen;
+    off_t size = 0;
+    size_t i;
 
-    /* Allocate request struct (zeroed) */
-    r = calloc(1, sizeof(*r));
-    if (!r) {
-        return NULL;
+    switch (r->body) {
+    case BODY_CHUNK_END:
+        if (length > 0) {
+            return -1;
+        }
+        r->body = BODY_CHUNK_SIZE;
+        return 0;
+
+    case BODY_TRAILER:
+        if (length == 0) {
+            r->body = BODY_NONE;
+        }
+        return 0;
+
+    default:
+        break;
     }
-    r->fd = -1;
-    r->file = NULL;
-    r->headers = NULL;
 
-    /* Accept a client */
-    rlen = sizeof(raddr);
-    r->fd = accept(sfd, &raddr, &rlen);
-    if (r->fd < 0) {
-        goto fail;
+    for (i = 0; i < length; i++) {
+        char c = line[i] | 0x20;
+        int  digit = (c >= '0' && c <= '9') ? c - '0' : (c >= 'a' && c <= 'f') ? c - 'a' + 10 : -1;
+        if (digit < 0) {
+            break;
+        }
+        if (size > (INT64_MAX - digit) / 16) {
+            return -1;
+        }
+        size = size * 16 + digit;
+    }
+    if (i == 0 || (i < length && line[i] != ';' && line[i] != ' ' && line[i] != '\t')) {
+        return -1;
     }
 
-    /* Lookup client information */
-    if (getnameinfo(&raddr, rlen, r->host, NI_MAXHOST, r->port, NI_MAXHOST, NI_NUMERICHOST | NI_NUMERICSERV) != 0) {
-        r->host[0] = '\0';
-        r->port[0] = '\0';
+    if (size > (off_t)MaxBodySize - r->body_total) {
+        log("Request body from %s:%s exceeds %zu bytes", r->host, r->port, MaxBodySize);
+        return -1;
     }
+    r->body_total += size;
+    r->body_left   = size;
+    r->body        = size > 0 ? BODY_CHUNK_DATA : BODY_TRAILER;
+    return 0;
+}
 
-    /* Open socket stream */
-    r->file = fdopen(r->fd, "r+");
-    if (!r->file) {
-        goto fail;
+/**
+ * Feed request body to the script reading the input pipe (or if there is
+ * none, e.g. because the script quit reading, discard it), decoding it if
+ * it is chunked.
+ *
+ * Body bytes that arrived with the request head (and chunk framing) go
+ * through the request buffer; the rest is spliced from the socket straight
+ * into the pipe, unless SendFile is disabled.  Neither the socket nor the
+ * pipe is ever waited for, so however large the body is, no more than the
+ * request buffer and pipe hold is in flight at a time: a script that reads
+ * slowly holds the client back.  The input pipe is closed once the whole
+ * body has been fed, so the script sees its end.
+ *
+ * Returns 0 once the body has been read, 1 if the socket has no more of it
+ * yet, 2 if the input pipe is full, and -1 on error (including a malformed
+ * or oversized chunked body, or the client closing the connection).
+ **/
+int
+read_body(struct request *r)
+{
+    ssize_t nwritten;
+    size_t  length;
+    char   *line;
+    int     status;
+
+    r->input_full = false;
+    while (r->body != BODY_NONE) {
+        /* Chunk framing comes in lines */
+        if (r->body != BODY_LENGTH && r->body != BODY_CHUNK_DATA) {
+            line = parse_request_line(r, &length);
+            if (line) {
+                status = parse_body_line(r, line, length);
+            } else {
+                status = read_body_buffer(r);
+                if (status == 0) {
+                    return 1;
+                }
+            }
+            if (status < 0) {
+                return -1;
+            }
+            continue;
+        }
+
+        /* Write out body data that is already buffered */
+        if (r->offset < r->nbuffer) {
+            length = r->nbuffer - r->offset;
+            if ((off_t)length > r->body_left) {
+                length = r->body_left;
+            }
+            nwritten = r->input_fd >= 0 ? write(r->input_fd, r->buffer + r->offset, length) : (ssize_t)length;
+            if (nwritten >= 0) {
+                r->offset += nwritten;
+            }
+
+        /* Splice the rest straight from the socket, as much as it holds */
+        } else if (r->input_fd >= 0 && SendFile) {
+            int navailable;
+            char peek;
+
+            if (ioctl(r->fd, FIONREAD, &navailable) < 0) {
+                return -1;
+            }
+            if (navailable == 0) {
+                /* Tell whether more is coming or the client hung up */
+                ssize_t npeek = recv(r->fd, &peek, 1, MSG_PEEK | MSG_DONTWAIT);
+                if (npeek > 0 || (npeek < 0 && errno == EINTR)) {
+                    continue;
+                }
+                return (npeek < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) ? 1 : -1;
+            }
+
+            length = (off_t)navailable < r->body_left ? (size_t)navailable : (size_t)r->body_left;
+            nwritten = splice(r->fd, NULL, r->input_fd, NULL, length, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (nwritten == 0) {
+                return -1;
+            }
+
+        /* Or else read it into the buffer first */
+        } else {
+            status = read_body_buffer(r);
+            if (status <= 0) {
+                return status < 0 ? -1 : 1;
+            }
+            continue;
+        }
+
+        if (nwritten < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                r->input_full = true;
+                return 2;
+            }
+            if (errno != EPIPE) {
+                return -1;
+            }
+            close_input(r);     /* Script quit reading: discard the rest */
+            continue;
+        }
+
+        r->body_left -= nwritten;
+        if (r->body_left == 0) {
+            r->body = r->body == BODY_LENGTH ? BODY_NONE : BODY_CHUNK_END;
+        }
     }
 
+    close_input(r);
+    return 0;
+}
 
-    log("Accepted request from %s:%s", r->host, r->port);
-    return r;
+/**
+ * Store what a request whose response is waiting for its script or body
+ * (see write_response) waits for in waits: output from the response pipe
+ * (or the end of another request's run of the script, the answer of its
+ * persistent worker, or a worker becoming free), and while the body is
+ * being read, either room in the input pipe or more of the body from the
+ * client socket.  A body that is only discarded once the answer waited for
+ * is in (see handle_worker_request) is not waited for meanwhile.
+ *
+ * Returns the number of entries stored (at most 2).
+ **/
+size_t
+request_waits(struct request *r, struct pollfd *waits)
+{
+    size_t n = 0;
 
-fail:
-    free_request(r);
-    return NULL;
+    if (r->pipe_fd >= 0) {
+        waits[n++] = (struct pollfd){.fd = r->pipe_fd, .events = POLLIN};
+    }
+    if (r->cache_fd >= 0) {
+        waits[n++] = (struct pollfd){.fd = r->cache_fd, .events = POLLIN};
+    }
+    if (r->worker) {
+        waits[n++] = (struct pollfd){.fd = worker_socket(r->worker), .events = POLLIN};
+    }
+    if (r->worker_fd >= 0) {
+        waits[n++] = (struct pollfd){.fd = r->worker_fd, .events = POLLIN};
+    }
+    if (r->body != BODY_NONE && !r->worker && r->worker_fd < 0) {
+        waits[n++] = r->input_full ? (struct pollfd){.fd = r->input_fd, .events = POLLOUT}
+                                   : (struct pollfd){.fd = r->fd,       .events = POLLIN};
+    }
+    return n;
 }
 
 /**
- * Deallocate request struct.
+ * Write response to client socket.
  *
- * This function does the following:
+ * This sends the response(s) buffered in the request stream, interleaved
+ * with the queued ranges of the body file (if any; see queue_body and
+ * write_body), followed by the output of the response pipe (if any) as it
+ * arrives (see relay_pipe).  Responses to pipelined requests are batched
+ * in the stream, so they go out in as few writes as possible, and headers
+ * in front of a body range or pipe output are sent with MSG_MORE, so they
+ * share segments with it (unless the client has a request body to send,
+ * which it may only do once it sees them).  Whenever the pipe has no
+ * output, the request body (if any) is fed to the script instead (see
+ * read_body), and it is read to its end before the connection moves on to
+ * the next request.  Requests for scripts served by persistent workers are
+ * answered once the worker's whole output is in (see
+ * handle_worker_response), and requests waiting for a busy worker or
+ * another request's run of the script are handled again once it is done.
  *
- *  1. Closes the request socket stream or file descriptor.
- *  2. Frees all allocated strings in request struct.
- *  3. Frees all of the headers (including any allocated fields).
- *  4. Frees request struct.
+ * Returns 0 once everything has been sent, 1 if the socket would block
+ * first, 2 if neither the pipe has output nor the body can be fed (or the
+ * answer waited for is not in; the caller should wait as request_waits
+ * tells), and -1 on error.
  **/
-void
-free_request(struct request *r)
+int
+write_response(struct request *r)
 {
-    struct header *header;
+    ssize_t nwritten;
+    ssize_t nrelay;
+    int status;
 
-    if (r == NULL) {
-    	return;
+    /* Sync response buffer with stream */
+    if (fflush(r->file) != 0) {
+        return -1;
     }
 
-    /* Close socket or fd */
-    if (r->file) {
-        fclose(r->file);
-    } else if (r->fd >= 0) {
-        close(r->fd);
+    while (true) {
+        struct body_range *range = r->nextrange < r->nranges ? &r->ranges[r->nextrange] : NULL;
+        size_t until = range ? range->position : r->nresponse;
+        int    flags = (range && range->length > 0) || (r->pipe_fd >= 0 && r->body == BODY_NONE)
+                       ? MSG_NOSIGNAL | MSG_MORE : MSG_NOSIGNAL;
+
+        /* Send buffered response up to the next body range */
+        while (r->nsent < until) {
+            nwritten = send(r->fd, r->response + r->nsent, until - r->nsent, flags);
+            if (nwritten < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return (errno == EAGAIN || errno == EWOULDBLOCK) ? 1 : -1;
+            }
+            r->nsent += nwritten;
+        }
+
+        if (range) {
+            /* Send body range */
+            status = write_body(r, range, r->nextrange + 1 < r->nranges || range->position < r->nresponse);
+            if (status != 0) {
+                return status;
+            }
+            r->nextrange++;
+            continue;
+        }
+
+        /* Handle request again once the script run or busy worker it waits
+         * for is done (see microcache_lookup and worker_start) */
+        if (r->cache_fd >= 0 || r->worker_fd >= 0) {
+            if (!(r->cache_fd >= 0 ? microcache_ready(r) : worker_ready(r))) {
+                return 2;
+            }
+            handle_cgi_request(r);
+            if (fflush(r->file) != 0) {
+                return -1;
+            }
+            continue;
+        }
+
+        /* Answer from the worker's output once all of it is in */
+        if (r->worker) {
+            if (!handle_worker_response(r)) {
+                return 2;
+            }
+            if (fflush(r->file) != 0) {
+                return -1;
+            }
+            continue;
+        }
+
+        /* Relay next output of pipe once everything before it is sent */
+        if (r->pipe_fd >= 0) {
+            if (rewind_response(r) < 0) {
+                return -1;
+            }
+            nrelay = relay_pipe(r);
+            if (nrelay > 0 && (status = splice_pipe(r, nrelay)) != 0) {
+                return status;
+            }
+            if (nrelay >= 0) {
+                continue;
+            }
+            if (errno != EAGAIN) {
+                return -1;
+            }
+        }
+
+        /* Meanwhile feed the request body to the script (or once the
+         * response is done, discard what is left of it) */
+        if (r->body != BODY_NONE) {
+            status = read_body(r);
+            if (status < 0) {
+                return -1;
+            }
+            if (status == 0) {
+                continue;
+            }
+        }
+        if (r->pipe_fd >= 0 || r->body != BODY_NONE) {
+            return 2;
+        }
+        break;
     }
 
-    /* Free allocated strings */
-    free(r->method);
-    free(r->uri);
-    free(r->path);
-    free(r->query);
+    return rewind_response(r);
+}
 
-    /* Free headers */
-    header = r->headers;
-    while (header) {
-        struct header *next = header->next;
-        free(header->name);
-        free(header->value);
-        free(header);
-        header = next;
+/**
+ * Empty response stream and body range queue once everything in them has
+ * been sent, so they can be reused for the next responses.
+ *
+ * Returns 0 on success, and -1 on error.
+ **/
+int
+rewind_response(struct request *r)
+{
+    /* Push out whatever the cork still holds */
+    if (r->corked) {
+        setsockopt(r->fd, IPPROTO_TCP, TCP_CORK, &(int){0}, sizeof(int));
+        r->corked = false;
     }
 
-    /* Free request */
-    free(r);
+    if (fseeko(r->file, 0, SEEK_SET) != 0 || fflush(r->file) != 0) {
+        return -1;
+    }
+    r->nsent     = 0;
+    r->nranges   = 0;
+    r->nextrange = 0;
+    return 0;
 }
 
 /**
  * Parse HTTP Request.
  *
- * This function first parses the request method, any query, and then the
- * headers, returning 0 on success, and -1 on error.
+ * This function first reads the request head (if it is not already
+ * buffered), then parses the request method, any query, the headers, and
+ * how the body (if any) is framed, returning 0 on success, and -1 on error.
+ *
+ * Parsing happens in place: the method, URI, query, version, and headers
+ * point into the request buffer (NUL-terminated there), so nothing is
+ * allocated or copied.  They stay valid until the request is reset.
  **/
 int
 parse_request(struct request *r)
 {
+    /* Read HTTP Request Head */
+    if (read_request(r) <= 0) {
+        return -1;
+    }
+
     /* Parse HTTP Request Method */
     if (parse_request_method(r) < 0) {
         return -1;
     }
 
-    if (r->uri) {
-        char *qmark = strchr(r->uri, '?');
-        if (qmark) {
-            r->path = strndup(r->uri, (size_t)(qmark - r->uri));
-            r->query = strdup(qmark+1);
-            if (!r->path || !r->query) {
-                return -1;
-            }
-        } else {
-            r->path = strdup(r->uri);
-            if (!r->path) {
-                return -1;
-            }
+    /* Parse HTTP Request Headers */
+    if (parse_request_headers(r) < 0) {
+        return -1;
+    }
 
-        }
+    /* Determine whether connection persists: HTTP/1.1 unless the client
+     * asks to close, HTTP/1.0 only if the client asks to keep it alive */
+    const char *connection = request_known_header(r, HEADER_CONNECTION);
+    if (streq(r->version, "HTTP/1.1")) {
+        r->keepalive = !(connection && strcasestr(connection, "close"));
+    } else {
+        r->keepalive = connection && strcasestr(connection, "keep-alive");
     }
 
-    /* Parse HTTP Requet Headers*/
+    r->nrequests++;
+    if (r->nrequests >= KeepAliveMax) {
+        r->keepalive = false;
+    }
 
-    if (parse_request_headers(r) < 0) {
+    /* Determine request body framing */
+    if (parse_request_body(r) < 0) {
         return -1;
     }
 
     return 0;
 }
 
+/**
+ * Return value of named request header (compared case-insensitively), or
+ * NULL if the request does not have it.
+ *
+ * Well-known headers are found through their slot (see
+ * request_known_header); others are searched for.
+ **/
+const char *
+request_header(struct request *r, const char *name)
+{
+    size_t    nname = strlen(name);
+    header_id id    = header_lookup(name, nname);
+
+    if (id != HEADER_UNKNOWN) {
+        return request_known_header(r, id);
+    }
+
+    for (size_t i = 0; i < r->nheaders; i++) {
+        struct header *header = &r->headers[i];
+        if (header->nname == nname && strcasecmp(header->name, name) == 0) {
+            return header->value;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Return value of well-known request header (the first one, if it was
+ * sent more than once), or NULL if the request does not have it.
+ **/
+const char *
+request_known_header(struct request *r, header_id id)
+{
+    return r->known[id] ? r->headers[r->known[id] - 1].value : NULL;
+}
+
+/**
+ * Return next token of string s (delimited by spaces or tabs, and ending at
+ * end), NUL-terminating it in place, storing its length, and advancing s
+ * past it.  Returns NULL if no token remains.
+ **/
+static char *
+parse_request_token(char **s, char *end, size_t *length)
+{
+    char *token = *s;
+    size_t n;
+
+    while (token < end && (*token == ' ' || *token == '\t')) {
+        token++;
+    }
+
+    n = scan_delimiter(token, end - token, " \t");
+    if (n == 0) {
+        return NULL;
+    }
+
+    *s = token + n < end ? token + n + 1 : end;
+    token[n] = '\0';
+    *length = n;
+    return token;
+}
+
+/**
+ * Trim spaces and tabs from both ends of the length bytes at s,
+ * NUL-terminating the result in place and storing its length.
+ **/
+static char *
+parse_request_trim(char *s, size_t length, size_t *ntrimmed)
+{
+    char *end = s + length;
+
+    while (s < end && (*s == ' ' || *s == '\t')) s++;
+    while (end > s && (end[-1] == ' ' || end[-1] == '\t')) end--;
+
+    *end = '\0';
+    *ntrimmed = end - s;
+    return s;
+}
+
 /**
  * Parse HTTP Request Method and URI
  *
@@ -165,47 +1441,39 @@ parse_request(struct request *r)
  *  GET / HTTP/1.1
  *  GET /cgi.script?q=foo HTTP/1.0
  *
- * This function extracts the method, uri, and query (if it exists).
+ * This function extracts the method, uri, query (if it exists), and version
+ * by splitting the request line in place.
  **/
 int
 parse_request_method(struct request *r)
 {
-    char line[BUFSIZ];
-    char method[BUFSIZ], uri[BUFSIZ], version[BUFSIZ];
+    char *line;
+    char *qmark;
+    size_t length;
+    size_t nmethod = 0, nuri = 0, nversion = 0;
 
-    /* Read line from socket */
-    if (!fgets(line, sizeof(line), r->file)) {
+    /* Read line from request buffer */
+    line = parse_request_line(r, &length);
+    if (!line) {
         goto fail;
     }
 
-    // Trim CRLF 
-    char *crlf = strstr(line, "\r\n");
-    if (crlf) *crlf = '\0';
-    else {
-        char *lf = strchr(line, '\n');
-        if (lf) *lf = '\0';
-    }
-
-    /* Parse method and uri */
-    if (sscanf(line, "%s %s %s", method, uri, version) != 3) {
+    /* Parse method, uri, and version */
+    char *end = line + length;
+    r->method  = parse_request_token(&line, end, &nmethod);
+    r->uri     = parse_request_token(&line, end, &nuri);
+    r->version = parse_request_token(&line, end, &nversion);
+    if (!r->method || !r->uri || !r->version) {
         goto fail;
     }
 
-    /* Parse query from uri */
-    char *qmark = strchr(uri, '?');
-    char *query_str = NULL;
-    if (qmark) {
-        *qmark = '\0';                 // keep only path in uri 
-        query_str = qmark + 1;         // after '?' 
-    }
-
-    /* Record method, uri, and query in request struct */
-    r->method = strdup(method);
-    r->uri    = strdup(uri);
-    r->query  = strdup(query_str ? query_str : "");
-
-    if (!r->method || !r->uri || !r->query) {
-        goto fail;
+    /* Parse query from uri (empty if there is none) */
+    qmark = r->uri + scan_delimiter(r->uri, nuri, "?");
+    if (*qmark) {
+        *qmark   = '\0';
+        r->query = qmark + 1;
+    } else {
+        r->query = r->uri + nuri;
     }
 
     debug("HTTP METHOD: %s", r->method);
@@ -234,93 +1502,142 @@ fail:
  *  Accept-Encoding: gzip, deflate
  *  Connection: keep-alive
  *
- * This function parses the stream from the request socket using the following
- * pseudo-code:
+ * This function parses the request buffer using the following pseudo-code:
  *
- *  while (buffer = read_from_socket() and buffer is not empty):
+ *  while (buffer = read_line_from_request() and buffer is not empty):
  *      name, value = buffer.split(':')
- *      header      = new Header(name, value)
- *      headers.append(header)
+ *      headers.append(trim(name), trim(value))
+ *
+ * Lines without a ':' are ignored; more than REQUEST_HEADERS headers is an
+ * error.  Well-known headers are also indexed by name (see header_id), so
+ * looking them up later takes constant time.
  **/
 int
 parse_request_headers(struct request *r)
 {
-    struct header *curr = NULL;
-    char buffer[BUFSIZ];
-    char *name;
-    char *value;
-    
-    /* Parse headers from socket */
-    while (fgets(buffer, sizeof(buffer), r->file)) {
-        size_t len = strlen(buffer);
-
-        // Strip trailing CRLF 
-        while (len > 0 && (buffer[len - 1] == '\n' || buffer[len - 1] == '\r')) {
-            buffer[--len] = '\0';
-        }
+    char *buffer;
+    size_t length;
 
+    /* Parse headers from request buffer */
+    while ((buffer = parse_request_line(r, &length))) {
         // Empty line marks end of headers 
-        if (len == 0) {
+        if (length == 0) {
             break;
         }
 
         // Split on first ':' 
-        char *colon = strchr(buffer, ':');
-        if (!colon) {
+        char *colon = buffer + scan_delimiter(buffer, length, ":");
+        if (!*colon) {
             // Malformed header: ignore this line 
             continue;
         }
 
-        *colon = '\0';
-        name  = buffer;
-        value = colon + 1;
+        if (r->nheaders >= REQUEST_HEADERS) {
+            goto fail;
+        }
+
+        // Record trimmed name and value
+        struct header *h = &r->headers[r->nheaders++];
+        h->name  = parse_request_trim(buffer, colon - buffer, &h->nname);
+        h->value = parse_request_trim(colon + 1, buffer + length - colon - 1, &h->nvalue);
+
+        // Index well-known headers by name (first one wins)
+        header_id id = header_lookup(h->name, h->nname);
+        if (id != HEADER_UNKNOWN && !r->known[id]) {
+            r->known[id] = r->nheaders;
+        }
+    }
+
+#ifndef NDEBUG
+    for (size_t i = 0; i < r->nheaders; i++) {
+    	debug("HTTP HEADER %s = %s", r->headers[i].name, r->headers[i].value);
+    }
+#endif
+    return 0;
 
-        // Trim leading/trailing whitespace from name 
-        while (*name == ' ' || *name == '\t') name++;
-        char *end = name + strlen(name);
-        while (end > name && (end[-1] == ' ' || end[-1] == '\t')) *--end = '\0';
+fail:
+    return -1;
+}
 
-        // Trim leading/trailing whitespace from value 
-        while (*value == ' ' || *value == '\t') value++;
-        end = value + strlen(value);
-        while (end > value && (end[-1] == ' ' || end[-1] == '\t')) *--end = '\0';
+/**
+ * Parse HTTP Request Body Framing
+ *
+ * A request has a body if it is sent with Transfer-Encoding: chunked, or
+ * with a Content-Length other than 0.  The body itself is read later, while
+ * the request is handled (see read_body).  Other transfer codings and
+ * malformed lengths are errors, and so are framings that peers may read
+ * differently (and so smuggle a request in the body): both headers at once,
+ * or Content-Length headers that disagree.
+ **/
+int
+parse_request_body(struct request *r)
+{
+    const char *encoding = request_known_header(r, HEADER_TRANSFER_ENCODING);
+    const char *length   = request_known_header(r, HEADER_CONTENT_LENGTH);
+    off_t size = 0;
 
-        // Allocate header node 
-        struct header *h = calloc(1, sizeof(*h));
-        if (!h) {
+    if (encoding && length) {
+        goto fail;
+    }
+    for (size_t i = 0; length && i < r->nheaders; i++) {
+        if (strcasecmp(r->headers[i].name, "Content-Length") == 0 && !streq(r->headers[i].value, length)) {
             goto fail;
         }
-        h->name  = strdup(name);
-        h->value = strdup(value);
-        if (!h->name || !h->value) {
-            if (h->name)  free(h->name);
-            if (h->value) free(h->value);
-            free(h);
+    }
+
+    if (encoding) {
+        if (strcasecmp(encoding, "chunked") != 0) {
             goto fail;
         }
-        h->next = NULL;
+        r->body = BODY_CHUNK_SIZE;
+        return 0;
+    }
 
-        // Append to list
-        if (r->headers == NULL) {
-            r->headers = h;
-            curr = h;
-        } else {
-            curr->next = h;
-            curr = h;
+    if (length) {
+        const char *c = length;
+        for (; *c >= '0' && *c <= '9'; c++) {
+            if (size > (INT64_MAX - (*c - '0')) / 10) {
+                goto fail;
+            }
+            size = size * 10 + (*c - '0');
+        }
+        if (c == length || *c) {
+            goto fail;
         }
     }
 
-
-
-#ifndef NDEBUG
-    for (struct header *header = r->headers; header != NULL; header = header->next) {
-    	debug("HTTP HEADER %s = %s", header->name, header->value);
-    }
-#endif
+    r->body       = size > 0 ? BODY_LENGTH : BODY_NONE;
+    r->body_left  = size;
+    r->body_total = size;
     return 0;
 
 fail:
     return -1;
 }
 
+/**
+ * Return next line of the request buffer, storing its length.
+ *
+ * The line terminator (CRLF or LF) is replaced with a NUL and the parse
+ * offset is advanced past it.  Returns NULL when no complete line remains.
+ **/
+char *
+parse_request_line(struct request *r, size_t *length)
+{
+    char *line = r->buffer + r->offset;
+    char *lf   = line + scan_delimiter(line, r->nbuffer - r->offset, "\n");
+
+    if (lf == r->buffer + r->nbuffer) {
+        return NULL;
+    }
+
+    r->offset = (lf - r->buffer) + 1;
+    if (lf > line && lf[-1] == '\r') {
+        lf--;
+    }
+    *lf = '\0';
+    *length = lf - line;
+    return line;
+}
+
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
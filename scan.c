@@ -0,0 +1,159 @@
+/* scan.c: Vectorized Delimiter Scanning */
+
+#include "mainServer.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86
+#endif
+
+#define SCAN_DELIMITERS 16      /* Maximum number of delimiters in a set */
+#define SCAN_PAGE       4096    /* Smallest page size */
+
+/* Whether a block of size bytes at s lies within one page (so reading all
+ * of it cannot fault even if only part of it belongs to the string) */
+#define SCAN_SAFE(s, size)  (((uintptr_t)(s) & (SCAN_PAGE - 1)) <= SCAN_PAGE - (size))
+
+typedef size_t (*scan_function)(const char *s, size_t n, const char *delimiters, size_t ndelimiters);
+
+static size_t scan_resolve(const char *s, size_t n, const char *delimiters, size_t ndelimiters);
+
+static scan_function ScanFunction = scan_resolve;   /* Selected on first use */
+
+/**
+ * Scan one byte at a time.
+ **/
+static size_t
+scan_scalar(const char *s, size_t n, const char *delimiters, size_t ndelimiters)
+{
+    for (size_t i = 0; i < n; i++) {
+        for (size_t d = 0; d < ndelimiters; d++) {
+            if (s[i] == delimiters[d]) {
+                return i;
+            }
+        }
+    }
+    return n;
+}
+
+#ifdef SCAN_X86
+/**
+ * Scan 16 bytes at a time, matching the whole delimiter set with one
+ * PCMPESTRI per block.
+ **/
+__attribute__((target("sse4.2")))
+static size_t
+scan_sse42(const char *s, size_t n, const char *delimiters, size_t ndelimiters)
+{
+    char padded[16] = {0};
+    size_t i = 0;
+
+    memcpy(padded, delimiters, ndelimiters);
+    __m128i set = _mm_loadu_si128((const __m128i *)padded);
+
+    for (; i + 16 <= n; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(s + i));
+        int index = _mm_cmpestri(set, ndelimiters, block, 16,
+                                 _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_LEAST_SIGNIFICANT);
+        if (index < 16) {
+            return i + index;
+        }
+    }
+
+    /* Scan the last partial block in one go if that cannot fault */
+    if (i < n && SCAN_SAFE(s + i, 16)) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(s + i));
+        int index = _mm_cmpestri(set, ndelimiters, block, n - i,
+                                 _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_LEAST_SIGNIFICANT);
+        return index < 16 ? i + index : n;
+    }
+    return i + scan_scalar(s + i, n - i, delimiters, ndelimiters);
+}
+
+/**
+ * Scan 32 bytes at a time, comparing each block against every delimiter.
+ **/
+__attribute__((target("avx2")))
+static size_t
+scan_avx2(const char *s, size_t n, const char *delimiters, size_t ndelimiters)
+{
+    __m256i set[SCAN_DELIMITERS];
+    size_t i = 0;
+
+    for (size_t d = 0; d < ndelimiters; d++) {
+        set[d] = _mm256_set1_epi8(delimiters[d]);
+    }
+
+    for (; i < n; i += 32) {
+        unsigned int valid = ~0u;
+
+        /* Only scan the last partial block in one go if that cannot fault,
+         * ignoring matches past the end */
+        if (n - i < 32) {
+            if (!SCAN_SAFE(s + i, 32)) {
+                break;
+            }
+            valid = (1u << (n - i)) - 1;
+        }
+
+        __m256i block = _mm256_loadu_si256((const __m256i *)(s + i));
+        __m256i match = _mm256_cmpeq_epi8(block, set[0]);
+        for (size_t d = 1; d < ndelimiters; d++) {
+            match = _mm256_or_si256(match, _mm256_cmpeq_epi8(block, set[d]));
+        }
+        unsigned int mask = _mm256_movemask_epi8(match) & valid;
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i < n ? i + scan_scalar(s + i, n - i, delimiters, ndelimiters) : n;
+}
+#endif
+
+/**
+ * Select the best implementation for this CPU, then scan with it.
+ **/
+static size_t
+scan_resolve(const char *s, size_t n, const char *delimiters, size_t ndelimiters)
+{
+    scan_function function = scan_scalar;
+
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        function = scan_avx2;
+    } else if (__builtin_cpu_supports("sse4.2")) {
+        function = scan_sse42;
+    }
+#endif
+
+    __atomic_store_n(&ScanFunction, function, __ATOMIC_RELAXED);
+    return function(s, n, delimiters, ndelimiters);
+}
+
+/**
+ * Return offset of the first of the n bytes at s that is one of the
+ * delimiters (a string of at most 16 characters), or n if there is none.
+ *
+ * This is used by the request parser to find line ends, header colons,
+ * spaces, and query marks.  Blocks of 32 (AVX2) or 16 (SSE4.2) bytes are
+ * scanned at once where the CPU supports it, chosen on first use; all
+ * implementations return the same result.
+ **/
+size_t
+scan_delimiter(const char *s, size_t n, const char *delimiters)
+{
+    size_t ndelimiters = strlen(delimiters);
+
+    if (ndelimiters > SCAN_DELIMITERS) {
+        return scan_scalar(s, n, delimiters, ndelimiters);
+    }
+    if (ndelimiters == 0) {
+        return n;
+    }
+    return __atomic_load_n(&ScanFunction, __ATOMIC_RELAXED)(s, n, delimiters, ndelimiters);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
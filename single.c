@@ -7,7 +7,7 @@
 #include <unistd.h>
 
 /**
- * Handle one HTTP request at a time
+ * Handle one HTTP connection at a time
  **/
 void
 single_server(int sfd)
@@ -25,8 +25,8 @@ single_server(int sfd)
             break;
         }
 
-	/* Handle request */
-        handle_request(request);
+	/* Handle requests on connection */
+        handle_connection(request);
 
 	/* Free request */
         free_request(request);
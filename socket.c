@@ -13,9 +13,17 @@
 
 /**
  * Allocate socket, bind it, and listen to specified port.
+ *
+ * The socket is close-on-exec, so scripts never inherit it.
+ *
+ * SO_REUSEADDR is always enabled, so a restarted server can bind the port
+ * while connections from its predecessor are in TIME_WAIT.  If reuseport is
+ * set, SO_REUSEPORT is enabled so several sockets (one per worker process)
+ * can listen on the same port, with the kernel distributing incoming
+ * connections between them.
  **/
 int
-socket_listen(const char *port)
+socket_listen(const char *port, bool reuseport)
 {
     struct addrinfo  hints;
     struct addrinfo *results;
@@ -34,10 +42,25 @@ socket_listen(const char *port)
     /* For each server entry, allocate socket and try to connect */
     for (struct addrinfo *p = results; p != NULL && socket_fd < 0; p = p->ai_next) {
 	/* Allocate socket */
-        socket_fd = socket(p->ai_family,p->ai_socktype, p->ai_protocol);
+        socket_fd = socket(p->ai_family, p->ai_socktype | SOCK_CLOEXEC, p->ai_protocol);
         if (socket_fd<0)
             continue;
 
+	/* Rebind right away even if connections from an earlier server
+	 * linger in TIME_WAIT */
+        if (setsockopt(socket_fd, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int)) < 0) {
+            close(socket_fd);
+            socket_fd = -1;
+            continue;
+        }
+
+	/* Share port with other workers */
+        if (reuseport && setsockopt(socket_fd, SOL_SOCKET, SO_REUSEPORT, &(int){1}, sizeof(int)) < 0) {
+            close(socket_fd);
+            socket_fd = -1;
+            continue;
+        }
+
 	/* Bind socket */
         if (bind(socket_fd, p->ai_addr, p->ai_addrlen) < 0) {
             close(socket_fd);
@@ -0,0 +1,29 @@
+#!/bin/bash
+#
+# body.sh: Request bodies reach the script whichever way they are framed,
+# bodies over the limit (-b) are refused or cut off, and ambiguous framing is rejected.
+
+. "$(dirname "$0")/harness.sh"
+
+checks() {
+    local url=$1
+
+    head -c 100000 /dev/urandom > $TMP/body
+    check "chunked upload"        grep -q "Received 100000 bytes" <(curl -s -H 'Transfer-Encoding: chunked' --data-binary @$TMP/body $url/scripts/upload.sh)
+    check "Content-Length upload" grep -q "Received 100000 bytes" <(curl -s --data-binary @$TMP/body $url/scripts/upload.sh)
+    check "CONTENT_LENGTH"        grep -q "^CONTENT_LENGTH=100000" <(curl -s --data-binary @$TMP/body $url/scripts/upload.sh)
+
+    head -c 300000 /dev/urandom > $TMP/large
+    check "body over limit"         test "$(status --data-binary @$TMP/large $url/scripts/upload.sh)" = 413
+    # A chunked body's size is only known as it arrives, so once it passes
+    # the limit the connection is dropped
+    check "chunked body over limit" test -z "$(curl -s -H 'Transfer-Encoding: chunked' --data-binary @$TMP/large $url/scripts/upload.sh | grep 'Received 300000')"
+
+    raw "POST /scripts/upload.sh HTTP/1.1\r\nHost: x\r\nContent-Length: 5\r\nTransfer-Encoding: chunked\r\n\r\n0\r\n\r\n" > $TMP/framing
+    check "ambiguous framing" grep -q '^HTTP/1.1 400' $TMP/framing
+}
+
+serve_modes checks -b 200K
+finish
+
+# vim: set expandtab sts=4 sw=4 ts=8 ft=sh:
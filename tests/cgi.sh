@@ -0,0 +1,38 @@
+#!/bin/bash
+#
+# cgi.sh: Scripts run with their CGI environment, and their output (head
+# and body) becomes the response.
+
+. "$(dirname "$0")/harness.sh"
+
+checks() {
+    local url=$1
+
+    curl -s -H 'X-Test: yes' "$url/scripts/env.sh?a=b" > $TMP/env
+    check "CGI"            grep -q "^REQUEST_METHOD=GET" $TMP/env
+    check "QUERY_STRING"   grep -q "^QUERY_STRING=a=b" $TMP/env
+    check "HTTP_* headers" grep -q "^HTTP_X_TEST=yes" $TMP/env
+    check "script head"    grep -qi '^Content-type: text/plain' <(curl -s -D - -o /dev/null $url/scripts/env.sh)
+
+    # Scripts inherit no server descriptors (listening socket, connections,
+    # epoll or io_uring instance) besides their standard input and output
+    curl -s $url/scripts/fds.sh > $TMP/fds
+    check "descriptors"    test "$(grep -c '^0 -> /dev/null$' $TMP/fds)-$(grep -c 'socket:\|anon_inode:' $TMP/fds)" = "1-0"
+
+    # Scripts silent for longer than the idle timeout (-k 2) still answer
+    check "slow script"    test "$(curl -s -m 10 $url/scripts/slow.sh)" = done
+
+    # Several scripts at once all finish
+    local pids=()
+    for i in 1 2 3 4; do
+        curl -s $url/scripts/env.sh > $TMP/env.$i &
+        pids+=($!)
+    done
+    wait ${pids[@]}
+    check "concurrent scripts" test "$(cat $TMP/env.[1-4] | grep -c '^REQUEST_METHOD=GET')" = 4
+}
+
+serve_modes checks
+finish
+
+# vim: set expandtab sts=4 sw=4 ts=8 ft=sh:
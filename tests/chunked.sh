@@ -0,0 +1,33 @@
+#!/bin/bash
+#
+# chunked.sh: Script output and listing pages go out with chunked transfer
+# coding under HTTP/1.1 (so the connection stays open), and HTTP/1.0
+# clients get them framed without it.
+
+. "$(dirname "$0")/harness.sh"
+
+checks() {
+    local url=$1
+
+    curl -s -D $TMP/head $url/scripts/env.sh > $TMP/env
+    check "chunked script output" grep -qi '^Transfer-Encoding: chunked' $TMP/head
+    check "decoded script output" grep -q '^REQUEST_METHOD=GET' $TMP/env
+
+    # The request after chunked script output is framed right
+    raw "GET /scripts/env.sh HTTP/1.1\r\nHost: x\r\n\r\nGET $FILE HTTP/1.1\r\nHost: x\r\nConnection: close\r\n\r\n" > $TMP/pipe
+    check "script then GET"       test "$(grep -a '^HTTP/1.1' $TMP/pipe | cut -d ' ' -f 2 | tr '\n' ' ')" = "200 200 "
+    check "GET after script"      cmp -s <(tail -c $SIZE $TMP/pipe) $ROOT$FILE
+
+    # HTTP/1.0 script output ends with the connection
+    check "HTTP/1.0 script output" test "$(curl -s -0 -D - -o /dev/null $url/scripts/env.sh | grep -ci '^Transfer-Encoding')" = 0
+
+    # Listing pages
+    check "chunked listing page"  grep -qi '^Transfer-Encoding: chunked' <(curl -s -D - -o /dev/null "$url/?offset=0")
+    check "HTTP/1.0 listing page" grep -qi '^Content-Length' <(curl -s -0 -D - -o /dev/null "$url/?offset=0")
+    check "listing page entries"  grep -q 'hackers.txt' <(curl -s "$url/text/?offset=0")
+}
+
+serve_modes checks
+finish
+
+# vim: set expandtab sts=4 sw=4 ts=8 ft=sh:
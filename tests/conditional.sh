@@ -0,0 +1,28 @@
+#!/bin/bash
+#
+# conditional.sh: Conditional GET with ETag and Last-Modified validators.
+
+. "$(dirname "$0")/harness.sh"
+
+checks() {
+    local url=$1
+    curl -sI $url$FILE | tr -d '\r' > $TMP/head
+    local etag=$(sed -n 's/^ETag: //ip' $TMP/head)
+    local modified=$(sed -n 's/^Last-Modified: //ip' $TMP/head)
+
+    check "validators"      test -n "$etag" -a -n "$modified"
+    check "If-None-Match"   test "$(status -H "If-None-Match: $etag" $url$FILE)" = 304
+    check "If-None-Match (changed)" test "$(status -H 'If-None-Match: "other"' $url$FILE)" = 200
+    check "If-None-Match *" test "$(status -H 'If-None-Match: *' $url$FILE)" = 304
+    check "If-Modified-Since" test "$(status -H "If-Modified-Since: $modified" $url$FILE)" = 304
+    check "If-Modified-Since (older)" test "$(status -H 'If-Modified-Since: Thu, 01 Jan 1970 00:00:00 GMT' $url$FILE)" = 200
+
+    # A 304 has no body, so the request after it is framed right
+    raw "GET $FILE HTTP/1.1\r\nHost: x\r\nIf-None-Match: $etag\r\n\r\nGET $FILE HTTP/1.1\r\nHost: x\r\nConnection: close\r\n\r\n" > $TMP/pipe
+    check "304 then GET"    test "$(grep -a '^HTTP/1.1' $TMP/pipe | cut -d ' ' -f 2 | tr '\n' ' ')" = "304 200 "
+}
+
+serve_modes checks
+finish
+
+# vim: set expandtab sts=4 sw=4 ts=8 ft=sh:
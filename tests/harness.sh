@@ -0,0 +1,93 @@
+# harness.sh: Helpers shared by the tests, which source it.  Each test runs
+# its checks against the server in every concurrency mode (-c):
+#
+#   . "$(dirname "$0")/harness.sh"
+#   checks() { check "name" test ...; }
+#   serve_modes checks [server flags]
+#   finish
+#
+# Tests take the port to start counting from (default 9700), and are run
+# from the top of the tree, after make.
+
+PORT=${1:-9700}
+ROOT=www
+FILE=/text/hackers.txt
+SIZE=$(wc -c < $ROOT$FILE)
+FIRST=$(head -n 1 $ROOT$FILE)
+TMP=$(mktemp -d)
+FAILURES=0
+
+trap 'rm -rf $TMP' EXIT
+
+# Report check named $1 as passed if the rest of the arguments (a command)
+# succeed
+check() {
+    local name=$1
+    shift
+    if "$@"; then
+        echo "    ok      $name"
+    else
+        echo "    FAILED  $name"
+        FAILURES=$((FAILURES + 1))
+    fi
+}
+
+# Send raw requests ($1, with escapes) on one connection, and print what
+# comes back until the server closes it.  The requests go out in one write
+# (the shell's printf writes line by line), so none of them arrive after the
+# server has answered and closed the connection.
+raw() {
+    printf "$1" > $TMP/request
+    (
+        exec 3<>/dev/tcp/127.0.0.1/$PORT || exit 1
+        cat $TMP/request >&3
+        timeout 5 cat <&3
+    )
+}
+
+# Print status code of curl request
+status() {
+    curl -s -o /dev/null -w '%{http_code}' "$@"
+}
+
+# Wait until server accepts connections
+wait_server() {
+    for i in $(seq 50); do
+        curl -s -o /dev/null http://127.0.0.1:$PORT/ && return 0
+        sleep 0.1
+    done
+    return 1
+}
+
+# Start server in each mode with the given flags (after $1), and run
+# function $1 against it with the server's URL
+serve_modes() {
+    local checks=$1
+    shift
+
+    for mode in single forking event uring threaded prefork; do
+        PORT=$((PORT + 1))
+        echo "$mode (port $PORT)"
+
+        ./httpServer -p $PORT -r $ROOT -c $mode -w 2 -k 2 "$@" 2> $TMP/$mode.log &
+        local pid=$!
+        if wait_server; then
+            $checks http://127.0.0.1:$PORT
+        else
+            echo "    FAILED  server did not start (see below)"
+            tail -n 5 $TMP/$mode.log
+            FAILURES=$((FAILURES + 1))
+        fi
+        kill $pid
+        wait $pid 2> /dev/null
+    done
+}
+
+# Report failures, and exit with whether there were any
+finish() {
+    echo "$FAILURES failure(s)"
+    [ $FAILURES -eq 0 ]
+    exit
+}
+
+# vim: set expandtab sts=4 sw=4 ts=8 ft=sh:
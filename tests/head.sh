@@ -0,0 +1,19 @@
+#!/bin/bash
+#
+# head.sh: HEAD gets the GET head without the body, so the next request on
+# a persistent connection is framed right.
+
+. "$(dirname "$0")/harness.sh"
+
+checks() {
+    raw "HEAD $FILE HTTP/1.1\r\nHost: x\r\n\r\nGET $FILE HTTP/1.1\r\nHost: x\r\nConnection: close\r\n\r\n" > $TMP/head
+    check "HEAD then GET"  test "$(grep -c '^HTTP/1.1 200' $TMP/head)-$(grep -cF "$FIRST" $TMP/head)" = "2-1"
+    check "GET after HEAD" cmp -s <(tail -c $SIZE $TMP/head) $ROOT$FILE
+    raw "HEAD /missing HTTP/1.1\r\nHost: x\r\nConnection: close\r\n\r\n" > $TMP/head
+    check "HEAD of 404"    test "$(grep -c '^HTTP/1.1 404' $TMP/head)-$(tail -c 4 $TMP/head | od -An -c | tr -d ' ')" = '1-\r\n\r\n'
+}
+
+serve_modes checks
+finish
+
+# vim: set expandtab sts=4 sw=4 ts=8 ft=sh:
@@ -0,0 +1,36 @@
+#!/bin/bash
+#
+# microcache.sh: Script responses are cached briefly (-t), per query and
+# the request headers they vary by (-V).  The cache belongs to the process
+# serving the connection, so the requests share one connection, and go to
+# a single worker, whose request count only goes up when the cache misses.
+
+. "$(dirname "$0")/harness.sh"
+
+# Print the request counts in what the worker answered
+counts() {
+    grep -a '^WORKER_REQUESTS=' | cut -d = -f 2 | tr '\n' ' '
+}
+
+checks() {
+    local get="GET /scripts/env.fcgi?a HTTP/1.1\r\nHost: x\r\n"
+
+    raw "$get\r\n$get\r\nGET /scripts/env.fcgi?b HTTP/1.1\r\nHost: x\r\n\r\n${get}Accept-Language: fr\r\nConnection: close\r\n\r\n" > $TMP/pipe
+    check "cached, per query and header" test "$(counts < $TMP/pipe)" = "1 1 2 3 "
+
+    (
+        exec 3<>/dev/tcp/127.0.0.1/$PORT || exit 1
+        printf "GET /scripts/env.fcgi?c HTTP/1.1\r\nHost: x\r\n\r\n" >&3
+        sleep 1.5
+        printf "GET /scripts/env.fcgi?c HTTP/1.1\r\nHost: x\r\nConnection: close\r\n\r\n" >&3
+        timeout 5 cat <&3
+    ) > $TMP/expiry
+    check "expired"         test "$(counts < $TMP/expiry | tr ' ' '\n' | sort -u | grep -c .)" = 2
+
+    check "body not cached" test "$(curl -s --data-binary x "$1/scripts/upload.sh" | grep -c 'Received 1 bytes')" = 1
+}
+
+serve_modes checks -t 1 -V Accept-Language -f 1
+finish
+
+# vim: set expandtab sts=4 sw=4 ts=8 ft=sh:
@@ -0,0 +1,27 @@
+#!/bin/bash
+#
+# pipeline.sh: Requests pipelined on one connection are all answered, in
+# order, with their bodies.
+
+. "$(dirname "$0")/harness.sh"
+
+checks() {
+    raw "GET $FILE HTTP/1.1\r\nHost: x\r\n\r\nGET /missing HTTP/1.1\r\nHost: x\r\n\r\nGET $FILE HTTP/1.1\r\nHost: x\r\nConnection: close\r\n\r\n" > $TMP/pipe
+    check "pipelining"       test "$(grep -a '^HTTP/1.1' $TMP/pipe | cut -d ' ' -f 2 | tr '\n' ' ')" = "200 404 200 "
+    check "pipelined bodies" test "$(grep -cF "$FIRST" $TMP/pipe)" = 2
+
+    # A request split across writes is still answered once it is complete
+    (
+        exec 3<>/dev/tcp/127.0.0.1/$PORT || exit 1
+        printf "GET $FILE HTTP/1.1\r\nHo" >&3
+        sleep 0.2
+        printf "st: x\r\nConnection: close\r\n\r\n" >&3
+        timeout 5 cat <&3
+    ) > $TMP/split
+    check "split request"    cmp -s <(tail -c $SIZE $TMP/split) $ROOT$FILE
+}
+
+serve_modes checks
+finish
+
+# vim: set expandtab sts=4 sw=4 ts=8 ft=sh:
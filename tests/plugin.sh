@@ -0,0 +1,30 @@
+#!/bin/bash
+#
+# plugin.sh: URIs under a plugin's prefix (-P) are handled by the plugin
+# (plugins/env.so), in process.
+
+. "$(dirname "$0")/harness.sh"
+
+checks() {
+    local url=$1
+
+    curl -s -H 'X-Test: yes' "$url/env/a?b" > $TMP/env
+    check "plugin"         grep -q '^PLUGIN_REQUESTS=' $TMP/env
+    check "PATH_INFO"      grep -q '^PATH_INFO=/a$' $TMP/env
+    check "QUERY_STRING"   grep -q '^QUERY_STRING=b$' $TMP/env
+    check "headers"        grep -q '^HTTP_X_TEST=yes$' $TMP/env
+    check "prefix itself"  test "$(status $url/env)" = 200
+    check "whole segments" test "$(status $url/envx)" = 404
+
+    raw "HEAD /env/a HTTP/1.1\r\nHost: x\r\n\r\nGET /env/a HTTP/1.1\r\nHost: x\r\nConnection: close\r\n\r\n" > $TMP/pipe
+    check "HEAD then GET"  test "$(grep -ac '^HTTP/1.1 200' $TMP/pipe)-$(grep -ac '^PLUGIN_REQUESTS=' $TMP/pipe)" = "2-1"
+
+    # Plugins take no body, so it is discarded, and the request handled
+    raw "POST /env/a HTTP/1.1\r\nHost: x\r\nContent-Length: 5\r\n\r\nhelloGET /env/b HTTP/1.1\r\nHost: x\r\nConnection: close\r\n\r\n" > $TMP/pipe
+    check "body discarded" test "$(grep -a '^PATH_INFO=' $TMP/pipe | tr '\n' ' ')" = "PATH_INFO=/a PATH_INFO=/b "
+}
+
+serve_modes checks -P /env=plugins/env.so
+finish
+
+# vim: set expandtab sts=4 sw=4 ts=8 ft=sh:
@@ -0,0 +1,24 @@
+#!/bin/bash
+#
+# range.sh: Byte ranges are served with 206 Partial Content.
+
+. "$(dirname "$0")/harness.sh"
+
+checks() {
+    local url=$1
+
+    check "Range"          test "$(curl -s -r 0-9 -w ' %{http_code}' $url$FILE)" = "$(head -c 10 $ROOT$FILE) 206"
+    check "open Range"     test "$(curl -s -r 10- $url$FILE | cmp - <(tail -c +11 $ROOT$FILE) && echo same)" = same
+    check "suffix Range"   test "$(curl -s -r -10 $url$FILE | cmp - <(tail -c 10 $ROOT$FILE) && echo same)" = same
+    check "Content-Range"  grep -qi "^Content-Range: bytes 0-9/$SIZE" <(curl -s -D - -o /dev/null -r 0-9 $url$FILE)
+    check "several Ranges" grep -qi '^Content-Type: multipart/byteranges' <(curl -s -D - -o /dev/null -r 0-9,20-29 $url$FILE)
+    check "Range past end" test "$(status -r $((SIZE + 10))- $url$FILE)" = 416
+
+    # If-Range with a stale validator gets the whole file
+    check "If-Range"       test "$(status -r 0-9 -H "If-Range: \"other\"" $url$FILE)" = 200
+}
+
+serve_modes checks
+finish
+
+# vim: set expandtab sts=4 sw=4 ts=8 ft=sh:
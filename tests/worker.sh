@@ -0,0 +1,40 @@
+#!/bin/bash
+#
+# worker.sh: Scripts named *.fcgi are served by persistent workers, which
+# requests queue for while busy, and which are replaced when they die.
+
+. "$(dirname "$0")/harness.sh"
+
+checks() {
+    local url=$1
+
+    # Both requests on a connection go to the one worker
+    raw "GET /scripts/env.fcgi HTTP/1.1\r\nHost: x\r\n\r\nGET /scripts/env.fcgi HTTP/1.1\r\nHost: x\r\nConnection: close\r\n\r\n" > $TMP/pipe
+    check "worker"         test "$(grep -c '^WORKER_PID=' $TMP/pipe)" = 2
+    check "persistent"     test "$(grep '^WORKER_PID=' $TMP/pipe | sort -u | wc -l)-$(grep '^WORKER_REQUESTS=' $TMP/pipe | tr '\n' ' ')" = "1-WORKER_REQUESTS=1 WORKER_REQUESTS=2 "
+
+    # Workers take no body, so it is discarded, and the request handled
+    raw "POST /scripts/env.fcgi HTTP/1.1\r\nHost: x\r\nTransfer-Encoding: chunked\r\n\r\n3\r\nabc\r\n0\r\n\r\nGET /scripts/env.fcgi HTTP/1.1\r\nHost: x\r\nConnection: close\r\n\r\n" > $TMP/pipe
+    check "body discarded" test "$(grep -a '^REQUEST_METHOD=' $TMP/pipe | tr '\n' ' ')" = "REQUEST_METHOD=POST REQUEST_METHOD=GET "
+
+    # Requests queue while the worker is busy
+    local pids=()
+    for i in 1 2 3 4; do
+        curl -s $url/scripts/env.fcgi > $TMP/env.$i &
+        pids+=($!)
+    done
+    wait ${pids[@]}
+    check "queued requests" test "$(cat $TMP/env.[1-4] | grep -c '^WORKER_PID=')" = 4
+
+    # A worker that dies is replaced
+    local pid=$(curl -s $url/scripts/env.fcgi | sed -n 's/^WORKER_PID=//p')
+    sleep 1.2
+    kill -9 $pid
+    sleep 0.2
+    check "respawned"      test "$(curl -s $url/scripts/env.fcgi | sed -n 's/^WORKER_PID=//p' | grep -v "^$pid\$")" != ""
+}
+
+serve_modes checks -f 1
+finish
+
+# vim: set expandtab sts=4 sw=4 ts=8 ft=sh:
@@ -0,0 +1,229 @@
+/* threaded.c: Thread Pool HTTP Server */
+
+#include "mainServer.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+
+#include <unistd.h>
+
+#define THREAD_QUEUE_SIZE   64      /* Accepted connections queued per worker */
+
+/**
+ * Bounded queue of accepted connections owned by one worker thread.
+ **/
+struct thread_queue {
+    pthread_t        thread;
+    pthread_mutex_t  lock;          /* Protects queue, head, and count */
+    struct request  *queue[THREAD_QUEUE_SIZE];
+    size_t           head;          /* Index of oldest queued request */
+    size_t           count;         /* Number of queued requests */
+};
+
+/**
+ * Pool of worker threads.
+ *
+ * The acceptor distributes connections round-robin over the worker queues;
+ * a worker whose own queue is empty steals from the others before going to
+ * sleep.  pending counts queued connections across all workers and bounds
+ * the pool to capacity, blocking the acceptor when every queue is full; it
+ * changes together with a queue, under that queue's lock, so it never
+ * counts a connection that is not queued (or drops below zero).
+ **/
+struct pool {
+    struct thread_queue *queues;
+    size_t           nworkers;
+    size_t           capacity;
+    size_t           pending;       /* Updated atomically, under a queue lock */
+    pthread_mutex_t  lock;          /* Protects sleeping on conditions */
+    pthread_cond_t   nonempty;      /* Signalled when work is queued */
+    pthread_cond_t   nonfull;       /* Signalled when a full pool drains */
+};
+
+/**
+ * Push request onto worker queue and count it in pending, returning false
+ * if the queue is full.
+ **/
+static bool
+thread_push(struct thread_queue *q, struct request *r, size_t *pending)
+{
+    bool pushed = false;
+
+    pthread_mutex_lock(&q->lock);
+    if (q->count < THREAD_QUEUE_SIZE) {
+        q->queue[(q->head + q->count) % THREAD_QUEUE_SIZE] = r;
+        q->count++;
+        __atomic_fetch_add(pending, 1, __ATOMIC_SEQ_CST);
+        pushed = true;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return pushed;
+}
+
+/**
+ * Pop oldest request from worker queue and uncount it from pending (whose
+ * previous value is stored in was), returning NULL if the queue is empty.
+ **/
+static struct request *
+thread_pop(struct thread_queue *q, size_t *pending, size_t *was)
+{
+    struct request *r = NULL;
+
+    pthread_mutex_lock(&q->lock);
+    if (q->count > 0) {
+        r = q->queue[q->head];
+        q->head = (q->head + 1) % THREAD_QUEUE_SIZE;
+        q->count--;
+        *was = __atomic_fetch_sub(pending, 1, __ATOMIC_SEQ_CST);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return r;
+}
+
+/**
+ * Take next request for worker: first from its own queue, then by stealing
+ * from the other workers.  Sleeps while the whole pool is empty.
+ **/
+static struct request *
+pool_take(struct pool *p, size_t self)
+{
+    struct request *r;
+    size_t was;
+
+    while (true) {
+        for (size_t i = 0; i < p->nworkers; i++) {
+            r = thread_pop(&p->queues[(self + i) % p->nworkers], &p->pending, &was);
+            if (r) {
+                if (was == p->capacity) {
+                    pthread_mutex_lock(&p->lock);
+                    pthread_cond_signal(&p->nonfull);
+                    pthread_mutex_unlock(&p->lock);
+                }
+                return r;
+            }
+        }
+
+        pthread_mutex_lock(&p->lock);
+        while (__atomic_load_n(&p->pending, __ATOMIC_SEQ_CST) == 0) {
+            pthread_cond_wait(&p->nonempty, &p->lock);
+        }
+        pthread_mutex_unlock(&p->lock);
+    }
+}
+
+/**
+ * Queue request on the next worker with room, blocking while the pool is full.
+ **/
+static void
+pool_put(struct pool *p, struct request *r, size_t *next)
+{
+    pthread_mutex_lock(&p->lock);
+    while (__atomic_load_n(&p->pending, __ATOMIC_SEQ_CST) >= p->capacity) {
+        pthread_cond_wait(&p->nonfull, &p->lock);
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    /* Only the acceptor adds work, so some queue must have room */
+    while (!thread_push(&p->queues[*next], r, &p->pending)) {
+        *next = (*next + 1) % p->nworkers;
+    }
+    *next = (*next + 1) % p->nworkers;
+
+    pthread_mutex_lock(&p->lock);
+    pthread_cond_signal(&p->nonempty);
+    pthread_mutex_unlock(&p->lock);
+}
+
+/**
+ * Worker thread arguments.
+ **/
+struct thread_args {
+    struct pool *pool;
+    size_t       self;
+};
+
+/**
+ * Worker thread: handle queued connections forever.
+ **/
+static void *
+thread_main(void *arg)
+{
+    struct thread_args *args = arg;
+    struct request *request;
+
+    while (true) {
+        request = pool_take(args->pool, args->self);
+
+        /* Handle requests on connection */
+        handle_connection(request);
+
+        /* Free request */
+        free_request(request);
+    }
+
+    return NULL;
+}
+
+/**
+ * Handle HTTP requests with a fixed pool of worker threads.
+ *
+ * The main thread accepts connections and queues them on the workers (see
+ * struct pool).  The pool has Workers threads, defaulting to four per CPU
+ * since requests are handled with blocking I/O.
+ **/
+void
+threaded_server(int sfd)
+{
+    struct request *request;
+    struct pool pool;
+    struct thread_args *args;
+    size_t next = 0;
+
+    /* Initialize pool */
+    memset(&pool, 0, sizeof(pool));
+    pool.nworkers = Workers > 0 ? Workers : 4 * sysconf(_SC_NPROCESSORS_ONLN);
+    pool.capacity = pool.nworkers * THREAD_QUEUE_SIZE;
+    pool.queues   = calloc(pool.nworkers, sizeof(struct thread_queue));
+    args          = calloc(pool.nworkers, sizeof(struct thread_args));
+    if (!pool.queues || !args) {
+        fatal("Unable to allocate thread pool: %s", strerror(errno));
+    }
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.nonempty, NULL);
+    pthread_cond_init(&pool.nonfull, NULL);
+
+    /* Start worker threads */
+    for (size_t i = 0; i < pool.nworkers; i++) {
+        pthread_mutex_init(&pool.queues[i].lock, NULL);
+        args[i].pool = &pool;
+        args[i].self = i;
+        int status = pthread_create(&pool.queues[i].thread, NULL, thread_main, &args[i]);
+        if (status != 0) {
+            fatal("Unable to create worker thread: %s", strerror(status));
+        }
+        pthread_detach(pool.queues[i].thread);
+    }
+
+    debug("Started %zu worker threads", pool.nworkers);
+
+    /* Accept and queue HTTP requests */
+    while (true) {
+    	/* Accept request */
+        request = accept_request(sfd);
+        if (!request) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+
+        /* Queue request for workers */
+        pool_put(&pool, request, &next);
+    }
+
+    /* Close server socket and exit */
+    close(sfd);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,814 @@
+/* uring.c: io_uring HTTP Server */
+
+#include "mainServer.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define URING_ENTRIES   256     /* Submission queue size */
+#define URING_COPY      (8*BUFSIZ)  /* Chunk size when body ranges are copied */
+
+/**
+ * Operations, kept in the low bits of each submission's user data (the
+ * rest is the connection it belongs to, if any, which malloc aligns to at
+ * least 16 bytes).
+ **/
+enum uring_op {
+    URING_ACCEPT,       /* Accept connections (multishot) */
+    URING_TIMEOUT,      /* Tick that expires idle connections */
+    URING_RECV,         /* Read into request buffer */
+    URING_SEND,         /* Write response stream or copied body chunk */
+    URING_SPLICE_IN,    /* Move body range chunk from file into pipe... */
+    URING_SPLICE_OUT,   /* ...and from there into socket (linked) */
+    URING_POLL,         /* Wait for output from response pipe */
+    URING_POLL_REMOVE,  /* Cancel wait for pipe output or request body */
+    URING_RELAY,        /* Splice output from response pipe into socket */
+    URING_POLL_BODY,    /* Wait for request body, room in input pipe, cached response, or worker */
+};
+
+#define URING_OP_MASK   15
+
+/**
+ * Mapped submission and completion rings.
+ **/
+struct uring {
+    int                  fd;
+    unsigned             entries;
+    unsigned             tail;          /* Local submission queue tail */
+    unsigned            *sq_head;
+    unsigned            *sq_tail;
+    unsigned            *sq_mask;
+    unsigned            *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned            *cq_head;
+    unsigned            *cq_tail;
+    unsigned            *cq_mask;
+    struct io_uring_cqe *cqes;
+};
+
+/**
+ * Connection: request plus the state of its outstanding operations.
+ **/
+struct uring_conn {
+    struct request *r;
+    int             pipe[2];        /* Relay for spliced body ranges (or -1) */
+    size_t          npipe;          /* Pipe capacity */
+    size_t          piped;          /* Bytes waiting in pipe */
+    char           *copy;           /* Buffer for copied body ranges (or NULL) */
+    bool            nosplice;       /* Whether body file cannot be spliced */
+    bool            copying;        /* Whether the send in flight is a copied chunk */
+    bool            polling;        /* Whether a poll on the response pipe is in flight */
+    bool            polling_body;   /* Whether a poll for the request body is in flight */
+    int             inflight;       /* Operations not completed yet */
+    bool            closing;        /* Close once inflight operations complete */
+    time_t          active;         /* Time of last completion */
+
+    struct uring_conn *prev;        /* Idle list (least recently active first) */
+    struct uring_conn *next;
+};
+
+/* Connections ordered by last activity (owned by the server loop) */
+
+static struct uring_conn *IdleHead  = NULL;
+static struct uring_conn *IdleTail  = NULL;
+static bool               Multishot = true;    /* Whether accept may be multishot */
+
+/**
+ * Enter ring: submit all prepared submissions, and wait for at least
+ * min_complete completions.
+ **/
+static int
+uring_enter(struct uring *u, unsigned min_complete)
+{
+    unsigned nsubmit;
+    int status;
+
+    __atomic_store_n(u->sq_tail, u->tail, __ATOMIC_RELEASE);
+    nsubmit = u->tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+
+    status = syscall(__NR_io_uring_enter, u->fd, nsubmit, min_complete,
+                     min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    return status < 0 ? -errno : status;
+}
+
+/**
+ * Return next free submission queue entry (zeroed), submitting what is
+ * queued first if the queue is full.
+ **/
+static struct io_uring_sqe *
+uring_sqe(struct uring *u, struct uring_conn *c, enum uring_op op)
+{
+    while (u->tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->entries) {
+        uring_enter(u, 0);
+    }
+
+    unsigned index = u->tail & *u->sq_mask;
+    struct io_uring_sqe *sqe = &u->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = (uintptr_t)c | op;
+    u->sq_array[index] = index;
+    u->tail++;
+
+    if (c) {
+        c->inflight++;
+    }
+    return sqe;
+}
+
+/**
+ * Return whether the kernel supports every operation the server uses.
+ **/
+static bool
+uring_probe(struct uring *u)
+{
+    static const int needed[] = {IORING_OP_ACCEPT, IORING_OP_TIMEOUT, IORING_OP_RECV,
+                                 IORING_OP_SEND, IORING_OP_SPLICE, IORING_OP_POLL_ADD,
+                                 IORING_OP_POLL_REMOVE};
+    size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, size);
+    bool supported = probe != NULL;
+
+    if (probe && syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PROBE, probe, 256) < 0) {
+        supported = false;
+    }
+    for (size_t i = 0; supported && i < sizeof(needed) / sizeof(needed[0]); i++) {
+        supported = needed[i] <= probe->last_op && (probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+    return supported;
+}
+
+/**
+ * Set up ring and map its queues.
+ *
+ * Returns 0 on success, and -1 if io_uring is unavailable (or lacks needed
+ * operations), with errno set.
+ **/
+static int
+uring_setup(struct uring *u)
+{
+    struct io_uring_params p;
+    void *sq, *cq;
+
+    memset(&p, 0, sizeof(p));
+    u->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (u->fd < 0) {
+        return -1;
+    }
+    fcntl(u->fd, F_SETFD, FD_CLOEXEC);     /* Not settable at setup */
+    if (!(p.features & IORING_FEAT_NODROP) || !uring_probe(u)) {
+        close(u->fd);
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+
+    size_t nsq = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t ncq = p.cq_off.cqes  + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        nsq = ncq = nsq > ncq ? nsq : ncq;
+    }
+
+    sq = mmap(NULL, nsq, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) {
+        close(u->fd);
+        return -1;
+    }
+    cq = sq;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        cq = mmap(NULL, ncq, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED) {
+            close(u->fd);
+            return -1;
+        }
+    }
+    u->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) {
+        close(u->fd);
+        return -1;
+    }
+
+    u->entries  = p.sq_entries;
+    u->sq_head  = (unsigned *)((char *)sq + p.sq_off.head);
+    u->sq_tail  = (unsigned *)((char *)sq + p.sq_off.tail);
+    u->sq_mask  = (unsigned *)((char *)sq + p.sq_off.ring_mask);
+    u->sq_array = (unsigned *)((char *)sq + p.sq_off.array);
+    u->cq_head  = (unsigned *)((char *)cq + p.cq_off.head);
+    u->cq_tail  = (unsigned *)((char *)cq + p.cq_off.tail);
+    u->cq_mask  = (unsigned *)((char *)cq + p.cq_off.ring_mask);
+    u->cqes     = (struct io_uring_cqe *)((char *)cq + p.cq_off.cqes);
+    u->tail     = *u->sq_tail;
+    return 0;
+}
+
+/**
+ * Remove connection from idle list (if it is on it).
+ **/
+static void
+uring_idle_remove(struct uring_conn *c)
+{
+    if (!c->prev && !c->next && IdleHead != c) {
+        return;
+    }
+    if (c->prev) c->prev->next = c->next; else IdleHead = c->next;
+    if (c->next) c->next->prev = c->prev; else IdleTail = c->prev;
+    c->prev = c->next = NULL;
+}
+
+/**
+ * Mark connection as active now by moving it to the end of the idle list.
+ **/
+static void
+uring_idle_touch(struct uring_conn *c, time_t now)
+{
+    if (IdleTail != c) {
+        uring_idle_remove(c);
+        c->prev = IdleTail;
+        c->next = NULL;
+        if (IdleTail) IdleTail->next = c; else IdleHead = c;
+        IdleTail = c;
+    }
+    c->active = now;
+}
+
+/**
+ * Submit cancellation of connection's poll (URING_POLL or URING_POLL_BODY),
+ * if it is in flight.
+ **/
+static void
+uring_poll_remove(struct uring *u, struct uring_conn *c, enum uring_op op)
+{
+    bool *polling = op == URING_POLL ? &c->polling : &c->polling_body;
+
+    if (*polling) {
+        struct io_uring_sqe *sqe = uring_sqe(u, NULL, URING_POLL_REMOVE);
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->addr   = (uintptr_t)c | op;
+        *polling    = false;
+    }
+}
+
+/**
+ * Close connection, or if operations are still in flight, shut its socket
+ * down and cancel any wait for its script (which completes them) and close
+ * it once they are done.
+ **/
+static void
+uring_close(struct uring *u, struct uring_conn *c)
+{
+    if (!c->closing) {
+        c->closing = true;
+        uring_idle_remove(c);
+    }
+    if (c->inflight > 0) {
+        shutdown(c->r->fd, SHUT_RDWR);
+        uring_poll_remove(u, c, URING_POLL);
+        uring_poll_remove(u, c, URING_POLL_BODY);
+        return;
+    }
+
+    if (c->pipe[0] >= 0) {
+        close(c->pipe[0]);
+        close(c->pipe[1]);
+    }
+    free(c->copy);
+    free_request(c->r);
+    free(c);
+}
+
+/**
+ * Submit accept on server socket, multishot if the kernel supports it.
+ **/
+static void
+uring_accept(struct uring *u, int sfd)
+{
+    struct io_uring_sqe *sqe = uring_sqe(u, NULL, URING_ACCEPT);
+
+    sqe->opcode       = IORING_OP_ACCEPT;
+    sqe->fd           = sfd;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->ioprio       = Multishot ? IORING_ACCEPT_MULTISHOT : 0;
+}
+
+/**
+ * Submit tick after which idle connections are expired.
+ **/
+static void
+uring_timeout(struct uring *u)
+{
+    static struct __kernel_timespec tick = {.tv_sec = 1};
+    struct io_uring_sqe *sqe = uring_sqe(u, NULL, URING_TIMEOUT);
+
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr   = (uintptr_t)&tick;
+    sqe->len    = 1;
+}
+
+/**
+ * Submit read of more request data straight into the request buffer.
+ *
+ * Returns -1 if the request buffer is full.
+ **/
+static int
+uring_recv(struct uring *u, struct uring_conn *c)
+{
+    size_t nspace;
+    char  *space = request_space(c->r, &nspace);
+
+    if (nspace == 0) {
+        return -1;
+    }
+
+    struct io_uring_sqe *sqe = uring_sqe(u, c, URING_RECV);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd     = c->r->fd;
+    sqe->addr   = (uintptr_t)space;
+    sqe->len    = nspace;
+    return 0;
+}
+
+/**
+ * Submit send of bytes to socket, with MSG_MORE if more response data
+ * follows them.
+ **/
+static void
+uring_send(struct uring *u, struct uring_conn *c, const char *data, size_t length, bool more)
+{
+    struct io_uring_sqe *sqe = uring_sqe(u, c, URING_SEND);
+
+    sqe->opcode    = IORING_OP_SEND;
+    sqe->fd        = c->r->fd;
+    sqe->addr      = (uintptr_t)data;
+    sqe->len       = length;
+    sqe->msg_flags = more ? MSG_NOSIGNAL | MSG_MORE : MSG_NOSIGNAL;
+}
+
+/**
+ * Submit waits for the connection's script: for output from its response
+ * pipe, and for room in its input pipe or more of the request body (or for
+ * another request's run of the script; see request_waits).  Once either
+ * completes, the other is cancelled.
+ *
+ * Unless the client's socket is among the waits, the connection is waiting
+ * on the server's side (a script, worker, or micro-cache entry), not on the
+ * client, so it is taken off the idle list until the next completion and is
+ * not expired however long that takes.
+ **/
+static void
+uring_poll(struct uring *u, struct uring_conn *c)
+{
+    struct pollfd waits[2];
+    size_t n = request_waits(c->r, waits);
+    bool client = false;
+
+    for (size_t i = 0; i < n; i++) {
+        enum uring_op op = waits[i].fd == c->r->pipe_fd ? URING_POLL : URING_POLL_BODY;
+        struct io_uring_sqe *sqe = uring_sqe(u, c, op);
+
+        client |= waits[i].fd == c->r->fd;
+        sqe->opcode        = IORING_OP_POLL_ADD;
+        sqe->fd            = waits[i].fd;
+        sqe->poll32_events = waits[i].events;
+        if (op == URING_POLL) {
+            c->polling = true;
+        } else {
+            c->polling_body = true;
+        }
+    }
+    if (!client) {
+        uring_idle_remove(c);
+    }
+}
+
+/**
+ * Submit splice of bytes between descriptors (an offset of -1 means the
+ * descriptor's own position, as pipes and sockets need).
+ **/
+static struct io_uring_sqe *
+uring_splice(struct uring *u, struct uring_conn *c, enum uring_op op,
+             int in, int64_t offset, int out, size_t length, unsigned flags)
+{
+    struct io_uring_sqe *sqe = uring_sqe(u, c, op);
+
+    sqe->opcode        = IORING_OP_SPLICE;
+    sqe->splice_fd_in  = in;
+    sqe->splice_off_in = offset;
+    sqe->fd            = out;
+    sqe->off           = (uint64_t)-1;
+    sqe->len           = length;
+    sqe->splice_flags  = flags;
+    return sqe;
+}
+
+/**
+ * Submit next step of sending body range.
+ *
+ * Ranges are spliced from the file into the connection's pipe and, linked
+ * to that, from the pipe into the socket, so the pair goes through the ring
+ * as one submission and the data never enters user space.  Bytes left in
+ * the pipe by a short send are sent on their own first.  If splicing is
+ * disabled (-s copy) or unsupported for the file, chunks are read with
+ * pread(2) and sent instead.
+ *
+ * Returns -1 on error.
+ **/
+static int
+uring_body(struct uring *u, struct uring_conn *c, struct body_range *range, bool more)
+{
+    struct request *r = c->r;
+
+    if (c->piped > 0) {
+        uring_splice(u, c, URING_SPLICE_OUT, c->pipe[0], -1, r->fd, c->piped,
+                     (more || range->length > 0) ? SPLICE_F_MORE : 0);
+        return 0;
+    }
+
+    if (!SendFile || c->nosplice) {
+        if (!c->copy && !(c->copy = malloc(URING_COPY))) {
+            return -1;
+        }
+        size_t  nwant = range->length < URING_COPY ? (size_t)range->length : URING_COPY;
+        ssize_t nread = pread(r->body_fd, c->copy, nwant, range->offset);
+        if (nread <= 0) {
+            return -1;
+        }
+        uring_send(u, c, c->copy, nread, more || range->length > nread);
+        c->copying = true;
+        return 0;
+    }
+
+    if (c->pipe[0] < 0) {
+        if (pipe2(c->pipe, O_CLOEXEC) < 0) {
+            c->pipe[0] = c->pipe[1] = -1;
+            return -1;
+        }
+        int npipe = fcntl(c->pipe[0], F_GETPIPE_SZ);
+        c->npipe = npipe > 0 ? npipe : 4096;
+    }
+
+    size_t length = range->length < (off_t)c->npipe ? (size_t)range->length : c->npipe;
+    struct io_uring_sqe *sqe = uring_splice(u, c, URING_SPLICE_IN, r->body_fd, range->offset,
+                                            c->pipe[1], length, 0);
+    sqe->flags |= IOSQE_IO_LINK;
+    uring_splice(u, c, URING_SPLICE_OUT, c->pipe[0], -1, r->fd, length,
+                 (more || range->length > (off_t)length) ? SPLICE_F_MORE : 0);
+    return 0;
+}
+
+/**
+ * Advance connection state machine once its operations have completed.
+ *
+ *  REQUEST_READING: If the request head is complete, handle it plus any
+ *                   pipelined requests already buffered (which queues
+ *                   their responses); otherwise submit a read.
+ *  REQUEST_WRITING: Submit the next part of the queued response (relaying
+ *                   script output as it comes, and feeding the script the
+ *                   request body while it has none, polling for both), or
+ *                   once it is all sent, either close the connection or
+ *                   reset it for the next request.
+ *
+ * eof tells whether the last read hit end of file (or failed).
+ **/
+static void
+uring_advance(struct uring *u, struct uring_conn *c, bool eof)
+{
+    struct request *r = c->r;
+
+    while (true) {
+        if (r->state == REQUEST_READING) {
+            if (!buffered_request(r)) {
+                if (!eof && uring_recv(u, c) == 0) {
+                    return;
+                }
+                if (r->nbuffer == r->start) {
+                    uring_close(u, c);
+                    return;
+                }
+            }
+
+            /* Parse, resolve, and handle request and any pipelined behind it
+             * (errors, including incomplete heads, produce a response) */
+            handle_pipeline(r);
+            if (fflush(r->file) != 0) {
+                uring_close(u, c);
+                return;
+            }
+            r->state = REQUEST_WRITING;
+        }
+
+        struct body_range *range = r->nextrange < r->nranges ? &r->ranges[r->nextrange] : NULL;
+        size_t until = range ? range->position : r->nresponse;
+
+        /* Send buffered response up to the next body range */
+        if (r->nsent < until) {
+            uring_send(u, c, r->response + r->nsent, until - r->nsent,
+                       (range && range->length > 0) || (r->pipe_fd >= 0 && r->body == BODY_NONE));
+            return;
+        }
+
+        /* Send body range */
+        if (range && (range->length > 0 || c->piped > 0)) {
+            bool more = r->nextrange + 1 < r->nranges || range->position < r->nresponse;
+            if (uring_body(u, c, range, more) < 0) {
+                uring_close(u, c);
+            }
+            return;
+        }
+        if (range) {
+            r->nextrange++;
+            continue;
+        }
+
+        /* Handle request again once the script run or busy worker it waits
+         * for is done (see microcache_lookup and worker_start) */
+        if (r->cache_fd >= 0 || r->worker_fd >= 0) {
+            if (!(r->cache_fd >= 0 ? microcache_ready(r) : worker_ready(r))) {
+                uring_poll(u, c);
+                return;
+            }
+            handle_cgi_request(r);
+            if (fflush(r->file) != 0) {
+                uring_close(u, c);
+                return;
+            }
+            continue;
+        }
+
+        /* Answer from the worker's output once all of it is in */
+        if (r->worker) {
+            if (!handle_worker_response(r)) {
+                uring_poll(u, c);
+                return;
+            }
+            if (fflush(r->file) != 0) {
+                uring_close(u, c);
+                return;
+            }
+            continue;
+        }
+
+        /* Relay next output of pipe once everything before it is sent:
+         * what is waiting in it is spliced straight into the socket (see
+         * relay_pipe) */
+        if (r->pipe_fd >= 0) {
+            if (rewind_response(r) < 0) {
+                uring_close(u, c);
+                return;
+            }
+            ssize_t nrelay = relay_pipe(r);
+            if (nrelay > 0) {
+                uring_splice(u, c, URING_RELAY, r->pipe_fd, -1, r->fd, nrelay, SPLICE_F_MORE);
+                return;
+            }
+            if (nrelay == 0) {
+                continue;
+            }
+            if (errno != EAGAIN) {
+                uring_close(u, c);
+                return;
+            }
+        }
+
+        /* Meanwhile feed the request body to the script (or once the
+         * response is done, discard what is left of it), and poll once
+         * neither can go on */
+        if (r->body != BODY_NONE) {
+            int status = read_body(r);
+            if (status < 0) {
+                uring_close(u, c);
+                return;
+            }
+            if (status == 0) {
+                continue;
+            }
+        }
+        if (r->pipe_fd >= 0 || r->body != BODY_NONE) {
+            uring_poll(u, c);
+            return;
+        }
+
+        /* Everything sent */
+        if (rewind_response(r) < 0 || !r->keepalive) {
+            uring_close(u, c);
+            return;
+        }
+        reset_request(r);
+    }
+}
+
+/**
+ * Handle completion of connection operation.
+ **/
+static void
+uring_complete(struct uring *u, struct uring_conn *c, enum uring_op op, int res)
+{
+    struct request *r = c->r;
+    bool eof = false;
+
+    c->inflight--;
+    if (c->closing) {
+        uring_close(u, c);
+        return;
+    }
+
+    switch (op) {
+    case URING_RECV:
+        if (res > 0) {
+            request_received(r, res);
+        } else {
+            eof = true;
+        }
+        break;
+    case URING_SEND:
+        if (res <= 0) {
+            uring_close(u, c);
+            return;
+        }
+        if (c->copying) {
+            r->ranges[r->nextrange].offset += res;
+            r->ranges[r->nextrange].length -= res;
+            c->copying = false;
+        } else {
+            r->nsent += res;
+        }
+        break;
+    case URING_SPLICE_IN:
+        if (res == -EINVAL) {
+            c->nosplice = true;         /* Unsupported for this file: copy instead */
+        } else if (res <= 0) {
+            uring_close(u, c);
+            return;
+        } else {
+            r->ranges[r->nextrange].offset += res;
+            r->ranges[r->nextrange].length -= res;
+            c->piped += res;
+        }
+        break;
+    case URING_POLL:
+        c->polling = false;
+        uring_poll_remove(u, c, URING_POLL_BODY);
+        break;
+    case URING_POLL_BODY:
+        c->polling_body = false;
+        uring_poll_remove(u, c, URING_POLL);
+        break;
+    case URING_RELAY:
+        if (res == -EINVAL) {
+            r->pipe_copy = true;        /* Unsupported for this socket: copy instead */
+        } else if (res <= 0 || pipe_relayed(r, res) < 0) {
+            uring_close(u, c);
+            return;
+        }
+        break;
+    case URING_SPLICE_OUT:
+        if (res == -ECANCELED) {
+            break;                      /* Short splice in: send what was piped */
+        }
+        if (res <= 0) {
+            uring_close(u, c);
+            return;
+        }
+        c->piped -= res;
+        break;
+    default:
+        break;
+    }
+
+    if (c->inflight == 0) {
+        uring_advance(u, c, eof);
+    }
+}
+
+/**
+ * Set up accepted connection and submit its first read.
+ **/
+static void
+uring_connection(struct uring *u, int fd, time_t now)
+{
+    struct uring_conn *c;
+    struct request *r = connection_request(fd, NULL, 0);
+
+    if (!r) {
+        return;
+    }
+
+    c = calloc(1, sizeof(struct uring_conn));
+    if (!c) {
+        free_request(r);
+        return;
+    }
+    c->r       = r;
+    c->pipe[0] = c->pipe[1] = -1;
+
+    uring_idle_touch(c, now);
+    uring_advance(u, c, false);
+}
+
+/**
+ * Close connections that have been idle for KeepAliveTimeout seconds
+ * (connections waiting on their script, worker, or micro-cache entry are
+ * not on the idle list; see uring_poll).
+ **/
+static void
+uring_expire(struct uring *u, time_t now)
+{
+    while (IdleHead && now - IdleHead->active >= KeepAliveTimeout) {
+        debug("Closing idle connection from %s:%s", IdleHead->r->host, IdleHead->r->port);
+        uring_close(u, IdleHead);
+    }
+}
+
+/**
+ * Handle HTTP requests from a single process using io_uring.
+ *
+ * This works like event_server, except that instead of waiting for sockets
+ * to become ready and then reading and writing them, every connection
+ * always has one operation (or linked pair) queued in the ring, and a single
+ * io_uring_enter(2) both submits all operations prepared since the last
+ * one and waits for further completions.  Connections are accepted with
+ * one multishot accept, requests are read straight into the request buffer,
+ * body ranges are spliced from their files into the socket (see
+ * uring_body), and so is script output from its pipe.  Request bodies are
+ * fed to scripts without blocking whenever a poll reports that they can
+ * move on (see read_body).
+ *
+ * If the kernel does not support io_uring (or the operations needed), this
+ * falls back to event_server.
+ **/
+void
+uring_server(int sfd)
+{
+    struct uring u;
+    int status;
+
+    if (uring_setup(&u) < 0) {
+        log("Unable to use io_uring (%s), falling back to epoll", strerror(errno));
+        event_server(sfd);
+        return;
+    }
+
+    uring_accept(&u, sfd);
+    uring_timeout(&u);
+
+    /* Dispatch completions */
+    while (true) {
+        status = uring_enter(&u, 1);
+        if (status < 0 && status != -EINTR && status != -EBUSY && status != -EAGAIN) {
+            log("Unable to enter io_uring: %s", strerror(-status));
+            break;
+        }
+
+        time_t now = time(NULL);
+        unsigned head = *u.cq_head;
+        unsigned tail = __atomic_load_n(u.cq_tail, __ATOMIC_ACQUIRE);
+
+        for (; head != tail; head++) {
+            struct io_uring_cqe *cqe = &u.cqes[head & *u.cq_mask];
+            struct uring_conn *c = (struct uring_conn *)(uintptr_t)(cqe->user_data & ~(uint64_t)URING_OP_MASK);
+            enum uring_op op = cqe->user_data & URING_OP_MASK;
+            unsigned flags = cqe->flags;
+            int res = cqe->res;
+
+            __atomic_store_n(u.cq_head, head + 1, __ATOMIC_RELEASE);
+
+            switch (op) {
+            case URING_ACCEPT:
+                if (res >= 0) {
+                    uring_connection(&u, res, now);
+                } else if (res == -EINVAL && Multishot) {
+                    Multishot = false;
+                }
+                if (!(flags & IORING_CQE_F_MORE)) {
+                    uring_accept(&u, sfd);
+                }
+                break;
+            case URING_POLL_REMOVE:
+                break;
+            case URING_TIMEOUT:
+                uring_expire(&u, now);
+                uring_timeout(&u);
+                break;
+            default:
+                if (!c->closing) {
+                    uring_idle_touch(c, now);
+                }
+                uring_complete(&u, c, op, res);
+                break;
+            }
+        }
+    }
+
+    close(u.fd);
+    close(sfd);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
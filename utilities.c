@@ -2,94 +2,237 @@
 #include "mainServer.h"
 
 #include <ctype.h>
+#include <fcntl.h>
 #include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
 #include <string.h>
 
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
 /**
- * Determine mime-type from file extension
+ * Extension to mimetype lookup table.
  *
- * This function first finds the file's extension and then scans the contents
- * of the MimeTypesPath file to determine which mimetype the file has.
+ * Tables are immutable once published.  Lookups hold MimeTypesUse for
+ * reading, and copy what they find out of the table, so a reload can build
+ * a new table, swap it in under MimeTypesUse held for writing (preferred
+ * over readers, so lookups cannot hold it off), and free the old one right
+ * away.
+ **/
+struct mimetypes {
+    char   *data;               /* File contents, tokenized in place */
+    size_t  nslots;             /* Number of slots (power of two) */
+    struct {
+        const char *ext;        /* Lowercase extension (NULL if empty) */
+        const char *mimetype;
+    } *slots;
+};
+
+static struct mimetypes *MimeTypes        = NULL;   /* Published table */
+static pthread_mutex_t   MimeTypesLock    = PTHREAD_MUTEX_INITIALIZER;  /* Serializes loads */
+static pthread_rwlock_t  MimeTypesUse     = PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;
+static volatile sig_atomic_t MimeTypesReload = 0;
+
+/**
+ * Free lookup table.
+ **/
+static void
+mimetypes_free(struct mimetypes *m)
+{
+    if (m) {
+        free(m->slots);
+        free(m->data);
+        free(m);
+    }
+}
+
+/**
+ * Parse MimeTypesPath file into a new lookup table.
  *
  * The MimeTypesPath file (typically /etc/mime.types) consists of rules in the
  * following format:
  *
  *  <MIMETYPE>      <EXT1> <EXT2> ...
  *
- * This function simply checks the file extension version each extension for
- * each mimetype and returns the mimetype on the first match.
- *
- * If no extension exists or no matching mimetype is found, then return
- * DefaultMimeType.
- *
- * This function returns an allocated string that must be free'd.
+ * When an extension appears more than once, the first rule wins.  Returns an
+ * empty table if the file cannot be read, and NULL on allocation failure.
  **/
-char *
-determine_mimetype(const char *path)
+static struct mimetypes *
+mimetypes_parse(void)
 {
-    char *ext;
-    char *mimetype;
-    char *token;
-    char buffer[BUFSIZ];
-    FILE *fs = NULL;
-    
-    /* Find file extension */
-    ext = strrchr(path, '.');          // last '.' 
-    if (!ext || !*(ext + 1)) {
-        goto fail;                     // no extension 
-    }
-    ext++;                             // skip '.' 
+    struct mimetypes *m;
+    struct stat s;
+    size_t nexts = 0;
+    FILE *fs;
 
-    /* Open MimeTypesPath file */
-    fs = fopen(MimeTypesPath, "r");
-    if (!fs) {
-        goto fail;
+    m = calloc(1, sizeof(struct mimetypes));
+    if (!m) {
+        return NULL;
     }
 
-    /* Scan file for matching file extensions */
-    while (fgets(buffer, sizeof(buffer), fs)) {
-        char *p = buffer;
+    /* Read whole file */
+    fs = fopen(MimeTypesPath, "re");
+    if (fs && fstat(fileno(fs), &s) == 0 && (m->data = malloc(s.st_size + 1))) {
+        size_t nread = fread(m->data, 1, s.st_size, fs);
+        m->data[nread] = '\0';
+
+        /* Count extensions (upper bound: all tokens) to size table */
+        for (char *p = m->data; *p; p++) {
+            if (!isspace((unsigned char)*p) && (p == m->data || isspace((unsigned char)p[-1]))) {
+                nexts++;
+            }
+        }
+    }
+    if (fs) {
+        fclose(fs);
+    }
 
-        // skip leading whitespace 
-        while (*p && isspace((unsigned char)*p)) p++;
+    m->nslots = 16;
+    while (m->nslots < 2 * nexts) {
+        m->nslots <<= 1;
+    }
+    m->slots = calloc(m->nslots, sizeof(*m->slots));
+    if (!m->slots) {
+        mimetypes_free(m);
+        return NULL;
+    }
 
-        // ignore comments/blank lines 
-        if (*p == '#' || *p == '\0' || *p == '\n')
-            continue;
+    /* Scan lines for rules, inserting each extension */
+    char *line_state;
+    for (char *line = m->data ? strtok_r(m->data, "\n", &line_state) : NULL;
+         line; line = strtok_r(NULL, "\n", &line_state)) {
+        char *state;
 
         // first token is mimetype; rest are extensions 
-        char *mt = strtok(p, " \t\r\n");
-        if (!mt) continue;
-
-        while ((token = strtok(NULL, " \t\r\n")) != NULL) {
-            // case-insensitive compare: ext vs token 
-            const char *e = ext;
-            const char *t = token;
-            int same = 1;
-            while (*e && *t) {
-                if (tolower((unsigned char)*e) != tolower((unsigned char)*t)) {
-                    same = 0; break;
-                }
-                e++; t++;
+        char *mt = strtok_r(line, " \t\r", &state);
+        if (!mt || *mt == '#') continue;
+
+        for (char *ext; (ext = strtok_r(NULL, " \t\r", &state)) != NULL; ) {
+            for (char *c = ext; *c; c++) {
+                *c = tolower((unsigned char)*c);
             }
-            if (same && *e == '\0' && *t == '\0') {
-                mimetype = mt;         // point into buffer; we'll strdup below 
-                goto done;
+
+            size_t i = hash_string(ext) & (m->nslots - 1);
+            while (m->slots[i].ext && !streq(m->slots[i].ext, ext)) {
+                i = (i + 1) & (m->nslots - 1);
+            }
+            if (!m->slots[i].ext) {
+                m->slots[i].ext      = ext;
+                m->slots[i].mimetype = mt;
             }
         }
     }
-   
-fail:
-    mimetype = DefaultMimeType;
 
-done:
-    if (fs) {
-        fclose(fs);
+    return m;
+}
+
+/**
+ * Load MimeTypesPath into the lookup table if it has not been loaded yet or
+ * a reload was requested (see reload_mimetypes).
+ *
+ * This is called once at startup, and then checked cheaply on every lookup.
+ **/
+void
+load_mimetypes(void)
+{
+    if (__atomic_load_n(&MimeTypes, __ATOMIC_ACQUIRE) && !MimeTypesReload) {
+        return;
+    }
+
+    struct mimetypes *old = NULL;
+    bool reloaded = false;
+
+    pthread_mutex_lock(&MimeTypesLock);
+    if (!MimeTypes || MimeTypesReload) {
+        MimeTypesReload = 0;
+
+        struct mimetypes *m = mimetypes_parse();
+        if (m) {
+            pthread_rwlock_wrlock(&MimeTypesUse);
+            old      = MimeTypes;
+            reloaded = old != NULL;
+            __atomic_store_n(&MimeTypes, m, __ATOMIC_RELEASE);
+            pthread_rwlock_unlock(&MimeTypesUse);
+            debug("Loaded mimetypes from %s", MimeTypesPath);
+        }
+    }
+    pthread_mutex_unlock(&MimeTypesLock);
+
+    /* No lookup can still be using the old table */
+    mimetypes_free(old);
+
+    /* Cached responses carry the old Content-Type */
+    if (reloaded) {
+        cache_flush();
     }
-    return strdup(mimetype);
+}
+
+/**
+ * Request that MimeTypesPath be reloaded before the next lookup (SIGHUP
+ * handler).
+ **/
+void
+reload_mimetypes(int signum)
+{
+    (void)signum;
+    MimeTypesReload = 1;
+}
+
+/**
+ * Determine mime-type from file extension
+ *
+ * This function first finds the file's extension and then looks it up
+ * (case-insensitively) in the table loaded from MimeTypesPath.
+ *
+ * If no extension exists or no matching mimetype is found, then return
+ * DefaultMimeType.
+ *
+ * This function returns a string allocated from the request's arena (or
+ * DefaultMimeType), so it stays valid for the request even if the
+ * mimetypes are reloaded meanwhile.
+ **/
+const char *
+determine_mimetype(struct request *r)
+{
+    const char *mimetype = DefaultMimeType;
+    struct mimetypes *m;
+    const char *ext;
+    char lower[NAME_MAX + 1];
+    size_t length;
+
+    /* Find file extension */
+    ext = strrchr(r->path, '.');          // last '.' 
+    if (!ext || !*(ext + 1) || strchr(ext, '/')) {
+        return DefaultMimeType;        // no extension 
+    }
+    ext++;                             // skip '.' 
+
+    /* Table extensions are lowercase, so match a lowercase copy */
+    length = strlen(ext);
+    if (length > NAME_MAX) {
+        return DefaultMimeType;
+    }
+    for (size_t i = 0; i <= length; i++) {
+        lower[i] = tolower((unsigned char)ext[i]);
+    }
+
+    /* Look up extension in table, copying the match out of it */
+    load_mimetypes();
+    pthread_rwlock_rdlock(&MimeTypesUse);
+    m = MimeTypes;
+    for (size_t i = m ? hash_string(lower) & (m->nslots - 1) : 0; m && m->slots[i].ext; i = (i + 1) & (m->nslots - 1)) {
+        if (streq(m->slots[i].ext, lower)) {
+            mimetype = request_strdup(r, m->slots[i].mimetype);
+            break;
+        }
+    }
+    pthread_rwlock_unlock(&MimeTypesUse);
+
+    return mimetype ? mimetype : DefaultMimeType;
 }
 
 /**
@@ -146,6 +289,9 @@ determine_request_path(const char *uri)
  *  2. REQUEST_CGI:    Path is an executable file.
  *  3. REQUEST_FILE:   Path is a readable file.
  *  4. REQUEST_BAD:    Everything else.
+ *
+ * (REQUEST_PLUGIN is decided by URI prefix before any path is resolved;
+ * see plugin_lookup.)
  **/
 request_type
 determine_request_type(const char *path)
@@ -184,12 +330,24 @@ http_status_string(http_status status)
     case HTTP_STATUS_OK:
         status_string = "200 OK";
         break;
+    case HTTP_STATUS_PARTIAL_CONTENT:
+        status_string = "206 Partial Content";
+        break;
+    case HTTP_STATUS_NOT_MODIFIED:
+        status_string = "304 Not Modified";
+        break;
     case HTTP_STATUS_BAD_REQUEST:
         status_string = "400 Bad Request";
         break;
     case HTTP_STATUS_NOT_FOUND:
         status_string = "404 Not Found";
         break;
+    case HTTP_STATUS_PAYLOAD_TOO_LARGE:
+        status_string = "413 Payload Too Large";
+        break;
+    case HTTP_STATUS_RANGE_NOT_SATISFIABLE:
+        status_string = "416 Range Not Satisfiable";
+        break;
     case HTTP_STATUS_INTERNAL_SERVER_ERROR:
         status_string = "500 Internal Server Error";
         break;
@@ -201,6 +359,144 @@ http_status_string(http_status status)
     return status_string;
 }
 
+/**
+ * Return current time as an HTTP date, for the Date header.
+ *
+ * The string is only formatted again once the second changes.  Each thread
+ * keeps its own copy, so this needs no locking and the string stays valid
+ * until the thread's next call.
+ **/
+const char *
+http_date(void)
+{
+    static __thread time_t DateTime = -1;
+    static __thread char   DateString[sizeof("Thu, 01 Jan 1970 00:00:00 GMT")];
+    time_t now = time(NULL);
+    struct tm tm;
+
+    if (now != DateTime) {
+        if (!gmtime_r(&now, &tm) ||
+            strftime(DateString, sizeof(DateString), "%a, %d %b %Y %H:%M:%S GMT", &tm) == 0) {
+            DateString[0] = '\0';
+        }
+        DateTime = now;
+    }
+    return DateString;
+}
+
+/* Children that had not exited yet when they were reaped (protected by
+ * ReapLock) */
+
+static pthread_mutex_t ReapLock = PTHREAD_MUTEX_INITIALIZER;
+static pid_t           ReapPending[REAP_MAX];
+static size_t          NReapPending = 0;
+
+/**
+ * Reap children left over by earlier calls to reap_child that have exited
+ * since.
+ **/
+static void
+reap_pending(void)
+{
+    pthread_mutex_lock(&ReapLock);
+    for (size_t i = 0; i < NReapPending; ) {
+        if (waitpid(ReapPending[i], NULL, WNOHANG) != 0) {
+            ReapPending[i] = ReapPending[--NReapPending];
+        } else {
+            i++;
+        }
+    }
+    pthread_mutex_unlock(&ReapLock);
+}
+
+/**
+ * Reap child process without waiting for it: if it has not exited yet, it
+ * is reaped by a later spawn_script instead (or, if REAP_MAX children are
+ * already pending, waited for after all).
+ **/
+void
+reap_child(pid_t pid)
+{
+    if (waitpid(pid, NULL, WNOHANG) != 0) {
+        return;         /* Reaped (or already reaped by the kernel) */
+    }
+
+    pthread_mutex_lock(&ReapLock);
+    bool pending = NReapPending < REAP_MAX;
+    if (pending) {
+        ReapPending[NReapPending++] = pid;
+    }
+    pthread_mutex_unlock(&ReapLock);
+
+    if (!pending) {
+        waitpid(pid, NULL, 0);
+    }
+}
+
+/**
+ * Start script at path with environment envp, its standard output connected
+ * to out, and its standard input to in (or /dev/null if in is -1).
+ *
+ * The script is started with posix_spawn(3), which does not copy the
+ * server's address space as fork(2) does, so spawning stays cheap however
+ * large the server grows.  Scripts never hold client connections (or other
+ * server descriptors) open: every descriptor the server opens is
+ * close-on-exec, and where glibc allows (2.34 and later) any other is
+ * closed in the child as well.  SIGPIPE gets its default action back, and
+ * scripts without an interpreter line are run through /bin/sh.
+ *
+ * Returns the child's pid, or -1 on error (with errno set).
+ **/
+pid_t
+spawn_script(const char *path, char **envp, int in, int out)
+{
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t defaults;
+    char *argv[]   = {(char *)path, NULL};
+    char *shargv[] = {"/bin/sh", (char *)path, NULL};
+    pid_t pid = -1;
+    int status;
+
+    reap_pending();
+
+    if ((status = posix_spawn_file_actions_init(&actions)) != 0) {
+        errno = status;
+        return -1;
+    }
+    if ((status = posix_spawnattr_init(&attr)) != 0) {
+        posix_spawn_file_actions_destroy(&actions);
+        errno = status;
+        return -1;
+    }
+
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGPIPE);
+    status = posix_spawnattr_setsigdefault(&attr, &defaults);
+    if (!status) status = posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF);
+    if (!status) status = in >= 0 ? posix_spawn_file_actions_adddup2(&actions, in, STDIN_FILENO)
+                                  : posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    if (!status) status = posix_spawn_file_actions_adddup2(&actions, out, STDOUT_FILENO);
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 34)
+    if (!status) status = posix_spawn_file_actions_addclosefrom_np(&actions, STDERR_FILENO + 1);
+#endif
+
+    if (!status) {
+        status = posix_spawn(&pid, path, &actions, &attr, argv, envp);
+        if (status == ENOEXEC) {
+            status = posix_spawn(&pid, "/bin/sh", &actions, &attr, shargv, envp);
+        }
+    }
+
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    if (status) {
+        errno = status;
+        return -1;
+    }
+    return pid;
+}
+
 /**
  * Advance string pointer pass all nonwhitespace characters
  **/
@@ -0,0 +1,184 @@
+/* watch.c: Filesystem Change Notification */
+
+#include "mainServer.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <string.h>
+
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#define WATCH_EVENTS    (IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_DELETE_SELF | \
+                         IN_MODIFY | IN_MOVE_SELF | IN_MOVED_FROM | IN_MOVED_TO)
+#define WATCH_HANDLERS  4       /* Maximum number of subscribers */
+
+/**
+ * Watched directory.
+ **/
+struct watch {
+    int   wd;                   /* inotify watch descriptor */
+    char *dir;                  /* Path of directory */
+};
+
+/* Watch state (shared by all threads, protected by WatchLock) */
+
+static pthread_mutex_t WatchLock = PTHREAD_MUTEX_INITIALIZER;
+static int             WatchFd   = -1;
+static struct watch   *Watches   = NULL;
+static size_t          NWatches  = 0;
+static watch_handler   Handlers[WATCH_HANDLERS];
+static size_t          NHandlers = 0;
+
+/**
+ * Register handler to be called with the path of every file or directory
+ * that changes under a watched directory.  A NULL path means changes may
+ * have been missed and everything must be considered stale.
+ **/
+void
+watch_subscribe(watch_handler handler)
+{
+    pthread_mutex_lock(&WatchLock);
+    if (NHandlers < WATCH_HANDLERS) {
+        Handlers[NHandlers++] = handler;
+    }
+    pthread_mutex_unlock(&WatchLock);
+}
+
+/**
+ * Start watching directory for changes (a no-op if it is already watched).
+ *
+ * Returns 0 on success, and -1 on error (in which case callers must not rely
+ * on change notification for files in the directory).
+ **/
+int
+watch_directory(const char *dir)
+{
+    int status = -1;
+
+    pthread_mutex_lock(&WatchLock);
+
+    if (WatchFd < 0) {
+        WatchFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (WatchFd < 0) {
+            goto done;
+        }
+    }
+
+    int wd = inotify_add_watch(WatchFd, dir, WATCH_EVENTS | IN_ONLYDIR);
+    if (wd < 0) {
+        goto done;
+    }
+
+    for (size_t i = 0; i < NWatches; i++) {
+        if (Watches[i].wd == wd) {
+            status = 0;
+            goto done;
+        }
+    }
+
+    struct watch *watches = realloc(Watches, (NWatches + 1) * sizeof(struct watch));
+    if (!watches) {
+        goto done;
+    }
+    Watches = watches;
+    Watches[NWatches].wd  = wd;
+    Watches[NWatches].dir = strdup(dir);
+    if (!Watches[NWatches].dir) {
+        goto done;
+    }
+    NWatches++;
+    status = 0;
+
+done:
+    pthread_mutex_unlock(&WatchLock);
+    return status;
+}
+
+/**
+ * Start watching the directory containing path, so changes to (or
+ * replacement of) the file itself are noticed.
+ **/
+int
+watch_parent(const char *path)
+{
+    char dir[PATH_MAX];
+    const char *slash = strrchr(path, '/');
+    size_t length = slash ? (size_t)(slash - path) : 0;
+
+    if (length == 0 || length >= sizeof(dir)) {
+        return -1;
+    }
+    memcpy(dir, path, length);
+    dir[length] = '\0';
+    return watch_directory(dir);
+}
+
+/**
+ * Notify subscribers about changed path.
+ **/
+static void
+watch_notify(const char *path)
+{
+    for (size_t i = 0; i < NHandlers; i++) {
+        Handlers[i](path);
+    }
+}
+
+/**
+ * Process pending change events without blocking.
+ *
+ * inotify queues events as the changes happen, so calling this right before
+ * consulting a cache guarantees the cache never serves a file that was
+ * changed before the call.
+ **/
+void
+watch_poll(void)
+{
+    char buffer[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    char path[PATH_MAX];
+    ssize_t nread;
+
+    pthread_mutex_lock(&WatchLock);
+
+    while (WatchFd >= 0 && (nread = read(WatchFd, buffer, sizeof(buffer))) > 0) {
+        for (char *p = buffer; p < buffer + nread; ) {
+            struct inotify_event *event = (struct inotify_event *)p;
+            p += sizeof(struct inotify_event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                watch_notify(NULL);
+                continue;
+            }
+
+            for (size_t i = 0; i < NWatches; i++) {
+                if (Watches[i].wd != event->wd) {
+                    continue;
+                }
+                if (event->len > 0) {
+                    snprintf(path, sizeof(path), "%s/%s", Watches[i].dir, event->name);
+                    watch_notify(path);
+                } else {
+                    watch_notify(Watches[i].dir);
+                }
+                break;
+            }
+
+            /* Forget directories that went away */
+            if (event->mask & IN_IGNORED) {
+                for (size_t i = 0; i < NWatches; i++) {
+                    if (Watches[i].wd == event->wd) {
+                        free(Watches[i].dir);
+                        Watches[i] = Watches[--NWatches];
+                        break;
+                    }
+                }
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&WatchLock);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,597 @@
+/* worker.c: Persistent CGI Workers */
+
+#include "mainServer.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/**
+ * Worker: long-lived script process serving one request at a time over a
+ * socket connected to its standard input and output.
+ **/
+struct worker {
+    pid_t pid;                      /* Process (or 0 if not running) */
+    int   fd;                       /* Server end of socket (or -1) */
+    bool  busy;                     /* Whether a request (or the monitor) holds it */
+    bool  respawn;                  /* Whether it died and is to be started again */
+    time_t started;                 /* When the process was started */
+    struct worker_pool *pool;       /* Pool the slot belongs to */
+
+    /* Answer being received (only touched by the request holding it) */
+    char   prefix[24];              /* Length prefix read so far */
+    size_t nprefix;
+    bool   sized;                   /* Whether the length prefix is complete */
+    unsigned long long nleft;       /* Output bytes plus trailing comma still to come */
+    FILE  *out;                     /* Output received so far */
+    char  *output;
+    size_t noutput;
+};
+
+/**
+ * Workers running one script.
+ **/
+struct worker_pool {
+    char               *path;       /* Resolved script path */
+    struct worker      *workers;    /* CgiWorkers slots */
+    struct request     *waiters;    /* Requests waiting while all are busy */
+    struct worker_pool *next;
+};
+
+/* Pools (shared by all threads, protected by WorkerLock) */
+
+static pthread_mutex_t     WorkerLock  = PTHREAD_MUTEX_INITIALIZER;
+static struct worker_pool *WorkerPools = NULL;
+static size_t              NWorkerPools = 0;
+
+/* Monitor thread, woken through WorkerWake when workers go idle */
+
+static pthread_once_t      WorkerOnce  = PTHREAD_ONCE_INIT;
+static int                 WorkerWake  = -1;
+
+/**
+ * Return whether script at path is served by persistent workers (its name
+ * ends in WORKER_SUFFIX and workers are enabled).
+ **/
+bool
+worker_script(const char *path)
+{
+    size_t length  = strlen(path);
+    size_t nsuffix = strlen(WORKER_SUFFIX);
+
+    return CgiWorkers > 0 && length > nsuffix && streq(path + length - nsuffix, WORKER_SUFFIX);
+}
+
+/**
+ * Start worker running script at path, with both its standard input and
+ * output connected to one end of a socket pair (see spawn_script).
+ *
+ * Returns 0 on success, -1 on error.
+ **/
+static int
+worker_spawn(const char *path, struct worker *w)
+{
+    extern char **environ;
+    int fds[2];
+    pid_t pid;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0) {
+        return -1;
+    }
+
+    pid = spawn_script(path, environ, fds[1], fds[1]);
+    close(fds[1]);
+    if (pid < 0) {
+        close(fds[0]);
+        return -1;
+    }
+
+    debug("Started worker %d for %s", pid, path);
+    w->pid     = pid;
+    w->fd      = fds[0];
+    w->started = time(NULL);
+    return 0;
+}
+
+/**
+ * Kill and reap worker, leaving its slot empty.
+ **/
+static void
+worker_stop(struct worker *w)
+{
+    if (w->pid > 0) {
+        debug("Stopping worker %d", w->pid);
+        close(w->fd);
+        kill(w->pid, SIGKILL);
+        waitpid(w->pid, NULL, 0);
+    }
+    w->pid = 0;
+    w->fd  = -1;
+}
+
+/**
+ * Add pool for script at path (WorkerLock must be held).
+ **/
+static struct worker_pool *
+worker_pool(const char *path)
+{
+    struct worker_pool *p = calloc(1, sizeof(struct worker_pool));
+
+    if (!p || !(p->path = strdup(path)) ||
+        !(p->workers = calloc(CgiWorkers, sizeof(struct worker)))) {
+        if (p) free(p->path);
+        free(p);
+        return NULL;
+    }
+    for (long i = 0; i < CgiWorkers; i++) {
+        p->workers[i].fd   = -1;
+        p->workers[i].pool = p;
+    }
+
+    p->next = WorkerPools;
+    WorkerPools = p;
+    NWorkerPools++;
+    return p;
+}
+
+/**
+ * Claim an idle worker slot for script at path (stored in w), or if all are
+ * busy, queue request to be woken up once one is released (worker_fd
+ * becomes readable; see worker_ready).
+ *
+ * Running idle workers are preferred, so processes are only started (by
+ * the caller) when every running one is busy.  Returns 0 if a slot was
+ * claimed, 1 if the request waits, and -1 on error.
+ **/
+static int
+worker_acquire(struct request *r, const char *path, struct worker **w)
+{
+    struct worker_pool *p;
+    int status = -1;
+    int fd;
+
+    pthread_mutex_lock(&WorkerLock);
+    for (p = WorkerPools; p && !streq(p->path, path); p = p->next);
+    if (!p && !(p = worker_pool(path))) {
+        pthread_mutex_unlock(&WorkerLock);
+        return -1;
+    }
+
+    *w = NULL;
+    for (long i = 0; i < CgiWorkers; i++) {
+        struct worker *c = &p->workers[i];
+        if (!c->busy && (!*w || ((*w)->pid == 0 && c->pid > 0))) {
+            *w = c;
+        }
+    }
+    if (*w) {
+        (*w)->busy = true;
+        status = 0;
+    } else if ((fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) >= 0) {
+        debug("Waiting for a worker of %s", path);
+        r->worker_pool = p;
+        r->worker_fd   = fd;
+        r->worker_next = p->waiters;
+        p->waiters     = r;
+        status = 1;
+    }
+    pthread_mutex_unlock(&WorkerLock);
+    return status;
+}
+
+/**
+ * Return worker slot to its pool and wake up the requests waiting for one
+ * (they all try again, and those that lose out queue up anew).
+ **/
+static void
+worker_idle(struct worker *w)
+{
+    pthread_mutex_lock(&WorkerLock);
+    w->busy = false;
+    while (w->pool->waiters) {
+        struct request *r = w->pool->waiters;
+        w->pool->waiters = r->worker_next;
+        r->worker_pool   = NULL;
+        r->worker_next   = NULL;
+        eventfd_write(r->worker_fd, 1);
+    }
+    pthread_mutex_unlock(&WorkerLock);
+
+    if (WorkerWake >= 0) {
+        eventfd_write(WorkerWake, 1);
+    }
+}
+
+/**
+ * Mark worker that died as one to be started again by the monitor, unless
+ * it died right after starting (so a script that cannot run is not
+ * restarted over and over; its slot is filled on demand instead).
+ **/
+static void
+worker_died(struct worker *w)
+{
+    w->respawn = time(NULL) - w->started >= WORKER_RESPAWN;
+}
+
+/**
+ * Monitor thread: watch the sockets of idle workers, and reap any worker
+ * that exits (or writes while it has no request) and start it again right
+ * away, rather than when the next request finds it dead.  Workers that die
+ * while serving a request are reaped by that request and started again
+ * here too.
+ **/
+static void *
+worker_monitor(void *arg)
+{
+    struct pollfd  *fds     = NULL;
+    struct worker **watched = NULL;
+    pid_t          *pids    = NULL;
+    size_t          capacity = 0;
+
+    (void)arg;
+    while (true) {
+        struct worker *revive = NULL;
+        size_t n = 1;
+        eventfd_t value;
+
+        /* Collect idle workers, claiming one that is to be started again */
+        pthread_mutex_lock(&WorkerLock);
+        if (capacity < 1 + NWorkerPools * CgiWorkers) {
+            capacity = 1 + NWorkerPools * CgiWorkers;
+            fds     = realloc(fds, capacity * sizeof(struct pollfd));
+            watched = realloc(watched, capacity * sizeof(struct worker *));
+            pids    = realloc(pids, capacity * sizeof(pid_t));
+            if (!fds || !watched || !pids) {
+                fatal("Unable to allocate worker monitor: %s", strerror(errno));
+            }
+        }
+        fds[0] = (struct pollfd){.fd = WorkerWake, .events = POLLIN};
+        for (struct worker_pool *p = WorkerPools; p; p = p->next) {
+            for (long i = 0; i < CgiWorkers; i++) {
+                struct worker *w = &p->workers[i];
+                if (w->busy) {
+                    continue;
+                }
+                if (w->pid > 0) {
+                    fds[n]     = (struct pollfd){.fd = w->fd, .events = POLLIN};
+                    watched[n] = w;
+                    pids[n]    = w->pid;
+                    n++;
+                } else if (w->respawn && !revive) {
+                    w->respawn = false;
+                    w->busy    = true;
+                    revive     = w;
+                }
+            }
+        }
+        pthread_mutex_unlock(&WorkerLock);
+
+        if (revive) {
+            if (worker_spawn(revive->pool->path, revive) < 0) {
+                log("Unable to restart worker for %s: %s", revive->pool->path, strerror(errno));
+            }
+            worker_idle(revive);
+            continue;
+        }
+
+        if (poll(fds, n, -1) < 0) {
+            continue;
+        }
+        if (fds[0].revents) {
+            eventfd_read(WorkerWake, &value);
+        }
+
+        /* Reap workers that hung up (skipping slots claimed meanwhile) */
+        pthread_mutex_lock(&WorkerLock);
+        for (size_t i = 1; i < n; i++) {
+            struct worker *w = watched[i];
+            if (fds[i].revents && !w->busy && w->pid == pids[i]) {
+                log("Worker %d for %s exited while idle", w->pid, w->pool->path);
+                worker_stop(w);
+                worker_died(w);
+            }
+        }
+        pthread_mutex_unlock(&WorkerLock);
+    }
+
+    return NULL;
+}
+
+/**
+ * Start monitor thread (once per process; see worker_monitor).  Without it,
+ * dead workers are still noticed, but only by the next request sent to them.
+ **/
+static void
+worker_monitor_start(void)
+{
+    pthread_t thread;
+    int status;
+
+    WorkerWake = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (WorkerWake < 0) {
+        log("Unable to create worker monitor: %s", strerror(errno));
+        return;
+    }
+    status = pthread_create(&thread, NULL, worker_monitor, NULL);
+    if (status != 0) {
+        log("Unable to create worker monitor: %s", strerror(status));
+        close(WorkerWake);
+        WorkerWake = -1;
+        return;
+    }
+    pthread_detach(thread);
+}
+
+/**
+ * Send request frame to worker: a netstring ("<length>:<data>,") holding
+ * the request's CGI variables.
+ *
+ * An idle worker is blocked reading its next frame, and frames are much
+ * smaller than a socket buffer, so sending never waits: a worker whose
+ * socket is full is broken.
+ *
+ * Returns 0 on success, -1 on error.
+ **/
+static int
+worker_send(struct worker *w, const char *vars, size_t nvars)
+{
+    char prefix[32];
+    struct iovec iov[3] = {
+        {prefix, snprintf(prefix, sizeof(prefix), "%zu:", nvars)},
+        {(char *)vars, nvars},
+        {",", 1},
+    };
+    struct msghdr msg = {.msg_iov = iov, .msg_iovlen = 3};
+
+    while (msg.msg_iovlen > 0) {
+        ssize_t nwritten = sendmsg(w->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (nwritten < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        while (msg.msg_iovlen > 0 && (size_t)nwritten >= msg.msg_iov->iov_len) {
+            nwritten -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + nwritten;
+            msg.msg_iov->iov_len -= nwritten;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Take data received from worker: first its answer's length prefix, then
+ * the output, which is copied to w->out, and the trailing comma.
+ *
+ * Returns 1 once the answer is complete, 0 if more is to come, and -1 if
+ * it is malformed.
+ **/
+static int
+worker_consume(struct worker *w, const char *data, size_t ndata)
+{
+    /* Read length prefix */
+    while (!w->sized && ndata > 0) {
+        char c = *data++;
+        ndata--;
+        if (c == ':' && w->nprefix > 0) {
+            w->prefix[w->nprefix] = '\0';
+            w->nleft = strtoull(w->prefix, NULL, 10) + 1;
+            w->sized = true;
+        } else if (c < '0' || c > '9' || w->nprefix == 19) {
+            return -1;
+        } else {
+            w->prefix[w->nprefix++] = c;
+        }
+    }
+    if (!w->sized) {
+        return 0;
+    }
+
+    /* Copy output, then check the trailing comma */
+    size_t nchunk = ndata < w->nleft ? ndata : w->nleft;
+    size_t nout   = nchunk == w->nleft ? nchunk - 1 : nchunk;
+    if (nout > 0 && fwrite(data, 1, nout, w->out) != nout) {
+        return -1;
+    }
+    if (nchunk == w->nleft && data[nchunk - 1] != ',') {
+        return -1;
+    }
+    w->nleft -= nchunk;
+    if (w->nleft > 0) {
+        return 0;
+    }
+
+    /* Workers answer one frame per request, so anything more is garbage */
+    return nchunk == ndata ? 1 : -1;
+}
+
+/**
+ * Run request through a persistent worker for its script (r->path).
+ *
+ * Instead of spawning the script for every request, up to CgiWorkers
+ * long-lived processes are kept per script (started on demand), each
+ * serving one request at a time over a Unix socket pair attached to its
+ * standard input and output.  The request's CGI variables (vars: nvars
+ * bytes of NUL-terminated NAME=value entries) are sent as a netstring, and
+ * the worker answers with a netstring holding the output a CGI script
+ * would have written, which is read as it arrives (see worker_receive).
+ * Nothing here blocks: while all of a script's workers are busy, the
+ * request waits for one to be released (see worker_ready), and is then
+ * handled again.
+ *
+ * Workers that die are reaped and started again by a monitor thread (see
+ * worker_monitor).  One that dies just before a request is sent to it is
+ * caught out when sending fails, and the request is retried once with a
+ * fresh process.
+ *
+ * Returns 0 once the request is sent (r->worker is set), 1 if it waits for
+ * a worker (r->worker_fd is set), and -1 on error.
+ **/
+int
+worker_start(struct request *r, const char *vars, size_t nvars)
+{
+    struct worker *w;
+    int status;
+
+    pthread_once(&WorkerOnce, worker_monitor_start);
+
+    status = worker_acquire(r, r->path, &w);
+    if (status != 0) {
+        return status;
+    }
+
+    for (int attempt = 0; attempt < 2; attempt++) {
+        if (w->pid == 0 && worker_spawn(w->pool->path, w) < 0) {
+            log("Unable to start worker for %s: %s", w->pool->path, strerror(errno));
+            break;
+        }
+        if (worker_send(w, vars, nvars) < 0) {
+            worker_stop(w);
+            continue;
+        }
+
+        w->out = open_memstream(&w->output, &w->noutput);
+        if (!w->out) {
+            worker_stop(w);
+            break;
+        }
+        w->nprefix = 0;
+        w->sized   = false;
+        r->worker  = w;
+        return 0;
+    }
+
+    worker_idle(w);
+    return -1;
+}
+
+/**
+ * Receive what the request's worker has answered so far, without waiting
+ * for more.
+ *
+ * Once the answer is complete, the output (to be freed by the caller) is
+ * stored in output and noutput, and the worker is released.  Workers that
+ * exit or answer with a malformed frame are killed and started again (see
+ * worker_monitor), and so are workers whose connection is dropped before
+ * their answer is in (see worker_release).
+ *
+ * Returns 1 once the output is complete, 0 if more is to come (wait as
+ * request_waits tells), and -1 on error.
+ **/
+int
+worker_receive(struct request *r, char **output, size_t *noutput)
+{
+    struct worker *w = r->worker;
+    char buffer[BUFSIZ];
+    int status = 0;
+
+    while (status == 0) {
+        ssize_t n = recv(w->fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        }
+        status = n > 0 ? worker_consume(w, buffer, n) : -1;
+    }
+
+    if (fclose(w->out) != 0) {
+        status = -1;
+    }
+    if (status < 0) {
+        log("Worker %d for %s failed", w->pid, w->pool->path);
+        worker_stop(w);
+        worker_died(w);
+        free(w->output);
+    } else {
+        *output  = w->output;
+        *noutput = w->noutput;
+    }
+    w->out    = NULL;
+    w->output = NULL;
+    r->worker = NULL;
+    worker_idle(w);
+    return status;
+}
+
+/**
+ * Return worker's socket, on which its answer arrives.
+ **/
+int
+worker_socket(const struct worker *w)
+{
+    return w->fd;
+}
+
+/**
+ * Return whether a worker the request waits for may be free (see
+ * worker_start), in which case the request is to be handled again.
+ **/
+bool
+worker_ready(struct request *r)
+{
+    eventfd_t value;
+
+    if (eventfd_read(r->worker_fd, &value) < 0) {
+        return false;
+    }
+    close(r->worker_fd);
+    r->worker_fd = -1;
+    return true;
+}
+
+/**
+ * Release request's part in the workers: stop waiting for one, or if its
+ * worker has not answered in full, kill the worker (its socket is left
+ * mid-frame) and release its slot.
+ **/
+void
+worker_release(struct request *r)
+{
+    struct worker *w = r->worker;
+
+    if (w) {
+        worker_stop(w);
+        worker_died(w);
+        fclose(w->out);
+        free(w->output);
+        w->out    = NULL;
+        w->output = NULL;
+        r->worker = NULL;
+        worker_idle(w);
+    }
+
+    if (r->worker_fd >= 0) {
+        pthread_mutex_lock(&WorkerLock);
+        if (r->worker_pool) {
+            struct request **link = &r->worker_pool->waiters;
+            while (*link && *link != r) {
+                link = &(*link)->worker_next;
+            }
+            if (*link) {
+                *link = r->worker_next;
+            }
+        }
+        pthread_mutex_unlock(&WorkerLock);
+
+        close(r->worker_fd);
+        r->worker_pool = NULL;
+        r->worker_fd   = -1;
+        r->worker_next = NULL;
+    }
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,7 @@
+#!/bin/sh
+
+echo "HTTP/1.0 200 OK"
+echo "Content-type: text/plain"
+echo
+
+ls -l /proc/$$/fd | sed -n 's/.* \([0-9]* -> .*\)/\1/p'
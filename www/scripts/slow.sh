@@ -0,0 +1,9 @@
+#!/bin/sh
+
+sleep 3
+
+echo "HTTP/1.0 200 OK"
+echo "Content-type: text/plain"
+echo
+
+echo done
@@ -0,0 +1,9 @@
+#!/bin/sh
+
+echo "HTTP/1.0 200 OK"
+echo "Content-type: text/plain"
+echo
+
+echo "CONTENT_TYPE=$CONTENT_TYPE"
+echo "CONTENT_LENGTH=$CONTENT_LENGTH"
+echo "Received $(wc -c) bytes"